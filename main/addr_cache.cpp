@@ -0,0 +1,201 @@
+#include "addr_cache.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+static const char* TAG = "ADDR";
+
+static uint32_t now_s() {
+	return static_cast<uint32_t>(esp_timer_get_time() / 1000000);
+}
+
+addr_cache::addr_cache() {
+	memset(m_entries, 0, sizeof(m_entries));
+	memset(m_used, 0, sizeof(m_used));
+	memset(m_by_nwk, EMPTY, sizeof(m_by_nwk));
+	memset(m_by_ieee, EMPTY, sizeof(m_by_ieee));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+addr_cache& addr_cache::instance() {
+	static addr_cache s_addr_cache;
+	return s_addr_cache;
+}
+
+size_t addr_cache::hash_nwk(uint16_t nwk) {
+	return (uint32_t(nwk) * 0x9E3779B1u) >> 24;
+}
+
+size_t addr_cache::hash_ieee(const uint8_t* ieee) {
+	uint64_t v;
+	memcpy(&v, ieee, sizeof(v));
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdull;
+	v ^= v >> 33;
+	return v & (INDEX_SIZE - 1);
+}
+
+int addr_cache::find_nwk_slot(uint16_t nwk) const {
+	for (size_t i = hash_nwk(nwk), n = 0; n < INDEX_SIZE; i = (i + 1) & (INDEX_SIZE - 1), ++n) {
+		auto idx = m_by_nwk[i];
+		if (idx == EMPTY)
+			return -1;
+		if (m_entries[idx].nwk == nwk)
+			return i;
+	}
+	return -1;
+}
+
+int addr_cache::find_ieee_slot(const uint8_t* ieee) const {
+	for (size_t i = hash_ieee(ieee), n = 0; n < INDEX_SIZE; i = (i + 1) & (INDEX_SIZE - 1), ++n) {
+		auto idx = m_by_ieee[i];
+		if (idx == EMPTY)
+			return -1;
+		if (memcmp(m_entries[idx].ieee, ieee, 8) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void addr_cache::index_insert(uint8_t* index, size_t hash, uint8_t idx) {
+	auto i = hash;
+	while (index[i] != EMPTY) {
+		i = (i + 1) & (INDEX_SIZE - 1);
+	}
+	index[i] = idx;
+}
+
+// Backward-shift deletion: later entries of the probe chain move up, so
+// lookups never need tombstones.
+void addr_cache::index_erase(uint8_t* index, size_t slot, bool by_nwk) {
+	auto hole = slot;
+	auto j = slot;
+	while (true) {
+		j = (j + 1) & (INDEX_SIZE - 1);
+		auto idx = index[j];
+		if (idx == EMPTY)
+			break;
+		auto home = by_nwk ? hash_nwk(m_entries[idx].nwk) : hash_ieee(m_entries[idx].ieee);
+		// distance from home to j vs from home to the hole
+		if (((j - home) & (INDEX_SIZE - 1)) >= ((j - hole) & (INDEX_SIZE - 1))) {
+			index[hole] = idx;
+			hole = j;
+		}
+	}
+	index[hole] = EMPTY;
+}
+
+void addr_cache::erase_entry(uint8_t idx) {
+	auto& e = m_entries[idx];
+	auto s = find_nwk_slot(e.nwk);
+	if (s >= 0 && m_by_nwk[s] == idx)
+		index_erase(m_by_nwk, s, true);
+	s = find_ieee_slot(e.ieee);
+	if (s >= 0)
+		index_erase(m_by_ieee, s, false);
+	m_used[idx] = false;
+}
+
+uint8_t addr_cache::alloc_entry() {
+	uint8_t oldest = 0;
+	for (uint8_t i = 0; i < CAPACITY; ++i) {
+		if (!m_used[i])
+			return i;
+		if (m_entries[i].last_seen < m_entries[oldest].last_seen)
+			oldest = i;
+	}
+	ESP_LOGD(TAG, "full, replace %04x", m_entries[oldest].nwk);
+	erase_entry(oldest);
+	return oldest;
+}
+
+addr_cache::entry_t* addr_cache::update_locked(const uint8_t* ieee, uint16_t nwk) {
+	auto ieee_slot = find_ieee_slot(ieee);
+	auto nwk_slot = find_nwk_slot(nwk);
+	// nwk now belongs to another device (address conflict resolution)
+	if (nwk_slot >= 0 && (ieee_slot < 0 || m_by_nwk[nwk_slot] != m_by_ieee[ieee_slot])) {
+		erase_entry(m_by_nwk[nwk_slot]);
+		ieee_slot = find_ieee_slot(ieee);
+		nwk_slot = -1;
+	}
+	if (ieee_slot >= 0) {
+		auto idx = m_by_ieee[ieee_slot];
+		auto& e = m_entries[idx];
+		if (nwk_slot < 0) {
+			auto s = find_nwk_slot(e.nwk);
+			if (s >= 0 && m_by_nwk[s] == idx)
+				index_erase(m_by_nwk, s, true);
+			e.nwk = nwk;
+			index_insert(m_by_nwk, hash_nwk(nwk), idx);
+		}
+		e.last_seen = now_s();
+		return &e;
+	}
+
+	auto idx = alloc_entry();
+	auto& e = m_entries[idx];
+	memset(&e, 0, sizeof(e));
+	memcpy(e.ieee, ieee, 8);
+	e.nwk = nwk;
+	e.last_seen = now_s();
+	m_used[idx] = true;
+	index_insert(m_by_nwk, hash_nwk(nwk), idx);
+	index_insert(m_by_ieee, hash_ieee(ieee), idx);
+	return &e;
+}
+
+void addr_cache::update_int(const uint8_t* ieee, uint16_t nwk, const uint8_t* capability) {
+	if (nwk >= 0xfff8) {
+		return; // broadcast / invalid
+	}
+	utils::sem_lock l(m_sem);
+	auto e = update_locked(ieee, nwk);
+	if (capability) {
+		e->capability = *capability;
+		e->flags |= FLAG_CAPABILITY;
+	}
+}
+
+void addr_cache::on_rx_int(uint16_t nwk, bool direct, uint8_t lqi, int8_t rssi) {
+	utils::sem_lock l(m_sem);
+	auto s = find_nwk_slot(nwk);
+	if (s < 0) {
+		return;
+	}
+	auto& e = m_entries[m_by_nwk[s]];
+	e.lqi = lqi;
+	e.rssi = rssi;
+	e.last_seen = now_s();
+	if (direct)
+		e.flags |= FLAG_NEIGHBOR;
+	else
+		e.flags &= ~FLAG_NEIGHBOR;
+}
+
+void addr_cache::remove_int(const uint8_t* ieee) {
+	utils::sem_lock l(m_sem);
+	auto s = find_ieee_slot(ieee);
+	if (s >= 0) {
+		erase_entry(m_by_ieee[s]);
+	}
+}
+
+bool addr_cache::find_by_nwk_int(uint16_t nwk, entry_t& out) {
+	utils::sem_lock l(m_sem);
+	auto s = find_nwk_slot(nwk);
+	if (s < 0)
+		return false;
+	out = m_entries[m_by_nwk[s]];
+	return true;
+}
+
+bool addr_cache::find_by_ieee_int(const uint8_t* ieee, entry_t& out) {
+	utils::sem_lock l(m_sem);
+	auto s = find_ieee_slot(ieee);
+	if (s < 0)
+		return false;
+	out = m_entries[m_by_ieee[s]];
+	return true;
+}
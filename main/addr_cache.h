@@ -0,0 +1,82 @@
+#pragma once
+#include "zboss_decl.h"
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// IEEE <-> NWK address map of the devices seen by the coordinator.
+//
+// Fed from the ZBOSS context (device announcements, updates, leaves, address
+// responses and APS indications) and read by the NWK_GET_* commands. Both
+// directions are open-addressing hash indexes over one entry table, so a
+// lookup is a hash and a probe or two. When the table is full the entry
+// heard from longest ago is replaced.
+class addr_cache {
+public:
+	enum flags_t : uint8_t {
+		FLAG_CAPABILITY = 0x01,   /*!< capability is known (device announcement) */
+		FLAG_NEIGHBOR = 0x02,     /*!< last frame was received directly from the device */
+	};
+	struct entry_t {
+		uint8_t ieee[8];
+		uint16_t nwk;
+		uint8_t capability;       /*!< MAC capability flags */
+		uint8_t lqi;              /*!< of the last frame from the device */
+		int8_t rssi;
+		uint8_t flags;
+		uint32_t last_seen;       /*!< seconds since boot */
+	};
+
+	static constexpr size_t CAPACITY = 128;
+
+private:
+	static constexpr size_t INDEX_SIZE = 256;
+	static constexpr uint8_t EMPTY = 0xFF;
+	static_assert(CAPACITY < EMPTY && (INDEX_SIZE & (INDEX_SIZE - 1)) == 0 && INDEX_SIZE >= 2 * CAPACITY);
+
+	addr_cache();
+	static addr_cache& instance();
+
+	entry_t m_entries[CAPACITY];
+	bool m_used[CAPACITY];
+	uint8_t m_by_nwk[INDEX_SIZE];
+	uint8_t m_by_ieee[INDEX_SIZE];
+	SemaphoreHandle_t m_sem;
+
+	static size_t hash_nwk(uint16_t nwk);
+	static size_t hash_ieee(const uint8_t* ieee);
+
+	int find_nwk_slot(uint16_t nwk) const;
+	int find_ieee_slot(const uint8_t* ieee) const;
+	void index_insert(uint8_t* index, size_t hash, uint8_t idx);
+	void index_erase(uint8_t* index, size_t slot, bool by_nwk);
+	void erase_entry(uint8_t idx);
+	uint8_t alloc_entry();
+	entry_t* update_locked(const uint8_t* ieee, uint16_t nwk);
+
+	void update_int(const uint8_t* ieee, uint16_t nwk, const uint8_t* capability);
+	void on_rx_int(uint16_t nwk, bool direct, uint8_t lqi, int8_t rssi);
+	void remove_int(const uint8_t* ieee);
+	bool find_by_nwk_int(uint16_t nwk, entry_t& out);
+	bool find_by_ieee_int(const uint8_t* ieee, entry_t& out);
+
+public:
+	// Records ieee <-> nwk; capability may be null when not known.
+	static void update(const uint8_t* ieee, uint16_t nwk, const uint8_t* capability = nullptr) {
+		instance().update_int(ieee, nwk, capability);
+	}
+	// Link quality of a frame from nwk; direct when it was not relayed.
+	static void on_rx(uint16_t nwk, bool direct, uint8_t lqi, int8_t rssi) {
+		instance().on_rx_int(nwk, direct, lqi, rssi);
+	}
+	static void remove(const uint8_t* ieee) { instance().remove_int(ieee); }
+
+	static bool find_by_nwk(uint16_t nwk, entry_t& out) {
+		return instance().find_by_nwk_int(nwk, out);
+	}
+	static bool find_by_ieee(const uint8_t* ieee, entry_t& out) {
+		return instance().find_by_ieee_int(ieee, out);
+	}
+};
@@ -58,6 +58,11 @@ esp_err_t app::process_event(const ctx_t& ctx) {
     case EVENT_RESET:
       esp_restart();
       break;
+    case EVENT_SOFT_RESET:
+      // everything received before the reset request is processed by now
+      protocol::reset();
+      zb_ncp::soft_reset();
+      break;
     default:
       break;
   }
@@ -10,6 +10,7 @@ public:
 	   EVENT_INPUT,                /*!< Input event from NCP to host */
 	   EVENT_OUTPUT,               /*!< Output event from host to NCP */
 	   EVENT_RESET,                /*!< Reset event from host to NCP */
+	   EVENT_SOFT_RESET,           /*!< Host session reset, the stack and the link stay up */
 	};
 	struct ctx_t {
 		event_t event;	/*!< The event between the host and NCP */
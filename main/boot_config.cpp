@@ -0,0 +1,55 @@
+#include "boot_config.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <cstring>
+
+static const char* TAG = "BOOT";
+
+static const char* NVS_NAMESPACE = "boot";
+static const char* NVS_KEY_CONFIG = "config";
+
+bool boot_config::matches(const config_t& config) {
+	nvs_handle_t h;
+	if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+		return false;
+	}
+	config_t stored;
+	size_t size = sizeof(stored);
+	auto ret = nvs_get_blob(h, NVS_KEY_CONFIG, &stored, &size);
+	nvs_close(h);
+	return ret == ESP_OK && size == sizeof(stored) && memcmp(&stored, &config, sizeof(stored)) == 0;
+}
+
+esp_err_t boot_config::save(const config_t& config) {
+	nvs_handle_t h;
+	auto ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h);
+	if (ret != ESP_OK) {
+		return ret;
+	}
+	ret = nvs_set_blob(h, NVS_KEY_CONFIG, &config, sizeof(config));
+	if (ret == ESP_OK) {
+		ret = nvs_commit(h);
+	}
+	nvs_close(h);
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "config not stored: %d", ret);
+	}
+	return ret;
+}
+
+void boot_config::clear() {
+	nvs_handle_t h;
+	if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+		return;
+	}
+	nvs_erase_key(h, NVS_KEY_CONFIG);
+	nvs_commit(h);
+	nvs_close(h);
+}
+
+void boot_config::network_ready(bool warm) {
+	ESP_LOGI(TAG, "network ready after %lu ms (%s start)",
+		(unsigned long)(esp_timer_get_time() / 1000), warm ? "warm" : "cold");
+}
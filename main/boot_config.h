@@ -0,0 +1,34 @@
+#pragma once
+#include <esp_err.h>
+#include <cstddef>
+#include <cstdint>
+
+// Network configuration the coordinator was last formed with, kept in NVS.
+//
+// The stack keeps the network itself in its NVRAM across restarts. When
+// the configuration asked for at boot is the one stored here, that network
+// is still the right one: the stack is started from NVRAM as it is
+// (NWK_START_WITHOUT_FORMATION) instead of being configured and formed
+// again. Anything else, or a failed warm start, goes the cold way and
+// stores the configuration once formation succeeds.
+class boot_config {
+public:
+	struct config_t {
+		uint8_t version;
+		uint8_t role;
+		uint32_t channel_mask;
+		uint16_t pan_id;
+		uint8_t nwk_key[16];
+	} __attribute__((packed));
+
+	static constexpr uint8_t VERSION = 1;
+
+	// True when config is what the network in NVRAM was formed with.
+	static bool matches(const config_t& config);
+	static esp_err_t save(const config_t& config);
+	// The network in NVRAM is gone or no longer the stored one.
+	static void clear();
+
+	// Logs the time from power-on to a network ready for traffic.
+	static void network_ready(bool warm);
+};
@@ -2,8 +2,14 @@
 #include "utils.h"
 #include <cstdint>
 #include "zb_ncp.h"
+#include "zb_coro.h"
+#include "wire_schema.h"
+#include "delegate.h"
+#include "desc_cache.h"
+#include "response_cache.h"
+#include <algorithm>
+#include <esp_timer.h>
 #include <cstring>
-#include <functional>
 
 typedef uint16_t __attribute__((aligned(1))) unaligned_uint16_t;
 
@@ -43,14 +49,27 @@ struct zb_ncp::immediate_cmd_process {
   static void process(const zb_ncp::cmd_t &cmd, const void *buffer, size_t len) {
     uint8_t outdata[Cmd::resp_buffer_size + sizeof(zb_ncp::cmd_t)];
     zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
+    auto res = &outdata[sizeof(zb_ncp::cmd_t)];
+    size_t reslen = 0;
 
-    auto outlen =
-        sizeof(outdata) +
-        Cmd::process_immediate(buffer, len, &outdata[sizeof(zb_ncp::cmd_t)],
-                               sizeof(outdata) - sizeof(zb_ncp::cmd_t));
+    // Cmd::cacheable: the answer only changes when a SET invalidates it
+    if constexpr (requires { Cmd::cacheable; }) {
+      reslen = response_cache::get(CmdId, buffer, len, res,
+                                   sizeof(outdata) - sizeof(zb_ncp::cmd_t));
+    }
+    if (!reslen) {
+      reslen = Cmd::process_immediate(buffer, len, res,
+                                      sizeof(outdata) - sizeof(zb_ncp::cmd_t));
+      if constexpr (requires { Cmd::cacheable; }) {
+        auto status = reinterpret_cast<const generic_response_t *>(res);
+        if (status->status == GENERIC_OK) {
+          response_cache::put(CmdId, buffer, len, res, reslen);
+        }
+      }
+    }
     *out_cmd = cmd;
     out_cmd->type = RESPONSE;
-    zb_ncp::send_cmd_data(outdata, outlen);
+    zb_ncp::send_cmd_data(outdata, sizeof(zb_ncp::cmd_t) + reslen);
   }
 };
 
@@ -75,7 +94,7 @@ struct zb_ncp::delayed_cmd_process : public ResolveStrategyT<CmdId> {
       ResolveStrategy::resolve(*out_cmd);
       out_cmd->type = RESPONSE;
       auto outlen =
-          sizeof(outdata) +
+          sizeof(zb_ncp::cmd_t) +
           Cmd::finish_delayed(status, &outdata[sizeof(zb_ncp::cmd_t)],
                               sizeof(outdata) - sizeof(zb_ncp::cmd_t));
       zb_ncp::send_cmd_data(outdata, outlen);
@@ -90,9 +109,10 @@ struct zb_ncp::delayed_cmd_process_direct : public ResolveStrategyT<CmdId> {
   using Cmd = cmd_handle<CmdId>;
   using ResolveStrategy = ResolveStrategyT<CmdId>;
 
-  inline static std::function<void(const Resp&)> m_callback = [](const Resp&){};
+  using CallbackFunc = inplace_delegate<void(const Resp&)>;
+  inline static CallbackFunc m_callback = [](const Resp&){};
 
-  static void process(const Arg& arg, const std::function<void(const Resp&)> callback) {
+  static void process(const Arg& arg, const CallbackFunc& callback) {
     ResolveStrategy::start_resolve(zb_ncp::cmd_t{
         .version = 0,
         .type = zb_ncp::REQUEST,
@@ -244,65 +264,61 @@ struct zb_ncp::general_status_arg_res {
   }
 };
 
-template <command_id_t CmdId, typename ArgType>
-struct request_cmd_resolver {
-  using Arg = ArgType;
-  struct request_t {
-    Arg arg;
-    zb_ncp::cmd_t cmd;
-    size_t old;
-    uint8_t tsn;
-    enum state_t : uint8_t {
-      S_NONE,
-      S_ALLOCATION,
-      S_EXEC,
-    } state;
-  };
-  using requests_arr_t = request_t[zb_ncp::MAX_PARALLEL_REQUESTS];
-  static size_t &old_cntr() {
-    static size_t s = 0;
-    return s;
-  }
-  static requests_arr_t &storage() {
-    static requests_arr_t s_requests;
-    return s_requests;
-  }
-
-  static request_t *start_resolve(const zb_ncp::cmd_t &cmd) {
-    request_t *res = nullptr;
-    for (auto &req : storage()) {
-      if (req.state == request_t::S_NONE) {
-        res = &req;
-        break;
-      }
-    }
-    if (!res) {
-      auto old = old_cntr();
-      for (auto &req : storage()) {
-        if (req.state == request_t::S_EXEC && req.old < old) {
-          res = &req;
-        }
-      }
-      if (res) {
-        ESP_LOGW(TAG, "Override request %d", int(res->cmd.tsn));
-      }
+// Lookup answered from NCP-side state. Cmd::lookup(arg, res) runs in the
+// caller's context; when it misses and Cmd provides lookup_stack(arg, res),
+// that is retried in the ZBOSS context before reporting GENERIC_NOT_FOUND.
+template <command_id_t CmdId, typename Arg, typename Res>
+struct zb_ncp::cached_lookup_process : cmd_base<zb_ncp::cmd_handle<CmdId>> {
+  using Cmd = zb_ncp::cmd_handle<CmdId>;
+  using Base = cmd_base<Cmd>;
+  struct FullRes {
+    generic_response_t status;
+    Res res;
+  } __attribute__((packed)) __attribute__((aligned(1)));
+
+  static void respond(const zb_ncp::cmd_t &cmd, const Res &res) {
+    uint8_t outdata[sizeof(FullRes) + sizeof(zb_ncp::cmd_t)];
+    zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto full_res = reinterpret_cast<FullRes *>(out_cmd + 1);
+    full_res->status.category = STATUS_CATEGORY_GENERIC;
+    full_res->status.status = GENERIC_OK;
+    memcpy(&full_res->res, &res, sizeof(Res));
+    zb_ncp::send_cmd_data(outdata, sizeof(outdata));
+  }
+  static zb_coro::task lookup_in_stack(zb_ncp::cmd_t cmd, Arg arg) {
+    if (!co_await zb_coro::schedule()) {
+      Base::report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
     }
-    if (res) {
-      res->cmd = cmd;
-      res->old = old_cntr()++;
+    Res res = {};
+    if (Cmd::lookup_stack(arg, res)) {
+      respond(cmd, res);
+    } else {
+      Base::report_failed(cmd, GENERIC_NOT_FOUND);
     }
-    return res;
   }
-
-  static uint16_t get_req_idx(const request_t *req) { return req - storage(); }
-  static request_t &get_by_index(uint16_t idx) { return storage()[idx]; }
-  static request_t *resolve(uint8_t tsn) {
-    for (auto &req : storage()) {
-      if (req.state == request_t::S_EXEC && req.tsn == tsn) {
-        return &req;
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    Arg arg;
+    if (len < sizeof(Arg)) {
+      Base::report_failed(cmd, GENERIC_INVALID_PARAMETER);
+      return;
+    }
+    memcpy(&arg, buffer, sizeof(Arg));
+    Res res = {};
+    if (Cmd::lookup(arg, res)) {
+      respond(cmd, res);
+      return;
+    }
+    if constexpr (requires { Cmd::lookup_stack(arg, res); }) {
+      if (!lookup_in_stack(cmd, arg)) {
+        Base::report_failed(cmd, GENERIC_NO_RESOURCES);
       }
+    } else {
+      Base::report_failed(cmd, GENERIC_NOT_FOUND);
     }
-    return nullptr;
   }
 };
 
@@ -337,12 +353,12 @@ template <> struct resp_parser<zb_zdo_power_desc_resp_t> {
 };
 
 template <command_id_t CmdId, typename Arg, typename Req, typename Resp>
-struct zb_ncp::request_cmd_process : public request_cmd_resolver<CmdId, Arg> {
+struct zb_ncp::request_cmd_process {
   static constexpr bool request_is_data = true;
   using Cmd = zb_ncp::cmd_handle<CmdId>;
   using ArgType = Arg;
-  // using Base = delayed_cmd_process< CmdId , request_cmd_resolver >;
-  using ResolveStrategy = request_cmd_resolver<CmdId, Arg>;
+  using ReqType = Req;
+  using RespType = Resp;
 
   static constexpr size_t resp_buffer_size =
       /*sizeof(generic_response_t) +*/ sizeof(Resp) +
@@ -363,99 +379,219 @@ struct zb_ncp::request_cmd_process : public request_cmd_resolver<CmdId, Arg> {
     cmd_base<Cmd>::report_failed(src_cmd, status);
   }
 
-  static void handle_response(ResolveStrategy::request_t &req,
+  static void handle_response(const zb_ncp::cmd_t &cmd, const Arg &arg,
                               const Resp *resp) {
     uint8_t outdata[Cmd::resp_buffer_size + sizeof(zb_ncp::cmd_t)];
     zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
-    *out_cmd = req.cmd;
+    *out_cmd = cmd;
     out_cmd->type = zb_ncp::RESPONSE;
     auto outlen = sizeof(zb_ncp::cmd_t);
     outlen +=
         Cmd::format_response(reinterpret_cast<uint8_t *>(out_cmd + 1), resp);
     zb_ncp::send_cmd_data(outdata, outlen);
   }
-  static void req_cb(uint8_t buf) {
-    auto zdp_cmd = static_cast<const zb_uint8_t *>(zb_buf_begin(buf));
-    auto resp = reinterpret_cast<const Resp *>(zdp_cmd);
-    auto req = ResolveStrategy::resolve(resp_parser<Resp>::get_tsn(resp));
-    if (req) {
-      ESP_LOGD(TAG, "%s::req_cb %d", Cmd::name,
-               int(resp_parser<Resp>::get_tsn(resp)));
-      auto status = resp_parser<Resp>::get_status(resp);
+  static void format_request(Req &req, const Arg &arg) { req = arg; }
+  static size_t get_request_alloc_size(const Arg &arg) { return sizeof(Req); }
+  // Read-only requests set coalesce: an identical request (same arguments)
+  // arriving while one is on air does not start another transaction, its
+  // host tsn waits for the response of the one in flight instead.
+  static constexpr bool coalesce = false;
+  static constexpr size_t MAX_COALESCED_ARGS = 4;
+  static constexpr size_t MAX_COALESCED_CMDS = 4;
+  // The leader's request times out by itself (zb_coro::zdo_request); a
+  // group still open well after that is given up on its followers' behalf.
+  static constexpr uint32_t COALESCE_TIMEOUT_MS =
+      zb_coro::zdo_request::TIMEOUT_MS + 5000;
+  struct coalesced_t {
+    bool used;
+    uint8_t count;
+    uint8_t gen;        /*!< bumped when the group is let go */
+    uint32_t start_ms;
+    Arg arg;
+    zb_ncp::cmd_t cmds[MAX_COALESCED_CMDS];
+  };
+  // Only touched from the ZBOSS context.
+  inline static coalesced_t s_coalesced[MAX_COALESCED_ARGS] = {};
+
+  // Returns the group the request was added to as a follower, or the new
+  // group it leads (nullptr when the table is full).
+  static coalesced_t *coalesce_join(const zb_ncp::cmd_t &cmd, const Arg &arg,
+                                    bool &follower) {
+    auto now = static_cast<uint32_t>(esp_timer_get_time() / 1000);
+    coalesced_t *free_group = nullptr;
+    for (auto &group : s_coalesced) {
+      if (group.used && now - group.start_ms > COALESCE_TIMEOUT_MS) {
+        coalesce_expire(group);
+      }
+      if (!group.used) {
+        free_group = free_group ? free_group : &group;
+      } else if (memcmp(&group.arg, &arg, sizeof(Arg)) == 0 &&
+                 group.count < MAX_COALESCED_CMDS) {
+        ESP_LOGD(TAG, "%s tsn: %d joins tsn: %d", Cmd::name, int(cmd.tsn),
+                 int(group.cmds[0].tsn));
+        group.cmds[group.count++] = cmd;
+        follower = true;
+        return &group;
+      }
+    }
+    follower = false;
+    if (free_group) {
+      free_group->used = true;
+      free_group->count = 1;
+      free_group->start_ms = now;
+      free_group->arg = arg;
+      free_group->cmds[0] = cmd;
+    }
+    return free_group;
+  }
+  // The followers are failed; the leader still answers its own request
+  // when it completes.
+  static void coalesce_expire(coalesced_t &group) {
+    ESP_LOGW(TAG, "%s tsn: %d no response, %d joined requests failed",
+             Cmd::name, int(group.cmds[0].tsn), int(group.count) - 1);
+    for (uint8_t i = 1; i < group.count; ++i) {
+      report_failed(group.cmds[i], GENERIC_TIMEOUT);
+    }
+    group.used = false;
+    ++group.gen;
+  }
+  // Soft reset: the requests waiting in a group are from the old host
+  // session and are let go unanswered. The leader in flight completes
+  // alone, like any other request that outlives the reset.
+  static void coalesce_reset() {
+    for (auto &group : s_coalesced) {
+      if (group.used) {
+        group.used = false;
+        ++group.gen;
+      }
+    }
+  }
+  static void complete(const zb_ncp::cmd_t &cmd, coalesced_t *group,
+                       uint8_t gen, const Arg &arg, const Resp *resp,
+                       uint8_t status) {
+    auto deliver = [&](const zb_ncp::cmd_t &to) {
       if (status == 0) {
-        Cmd::handle_response(*req, resp);
+        Cmd::handle_response(to, arg, resp);
       } else {
-        report_failed(req->cmd, status);
+        report_failed(to, status);
       }
-      req->state = ResolveStrategy::request_t::S_NONE;
-    } else {
-      ESP_LOGW(TAG, "%s not found request for response %d", Cmd::name,
-               int(resp_parser<Resp>::get_tsn(resp)));
+    };
+    if (!group || group->gen != gen) {
+      deliver(cmd); // alone, or the group expired meanwhile
+      return;
     }
-    zb_buf_free(buf);
+    for (uint8_t i = 0; i < group->count; ++i) {
+      deliver(group->cmds[i]);
+    }
+    group->used = false;
+    ++group->gen;
   }
-  static void format_request(Req &req, const Arg &arg) { req = arg; }
-  static void on_request_started() {}
-  static size_t get_request_alloc_size(const Arg &arg) { return sizeof(Req); }
-  static void do_request(uint8_t buf, uint16_t req_arg) {
+
+  static zb_coro::task run(zb_ncp::cmd_t cmd, Arg arg) {
+    coalesced_t *group = nullptr;
+    uint8_t gen = 0;
+    if constexpr (Cmd::coalesce) {
+      if (!co_await zb_coro::schedule()) {
+        report_failed(cmd, GENERIC_NO_RESOURCES);
+        co_return;
+      }
+      bool follower;
+      group = coalesce_join(cmd, arg, follower);
+      if (follower) {
+        co_return;
+      }
+      gen = group ? group->gen : 0;
+    }
+    auto buf = co_await zb_coro::buf_get_out(Cmd::get_request_alloc_size(arg));
+    if (!buf) {
+      complete(cmd, group, gen, arg, nullptr, GENERIC_NO_RESOURCES);
+      co_return;
+    }
     Req *request_data;
-    auto &req = ResolveStrategy::get_by_index(req_arg);
     if (Cmd::request_is_data) {
-      ESP_LOGD(TAG, "%s::do_request zb_buf_initial_alloc req_idx: %d",
-               Cmd::name, req_arg);
+      ESP_LOGD(TAG, "%s::run zb_buf_initial_alloc tsn: %d", Cmd::name,
+               int(cmd.tsn));
       request_data = static_cast<Req *>(
-          zb_buf_initial_alloc(buf, Cmd::get_request_alloc_size(req.arg)));
+          zb_buf_initial_alloc(buf, Cmd::get_request_alloc_size(arg)));
     } else {
-      ESP_LOGD(TAG, "%s::do_request zb_buf_alloc_tail req_idx: %d", Cmd::name,
-               req_arg);
+      ESP_LOGD(TAG, "%s::run zb_buf_alloc_tail tsn: %d", Cmd::name,
+               int(cmd.tsn));
       request_data = static_cast<Req *>(
-          zb_buf_alloc_tail(buf, Cmd::get_request_alloc_size(req.arg)));
+          zb_buf_alloc_tail(buf, Cmd::get_request_alloc_size(arg)));
     }
-    Cmd::format_request(*request_data, req.arg);
-    auto r = Cmd::start_request(buf);
-    if (r == 0xFF) {
-      ESP_LOGE(TAG, "%s::do_request failed", Cmd::name);
-      zb_buf_free(buf);
-      req.state = ResolveStrategy::request_t::S_NONE;
-      report_failed(req.cmd, GENERIC_NO_RESOURCES);
-    } else {
-      req.state = ResolveStrategy::request_t::S_EXEC;
-      req.tsn = r;
-      ESP_LOGD(TAG, "%s::do_request tsn: %d", Cmd::name, int(r));
-      Cmd::on_request_started();
+    Cmd::format_request(*request_data, arg);
+    zb_coro::zdo_request request(buf, &Cmd::start_request);
+    auto resp_buf = co_await request;
+    if (!resp_buf) {
+      ESP_LOGE(TAG, "%s::run request failed", Cmd::name);
+      complete(cmd, group, gen, arg, nullptr,
+               request.timed_out() ? GENERIC_TIMEOUT : GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    auto resp = static_cast<const Resp *>(zb_buf_begin(resp_buf));
+    ESP_LOGD(TAG, "%s::run response %d", Cmd::name,
+             int(resp_parser<Resp>::get_tsn(resp)));
+    auto status = resp_parser<Resp>::get_status(resp);
+    if (status == 0) {
+      if constexpr (requires { Cmd::cache_key(arg); }) {
+        desc_cache::put(Cmd::cache_key(arg), resp, zb_buf_len(resp_buf));
+      }
     }
+    complete(cmd, group, gen, arg, resp, status);
+    zb_buf_free(resp_buf);
   }
+  // Commands with a variable response declare a wire::schema as
+  // response_schema; the rest send the ZDP response with the tsn replaced
+  // by the status category.
   static uint16_t format_response(uint8_t *outdata, const Resp *resp) {
-    memcpy(outdata, resp, sizeof(Resp));
-    outdata[0] = STATUS_CATEGORY_ZDO;
-    return sizeof(Resp);
+    if constexpr (requires { typename Cmd::response_schema; }) {
+      auto len = Cmd::response_schema::encode(outdata, Cmd::resp_buffer_size,
+                                              *resp);
+      if (!len) {
+        ESP_LOGE(TAG, "%s response does not fit", Cmd::name);
+      }
+      return len;
+    } else {
+      memcpy(outdata, resp, sizeof(Resp));
+      outdata[0] = STATUS_CATEGORY_ZDO;
+      return sizeof(Resp);
+    }
   }
   static bool check_arg_size(const void *buffer, size_t len) {
     return len >= sizeof(Arg);
   }
+  // Commands with a variable request declare a wire::schema as
+  // request_schema; the rest take the argument struct as is.
+  static bool parse_arg(Arg &arg, const void *buffer, size_t len) {
+    if constexpr (requires { typename Cmd::request_schema; }) {
+      return Cmd::request_schema::decode(buffer, len, arg);
+    } else {
+      if (!Cmd::check_arg_size(buffer, len)) {
+        return false;
+      }
+      memcpy(&arg, buffer, std::min(len, sizeof(Arg)));
+      return true;
+    }
+  }
   static esp_err_t process(const zb_ncp::cmd_t &cmd, const void *buffer,
                            size_t len) {
-    if (!Cmd::check_arg_size(buffer, len)) {
+    Arg arg = {};
+    if (!Cmd::parse_arg(arg, buffer, len)) {
       report_failed(cmd, GENERIC_INVALID_PARAMETER);
       return ESP_OK;
     }
-    auto req = ResolveStrategy::start_resolve(cmd);
-    if (!req) {
-      report_failed(cmd, GENERIC_NO_RESOURCES);
-      return ESP_OK;
+    // Descriptors already known are answered without going on air.
+    if constexpr (requires { Cmd::cache_key(arg); }) {
+      alignas(4) uint8_t cached[desc_cache::MAX_DATA];
+      size_t cached_len;
+      if (desc_cache::get(Cmd::cache_key(arg), cached, cached_len)) {
+        ESP_LOGD(TAG, "%s cached tsn: %d", Cmd::name, int(cmd.tsn));
+        Cmd::handle_response(cmd, arg, reinterpret_cast<const Resp *>(cached));
+        return ESP_OK;
+      }
     }
-    req->arg = *reinterpret_cast<const Arg *>(buffer);
-    req->state = ResolveStrategy::request_t::S_ALLOCATION;
-    auto ret = zb_buf_get_out_delayed_ext(
-        &do_request, ResolveStrategy::get_req_idx(req),
-        Cmd::get_request_alloc_size(req->arg));
-    if (ret != 0) {
-      req->state = ResolveStrategy::request_t::S_NONE;
+    if (!Cmd::run(cmd, arg)) {
       report_failed(cmd, GENERIC_NO_RESOURCES);
-      return ESP_OK;
-    } else {
-      ESP_LOGD(TAG, "%s::do_start req_idx: %d", Cmd::name,
-               ResolveStrategy::get_req_idx(req));
     }
     return ESP_OK;
   }
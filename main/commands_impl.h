@@ -1,8 +1,26 @@
 #include "commands.h"
 #include "commands_helpers.h"
+#include "app.h"
 #include "statuses.h"
 #include "zb_ncp.h"
+#include "ind_sender.h"
+#include "ind_store.h"
+#include "ind_filter.h"
+#include "topology.h"
+#include "dev_stats.h"
+#include "ota_server.h"
+#include "fw_update.h"
+#include "net_backup.h"
+#include "boot_config.h"
+#include "tx_sched.h"
+#include "payload_arena.h"
+#include "addr_cache.h"
+#include "zb_coro.h"
 #include <esp_mac.h>
+#include <esp_timer.h>
+#include <atomic>
+#include <utility>
+#include <vector>
 
 #ifndef TAG
 #define TAG "no tag (commands_impl)"
@@ -42,6 +60,7 @@ template <>
 struct zb_ncp::cmd_handle<GET_MODULE_VERSION>
     : immediate_cmd_process<GET_MODULE_VERSION>,
       general_status_res<GET_MODULE_VERSION, GET_MODULE_VERSION_resp_t> {
+  static constexpr bool cacheable = true;
   static void process_status_res(ncp_generic_status_t &status,
                                  GET_MODULE_VERSION_resp_t *res) {
     res->fwVersion = 0x100;
@@ -59,18 +78,41 @@ struct zb_ncp::cmd_handle<GET_MODULE_VERSION>
 template <>
 struct zb_ncp::cmd_handle<NCP_RESET> : immediate_cmd_process<NCP_RESET>,
                                        general_status_arg<NCP_RESET, uint8_t> {
+  // Vendor option: restart only the host session. The link sequence
+  // numbers, partial frames and pending host requests are dropped and the
+  // vendor settings go back to their defaults, as after a reboot; the stack
+  // keeps running and the transport stays up, so the host reconnects
+  // without waiting for a reboot. The response is the last packet of the
+  // old session.
+  static constexpr uint8_t RESET_SOFT = 0x80;
+
   static void process_status_arg(ncp_generic_status_t &status,
                                  uint8_t options) {
+    if (options & RESET_SOFT) {
+      if (options != RESET_SOFT) {
+        status = GENERIC_INVALID_PARAMETER;
+      } else if (app::send_event(app::ctx_t{.event = app::EVENT_SOFT_RESET,
+                                            .size = 0}) != ESP_OK) {
+        status = GENERIC_BUSY;
+      }
+      return;
+    }
     if (options == 1 || options == 2) {
       ESP_LOGI(TAG, "erase nvram");
       zb_nvram_erase();
+      boot_config::clear();
     }
     if (options == 2) {
       ESP_LOGI(TAG, "factory reset");
       zb_bdb_reset_via_local_action(0);
     }
     ESP_LOGI(TAG, "restart");
-    esp_restart();
+    if (options == 0) {
+      // held indications are spilled first, to be replayed after it
+      ind_store::restart();
+    } else {
+      esp_restart();
+    }
   }
 };
 
@@ -84,6 +126,7 @@ template <>
 struct zb_ncp::cmd_handle<GET_ZIGBEE_ROLE>
     : immediate_cmd_process<GET_ZIGBEE_ROLE>,
       general_status_res<GET_ZIGBEE_ROLE, uint8_t> {
+  static constexpr bool cacheable = true;
   static void process_status_res(ncp_generic_status_t &status,
                                  uint8_t *__attribute__((aligned(1))) res) {
     *res = zb_get_network_role();
@@ -103,6 +146,7 @@ struct zb_ncp::cmd_handle<SET_ZIGBEE_ROLE>
     if (role != ZB_NWK_DEVICE_TYPE_COORDINATOR) {
       status = GENERIC_INVALID_PARAMETER_1;
     }
+    response_cache::invalidate(GET_ZIGBEE_ROLE);
   }
 };
 
@@ -232,6 +276,7 @@ struct zb_ncp::cmd_handle<GET_LOCAL_IEEE_ADDR>
     : immediate_cmd_process<GET_LOCAL_IEEE_ADDR>,
       general_status_arg_res<GET_LOCAL_IEEE_ADDR, uint8_t,
                              GET_LOCAL_IEEE_ADDR_resp_t> {
+  static constexpr bool cacheable = true;
   static void process_status_arg_res(ncp_generic_status_t &status, uint8_t arg,
                                      GET_LOCAL_IEEE_ADDR_resp_t *res) {
     if (arg != 0) {
@@ -420,6 +465,7 @@ template <>
 struct zb_ncp::cmd_handle<GET_COORDINATOR_VERSION>
     : immediate_cmd_process<GET_COORDINATOR_VERSION>,
       general_status_res<GET_COORDINATOR_VERSION, uint8_t> {
+  static constexpr bool cacheable = true;
   static void process_status_res(ncp_generic_status_t &status, uint8_t *res) {
     *res = zb_aib_get_coordinator_version();
   }
@@ -662,23 +708,28 @@ struct zb_ncp::cmd_handle<NWK_FORMATION>
 //     response: [...commonResponse],
 // },
 
+struct NWK_START_WITHOUT_FORMATION_arg_t {
+} __attribute__((packed));
+
 template <>
 struct zb_ncp::cmd_handle<NWK_START_WITHOUT_FORMATION>
-    : delayed_cmd_process<NWK_START_WITHOUT_FORMATION, single_cmd_delayed> {
+    : delayed_cmd_process_direct<NWK_START_WITHOUT_FORMATION, single_cmd_delayed,
+                                 NWK_START_WITHOUT_FORMATION_arg_t,
+                                 generic_response_t> {
   static constexpr size_t resp_buffer_size = 2;
   static constexpr const char *name = "NWK_START_WITHOUT_FORMATION";
-  // static uint32_t channel_mask;
-  static int start_delayed(const void *cmddata, uint16_t cmdlen) {
+  // The network comes from NVRAM, see zb_ncp::continue_zboss.
+  static int start_delayed(const NWK_START_WITHOUT_FORMATION_arg_t &arg) {
     if (!zb_ncp::start_zigbee_stack()) {
       response(0);
     }
     return 0;
   }
-  static uint16_t finish_delayed(int status, uint8_t *outdata,
-                                 uint16_t outlen) {
-    *outdata++ = STATUS_CATEGORY_NWK;
-    *outdata++ = status;
-    return 2;
+  static generic_response_t finish_delayed(int status) {
+    return generic_response_t{
+        .category = STATUS_CATEGORY_NWK,
+        .status = (ncp_generic_status_t)status,
+    };
   }
 };
 
@@ -704,34 +755,26 @@ struct zb_ncp::cmd_handle<ZDO_ACTIVE_EP_REQ>
                                    zb_zdo_active_ep_req_t, zb_zdo_ep_resp_t>;
   static constexpr size_t additional_buffer_size = 16;
   static constexpr const char *name = "ZDO_ACTIVE_EP_REQ";
-  static uint8_t start_request(uint8_t buf) {
-    return zb_zdo_active_ep_req(buf, &Base::req_cb);
+  static constexpr bool coalesce = true;
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
+    return zb_zdo_active_ep_req(buf, cb);
   }
   static void format_request(zb_zdo_active_ep_req_t &req, uint16_t arg) {
     ESP_LOGI(TAG, "ZDO_ACTIVE_EP_REQ::start_request nwk_addr:%04x", arg);
     req.nwk_addr = arg;
   }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_ep_resp_t *resp) {
-    auto len = Base::format_response(outdata, resp);
-    uint16_t ep_count = resp->ep_count;
-    if (ep_count > 16) {
-      ESP_LOGE(TAG, "S_ZDO_ACTIVE_EP_REQ: truncate endpoints %d",
-               int(ep_count));
-      ep_count = 16;
-    }
-    outdata[2] = ep_count;
-    const uint8_t *ep_list = reinterpret_cast<const uint8_t *>(resp + 1);
-    ESP_LOGI(TAG, "S_ZDO_ACTIVE_EP_REQ::format_response nwk_addr:%04x %d",
-             resp->nwk_addr, ep_count);
-    for (uint16_t i = 0; i < ep_count; ++i) {
-      outdata[3 + i] = ep_list[i];
-      ++len;
-      ESP_LOGI(TAG, "S_ZDO_ACTIVE_EP_REQ::format_response ep:%d", ep_list[i]);
-    }
-    *reinterpret_cast<uint16_t *>(&outdata[3 + ep_count]) = resp->nwk_addr;
-    return 3 + ep_count + 2;
+  static desc_cache::key_t cache_key(uint16_t arg) {
+    return {arg, ZDO_ACTIVE_EP_REQ, 0};
   }
+  static const uint8_t *ep_list(const zb_zdo_ep_resp_t &resp) {
+    return reinterpret_cast<const uint8_t *>(&resp + 1);
+  }
+  using response_schema =
+      wire::schema<wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+                   wire::field<&zb_zdo_ep_resp_t::status>,
+                   wire::count<&zb_zdo_ep_resp_t::ep_count, 16>,
+                   wire::list<&zb_zdo_ep_resp_t::ep_count, &ep_list, 16>,
+                   wire::field<&zb_zdo_ep_resp_t::nwk_addr>>;
 };
 // REQUEST_CMD_PROCESS_DECL(ZDO_ACTIVE_EP_REQ,uint16_t)
 
@@ -784,49 +827,59 @@ struct zb_ncp::cmd_handle<ZDO_SIMPLE_DESC_REQ>
                           zb_zdo_simple_desc_req_t, zb_zdo_simple_desc_resp_t>;
   static constexpr size_t additional_buffer_size = 2 * 32;
   static constexpr const char *name = "ZDO_SIMPLE_DESC_REQ";
-  static uint8_t start_request(uint8_t buf) {
-    return zb_zdo_simple_desc_req(buf, &Base::req_cb);
-  }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_simple_desc_resp_t *resp) {
-    auto out = outdata;
-    *out++ = STATUS_CATEGORY_ZDO;
-    *out++ = resp->hdr.status;
-    *out++ = resp->simple_desc.endpoint;
-    *reinterpret_cast<uint16_t *>(out) = resp->simple_desc.app_profile_id;
-    out += 2;
-    *reinterpret_cast<uint16_t *>(out) = resp->simple_desc.app_device_id;
-    out += 2;
-    *out++ = resp->simple_desc.app_device_version;
-
-    auto input_count = resp->simple_desc.app_input_cluster_count;
-    auto output_count = resp->simple_desc.app_output_cluster_count;
-    while ((input_count + output_count) > 32) {
-      if (input_count > output_count)
-        --input_count;
+  static constexpr bool coalesce = true;
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
+    return zb_zdo_simple_desc_req(buf, cb);
+  }
+  static desc_cache::key_t cache_key(const zb_zdo_simple_desc_req_t &arg) {
+    return {arg.nwk_addr, ZDO_SIMPLE_DESC_REQ, arg.endpoint};
+  }
+  using Resp = zb_zdo_simple_desc_resp_t;
+  using Hdr = zb_zdo_simple_desc_resp_hdr_t;
+  using Desc = zb_af_simple_desc_1_1_t;
+
+  // At most 32 clusters fit, trimmed from the longer list first.
+  static std::pair<uint8_t, uint8_t> cluster_counts(const Resp &resp) {
+    uint8_t in = resp.simple_desc.app_input_cluster_count;
+    uint8_t out = resp.simple_desc.app_output_cluster_count;
+    while ((in + out) > 32) {
+      if (in > out)
+        --in;
       else
-        --output_count;
-    }
-
-    *out++ = input_count;
-    *out++ = output_count;
-
-    for (uint16_t i = 0; i < input_count; ++i) {
-      *reinterpret_cast<uint16_t *>(out) =
-          resp->simple_desc.app_cluster_list[i];
-      out += 2;
+        --out;
     }
-    for (uint16_t i = 0; i < output_count; ++i) {
-      *reinterpret_cast<uint16_t *>(out) =
-          resp->simple_desc
-              .app_cluster_list[i + resp->simple_desc.app_input_cluster_count];
-      out += 2;
-    }
-    *reinterpret_cast<uint16_t *>(out) = resp->hdr.nwk_addr;
-    out += 2;
-
-    return out - outdata;
-  }
+    return {in, out};
+  }
+  static uint8_t input_count(const Resp &resp) {
+    return cluster_counts(resp).first;
+  }
+  static uint8_t output_count(const Resp &resp) {
+    return cluster_counts(resp).second;
+  }
+  static uint8_t device_version(const Resp &resp) {
+    return resp.simple_desc.app_device_version;
+  }
+  // The list is unaligned; the schema only copies it bytewise.
+  static const uint16_t *input_clusters(const Resp &resp) {
+    return reinterpret_cast<const uint16_t *>(
+        reinterpret_cast<const uint8_t *>(&resp.simple_desc) +
+        offsetof(Desc, app_cluster_list));
+  }
+  static const uint16_t *output_clusters(const Resp &resp) {
+    return input_clusters(resp) + resp.simple_desc.app_input_cluster_count;
+  }
+  using response_schema =
+      wire::schema<wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+                   wire::field<&Resp::hdr, &Hdr::status>,
+                   wire::field<&Resp::simple_desc, &Desc::endpoint>,
+                   wire::field<&Resp::simple_desc, &Desc::app_profile_id>,
+                   wire::field<&Resp::simple_desc, &Desc::app_device_id>,
+                   wire::value<&device_version>,
+                   wire::value<&input_count>,
+                   wire::value<&output_count>,
+                   wire::list<&input_count, &input_clusters, 32>,
+                   wire::list<&output_count, &output_clusters, 32>,
+                   wire::field<&Resp::hdr, &Hdr::nwk_addr>>;
 };
 // REQUEST_CMD_PROCESS_DECL(ZDO_SIMPLE_DESC_REQ,zb_zdo_simple_desc_req_t)
 
@@ -871,23 +924,24 @@ struct zb_ncp::cmd_handle<ZDO_NODE_DESC_REQ>
                           zb_zdo_node_desc_req_t, zb_zdo_node_desc_resp_t>;
   static constexpr size_t additional_buffer_size = 0;
   static constexpr const char *name = "ZDO_NODE_DESC_REQ";
+  static constexpr bool coalesce = true;
   static void format_request(zb_zdo_node_desc_req_t &req,
                              const zb_zdo_node_desc_req_t &arg) {
     req = arg;
     ESP_LOGI(TAG, "ZDO_NODE_DESC_REQ %04x", req.nwk_addr);
   }
-  static uint8_t start_request(uint8_t buf) {
-    return zb_zdo_node_desc_req(buf, &Base::req_cb);
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
+    return zb_zdo_node_desc_req(buf, cb);
   }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_node_desc_resp_t *resp) {
-    outdata[0] = STATUS_CATEGORY_ZDO;
-    outdata[1] = resp->hdr.status;
-    memcpy(&outdata[2], &resp->node_desc, sizeof(zb_af_node_desc_t));
-    *reinterpret_cast<uint16_t *>(&outdata[2 + sizeof(zb_af_node_desc_t)]) =
-        resp->hdr.nwk_addr;
-    return sizeof(zb_zdo_node_desc_resp_t);
+  static desc_cache::key_t cache_key(const zb_zdo_node_desc_req_t &arg) {
+    return {arg.nwk_addr, ZDO_NODE_DESC_REQ, 0};
   }
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+      wire::field<&zb_zdo_node_desc_resp_t::hdr, &zb_zdo_desc_resp_hdr_t::status>,
+      wire::field<&zb_zdo_node_desc_resp_t::node_desc>,
+      wire::field<&zb_zdo_node_desc_resp_t::hdr,
+                  &zb_zdo_desc_resp_hdr_t::nwk_addr>>;
 };
 // REQUEST_CMD_PROCESS_DECL(ZDO_NODE_DESC_REQ,zb_zdo_node_desc_req_t)
 
@@ -913,10 +967,10 @@ struct zb_ncp::cmd_handle<ZDO_PERMIT_JOINING_REQ>
   static constexpr size_t additional_buffer_size = 0;
   static constexpr bool request_is_data = false;
   static constexpr const char *name = "ZDO_PERMIT_JOINING_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_PERMIT_JOINING_REQ::start_request nwk_addr:%04x
     // time:%d",s_req.dest_addr,int(s_req.permit_duration));
-    return zb_zdo_mgmt_permit_joining_req(buf, &Base::req_cb);
+    return zb_zdo_mgmt_permit_joining_req(buf, cb);
   }
 };
 
@@ -963,8 +1017,8 @@ struct zb_ncp::cmd_handle<ZDO_BIND_REQ>
     req.dst_endp = arg.dstEP;
     req.req_dst_addr = arg.target;
   }
-  static uint8_t start_request(uint8_t buf) {
-    return zb_zdo_bind_req(buf, &Base::req_cb);
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
+    return zb_zdo_bind_req(buf, cb);
   }
 };
 
@@ -989,8 +1043,8 @@ struct zb_ncp::cmd_handle<ZDO_UNBIND_REQ>
     req.dst_endp = arg.dstEP;
     req.req_dst_addr = arg.target;
   }
-  static uint8_t start_request(uint8_t buf) {
-    return zb_zdo_unbind_req(buf, &Base::req_cb);
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
+    return zb_zdo_unbind_req(buf, cb);
   }
 };
 
@@ -1027,43 +1081,42 @@ struct zb_ncp::cmd_handle<ZDO_IEEE_ADDR_REQ>
   static constexpr size_t additional_buffer_size = 2 + 16 * 2;
   static constexpr bool request_is_data = false;
   static constexpr const char *name = "ZDO_IEEE_ADDR_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static constexpr bool coalesce = true;
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_IEEE_ADDR_REQ::start_request nwk: %04x nwk_addr:
     // %04x",s_req.dst_addr,s_req.nwk_addr);
-    return zb_zdo_ieee_addr_req(buf, &Base::req_cb);
-  }
-  static void handle_response(ResolveStrategy::request_t &req,
+    return zb_zdo_ieee_addr_req(buf, cb);
+  }
+  // Extended response: associated devices list.
+  using Ext = zb_zdo_ieee_addr_resp_ext_t;
+  static uint8_t assoc_start_index(const Ext &ext) {
+    return reinterpret_cast<const zb_zdo_ieee_addr_resp_ext2_t *>(&ext + 1)->start_index;
+  }
+  static const uint16_t *assoc_nwks(const Ext &ext) {
+    return reinterpret_cast<const uint16_t *>(
+        reinterpret_cast<const zb_zdo_ieee_addr_resp_ext2_t *>(&ext + 1) + 1);
+  }
+  static bool has_assoc(const Ext &ext) { return ext.num_assoc_dev != 0; }
+  using assoc_schema = wire::schema<
+      wire::count<&Ext::num_assoc_dev, 16>,
+      wire::when<&has_assoc, wire::value<&assoc_start_index>,
+                 wire::list<&Ext::num_assoc_dev, &assoc_nwks, 16>>>;
+  static void handle_response(const zb_ncp::cmd_t &cmd,
+                              const zb_zdo_ieee_addr_req_param_t &arg,
                               const zb_zdo_ieee_addr_resp_t *resp) {
     uint8_t outdata[Cmd::resp_buffer_size + sizeof(zb_ncp::cmd_t)];
     zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
-    *out_cmd = req.cmd;
+    *out_cmd = cmd;
     out_cmd->type = zb_ncp::RESPONSE;
     auto outlen = sizeof(zb_ncp::cmd_t);
+    addr_cache::update(resp->ieee_addr_remote_dev, resp->nwk_addr_remote_dev);
     outlen +=
         Cmd::format_response(reinterpret_cast<uint8_t *>(out_cmd + 1), resp);
-    if (req.arg.request_type == 0x01) {
-      auto ext =
-          reinterpret_cast<const zb_zdo_ieee_addr_resp_ext_t *>(resp + 1);
-      auto dst = reinterpret_cast<uint8_t *>(out_cmd + 1) + outlen;
-      auto num = ext->num_assoc_dev;
-      if (num > 16) {
-        num = 16;
-        ESP_LOGE(TAG, "truncate ZDO_IEEE_ADDR_REQ response %d", int(num));
-      }
-      *dst++ = num;
-      ++outlen;
-      if (num) {
-        auto ext2 =
-            reinterpret_cast<const zb_zdo_ieee_addr_resp_ext2_t *>(ext + 1);
-        *dst++ = ext2->start_index;
-        ++outlen;
-        auto nwks = reinterpret_cast<const uint16_t *>(ext2 + 1);
-        for (uint8_t i = 0; i < ext->num_assoc_dev; ++i) {
-          *reinterpret_cast<uint16_t *>(dst) = *nwks++;
-          dst += 2;
-          outlen += 2;
-        }
-      }
+    if (arg.request_type == 0x01) {
+      auto ext = reinterpret_cast<const zb_zdo_ieee_addr_resp_ext_t *>(resp + 1);
+      wire::writer w(outdata + outlen, sizeof(outdata) - outlen);
+      assoc_schema::encode(w, *ext);
+      outlen += w.size();
     }
     zb_ncp::send_cmd_data(outdata, outlen);
   }
@@ -1102,42 +1155,42 @@ struct zb_ncp::cmd_handle<ZDO_NWK_ADDR_REQ>
   static constexpr size_t additional_buffer_size = 2 + 16 * 2;
   static constexpr bool request_is_data = false;
   static constexpr const char *name = "ZDO_NWK_ADDR_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static constexpr bool coalesce = true;
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_IEEE_ADDR_REQ::start_request nwk: %04x nwk_addr:
     // %04x",s_req.dst_addr,s_req.nwk_addr);
-    return zb_zdo_nwk_addr_req(buf, &Base::req_cb);
-  }
-  static void handle_response(ResolveStrategy::request_t &req,
+    return zb_zdo_nwk_addr_req(buf, cb);
+  }
+  // Extended response: associated devices list.
+  using Ext = zb_zdo_nwk_addr_resp_ext_t;
+  static uint8_t assoc_start_index(const Ext &ext) {
+    return reinterpret_cast<const zb_zdo_nwk_addr_resp_ext2_t *>(&ext + 1)->start_index;
+  }
+  static const uint16_t *assoc_nwks(const Ext &ext) {
+    return reinterpret_cast<const uint16_t *>(
+        reinterpret_cast<const zb_zdo_nwk_addr_resp_ext2_t *>(&ext + 1) + 1);
+  }
+  static bool has_assoc(const Ext &ext) { return ext.num_assoc_dev != 0; }
+  using assoc_schema = wire::schema<
+      wire::count<&Ext::num_assoc_dev, 16>,
+      wire::when<&has_assoc, wire::value<&assoc_start_index>,
+                 wire::list<&Ext::num_assoc_dev, &assoc_nwks, 16>>>;
+  static void handle_response(const zb_ncp::cmd_t &cmd,
+                              const zb_zdo_nwk_addr_req_param_t &arg,
                               const zb_zdo_nwk_addr_resp_head_t *resp) {
     uint8_t outdata[Cmd::resp_buffer_size + sizeof(zb_ncp::cmd_t)];
     zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
-    *out_cmd = req.cmd;
+    *out_cmd = cmd;
     out_cmd->type = zb_ncp::RESPONSE;
     auto outlen = sizeof(zb_ncp::cmd_t);
+    addr_cache::update(resp->ieee_addr, resp->nwk_addr);
     outlen +=
         Cmd::format_response(reinterpret_cast<uint8_t *>(out_cmd + 1), resp);
-    if (req.arg.request_type == 0x01) {
+    if (arg.request_type == 0x01) {
       auto ext = reinterpret_cast<const zb_zdo_nwk_addr_resp_ext_t *>(resp + 1);
-      auto dst = reinterpret_cast<uint8_t *>(out_cmd + 1) + outlen;
-      auto num = ext->num_assoc_dev;
-      if (num > 16) {
-        num = 16;
-        ESP_LOGE(TAG, "truncate ZDO_NWK_ADDR_REQ response %d", int(num));
-      }
-      *dst++ = num;
-      ++outlen;
-      if (num) {
-        auto ext2 =
-            reinterpret_cast<const zb_zdo_nwk_addr_resp_ext2_t *>(ext + 1);
-        *dst++ = ext2->start_index;
-        ++outlen;
-        auto nwks = reinterpret_cast<const uint16_t *>(ext2 + 1);
-        for (uint8_t i = 0; i < ext->num_assoc_dev; ++i) {
-          *reinterpret_cast<uint16_t *>(dst) = *nwks++;
-          dst += 2;
-          outlen += 2;
-        }
-      }
+      wire::writer w(outdata + outlen, sizeof(outdata) - outlen);
+      assoc_schema::encode(w, *ext);
+      outlen += w.size();
     }
     zb_ncp::send_cmd_data(outdata, outlen);
   }
@@ -1159,20 +1212,22 @@ struct zb_ncp::cmd_handle<ZDO_POWER_DESC_REQ>
   static constexpr size_t additional_buffer_size = 0;
   static constexpr bool request_is_data = true;
   static constexpr const char *name = "ZDO_POWER_DESC_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static constexpr bool coalesce = true;
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_IEEE_ADDR_REQ::start_request nwk: %04x nwk_addr:
     // %04x",s_req.dst_addr,s_req.nwk_addr);
-    return zb_zdo_power_desc_req(buf, &Base::req_cb);
-  }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_power_desc_resp_t *resp) {
-    outdata[0] = STATUS_CATEGORY_ZDO;
-    outdata[1] = resp->hdr.status;
-    memcpy(&outdata[2], &resp->power_desc, sizeof(zb_af_node_power_desc_t));
-    *reinterpret_cast<uint16_t *>(
-        &outdata[2 + sizeof(zb_af_node_power_desc_t)]) = resp->hdr.nwk_addr;
-    return sizeof(zb_zdo_power_desc_resp_t);
-  }
+    return zb_zdo_power_desc_req(buf, cb);
+  }
+  static desc_cache::key_t cache_key(const zb_zdo_power_desc_req_t &arg) {
+    return {arg.nwk_addr, ZDO_POWER_DESC_REQ, 0};
+  }
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+      wire::field<&zb_zdo_power_desc_resp_t::hdr,
+                  &zb_zdo_desc_resp_hdr_t::status>,
+      wire::field<&zb_zdo_power_desc_resp_t::power_desc>,
+      wire::field<&zb_zdo_power_desc_resp_t::hdr,
+                  &zb_zdo_desc_resp_hdr_t::nwk_addr>>;
 };
 
 // Send Match Descriptor request to a remote device
@@ -1268,20 +1323,20 @@ struct zb_ncp::cmd_handle<ZDO_MATCH_DESC_REQ>
   static constexpr size_t additional_buffer_size = 64;
   static constexpr bool request_is_data = true;
   static constexpr const char *name = "ZDO_MATCH_DESC_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_IEEE_ADDR_REQ::start_request nwk: %04x nwk_addr:
     // %04x",s_req.dst_addr,s_req.nwk_addr);
-    return zb_zdo_match_desc_req(buf, &Base::req_cb);
+    return zb_zdo_match_desc_req(buf, cb);
   }
-  static bool check_arg_size(const void *buffer, size_t len) {
-    if (len < 6)
-      return false;
-    auto arg = static_cast<const ZDO_MATCH_DESC_REQ_arg_t *>(buffer);
-    if ((arg->inputClusterCount + arg->inputClusterCount) > 64) {
-      return false;
-    }
-    return len >= (6 + (arg->inputClusterCount + arg->outputClusterCount) * 2);
+  using Arg = ZDO_MATCH_DESC_REQ_arg_t;
+  static size_t cluster_count(const Arg &arg) {
+    return arg.inputClusterCount + arg.outputClusterCount;
   }
+  using request_schema =
+      wire::schema<wire::field<&Arg::nwk>, wire::field<&Arg::profileID>,
+                   wire::field<&Arg::inputClusterCount>,
+                   wire::field<&Arg::outputClusterCount>,
+                   wire::list<&cluster_count, &Arg::clusters, 64>>;
   static size_t get_request_alloc_size(const ZDO_MATCH_DESC_REQ_arg_t &arg) {
     return sizeof(zb_zdo_match_desc_param_t) - 2 +
            (arg.inputClusterCount + arg.outputClusterCount) * 2;
@@ -1296,24 +1351,16 @@ struct zb_ncp::cmd_handle<ZDO_MATCH_DESC_REQ>
     memcpy(req.cluster_list, arg.clusters,
            (arg.inputClusterCount + arg.outputClusterCount) * 2);
   }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_match_desc_resp_t *resp) {
-    auto out = outdata;
-    *out++ = STATUS_CATEGORY_ZDO;
-    *out++ = resp->status;
-    auto len = resp->match_len;
-    if (len > 64) {
-      ESP_LOGE(TAG, "Truncate ZDO_MATCH_DESC_REQ %d", int(len));
-      len = 64;
-    }
-    *out++ = len;
-    for (uint8_t i = 0; i < len; ++i) {
-      *out++ = reinterpret_cast<const uint8_t *>(resp + 1)[i];
-    }
-    *reinterpret_cast<uint16_t *>(out) = resp->nwk_addr;
-    out += 2;
-    return out - outdata;
+  using Resp = zb_zdo_match_desc_resp_t;
+  static const uint8_t *match_list(const Resp &resp) {
+    return reinterpret_cast<const uint8_t *>(&resp + 1);
   }
+  using response_schema =
+      wire::schema<wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+                   wire::field<&Resp::status>,
+                   wire::count<&Resp::match_len, 64>,
+                   wire::list<&Resp::match_len, &match_list, 64>,
+                   wire::field<&Resp::nwk_addr>>;
 };
 
 // Sends a ZDO Mgmt LQI request to a remote device
@@ -1360,41 +1407,27 @@ struct zb_ncp::cmd_handle<ZDO_MGMT_LQI_REQ>
   static constexpr size_t additional_buffer_size =
       64 * sizeof(zb_zdo_neighbor_table_record_t);
   static constexpr const char *name = "ZDO_MGMT_LQI_REQ";
+  static constexpr bool coalesce = true;
   static void format_request(zb_zdo_mgmt_lqi_param_t &req,
                              const S_ZDO_MGMT_LQI_REQ_arg_t &arg) {
     req.dst_addr = arg.nwk;
     req.start_index = arg.startIndex;
   }
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_MGMT_LQI_REQ::start_request dst_addr: %04x
     // start_index: %d",s_req.dst_addr,int(s_req.start_index));
-    return zb_zdo_mgmt_lqi_req(buf, &Base::req_cb);
-  }
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_mgmt_lqi_resp_t *resp) {
-    auto len = Base::format_response(outdata, resp);
-    auto outwrite = &outdata[len];
-    auto src =
-        reinterpret_cast<const zb_zdo_neighbor_table_record_t *>(resp + 1);
-    auto cnt = resp->neighbor_table_list_count;
-    if (cnt > 64) {
-      ESP_LOGE(TAG, "Truncate ZDO_MGMT_LQI_REQ %d",
-               int(resp->neighbor_table_entries));
-      cnt = 64;
-      reinterpret_cast<zb_zdo_mgmt_lqi_resp_t *>(outdata)
-          ->neighbor_table_list_count = cnt;
-    }
-    ESP_LOGD(
-        TAG,
-        "ZDO_MGMT_LQI_REQ format_response entries:%d start_index: %d len:%d",
-        int(resp->start_index), int(cnt), int(cnt));
-    for (uint8_t i = 0; i < cnt; ++i) {
-      memcpy(outwrite, src, sizeof(zb_zdo_neighbor_table_record_t));
-      outwrite += sizeof(zb_zdo_neighbor_table_record_t);
-      src++;
-    }
-    return outwrite - outdata;
-  }
+    return zb_zdo_mgmt_lqi_req(buf, cb);
+  }
+  using Resp = zb_zdo_mgmt_lqi_resp_t;
+  static const zb_zdo_neighbor_table_record_t *neighbors(const Resp &resp) {
+    return reinterpret_cast<const zb_zdo_neighbor_table_record_t *>(&resp + 1);
+  }
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>, wire::field<&Resp::status>,
+      wire::field<&Resp::neighbor_table_entries>,
+      wire::field<&Resp::start_index>,
+      wire::count<&Resp::neighbor_table_list_count, 64>,
+      wire::list<&Resp::neighbor_table_list_count, &neighbors, 64>>;
 };
 
 // Request that a Remote Device leave the network
@@ -1428,11 +1461,11 @@ struct zb_ncp::cmd_handle<ZDO_MGMT_LEAVE_REQ>
     memcpy(req.device_address, arg.long_addr, 8);
     req.rejoin = (arg.flags & 0x80) ? 1 : 0;
   }
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_MGMT_LEAVE_REQ start_request device_address: "
     // IEEE_ADDR_FMT " dst_addr:%04x
     // ",IEEE_ADDR_PRINT(s_req.device_address),s_req.dst_addr);
-    return zdo_mgmt_leave_req(buf, &Base::req_cb);
+    return zdo_mgmt_leave_req(buf, cb);
   }
 };
 
@@ -1457,17 +1490,18 @@ struct zb_ncp::cmd_handle<ZDO_MGMT_BIND_REQ>
   static constexpr size_t additional_buffer_size =
       64 * sizeof(zb_zdo_binding_table_record_t);
   static constexpr const char *name = "ZDO_MGMT_BIND_REQ";
+  static constexpr bool coalesce = true;
   static void format_request(zb_zdo_mgmt_bind_param_t &req,
                              const ZDO_MGMT_BIND_REQ_args_t &arg) {
     memset(&req, 0, sizeof(zb_zdo_mgmt_bind_param_t));
     req.dst_addr = arg.nwk;
     req.start_index = arg.startIndex;
   }
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_MGMT_LEAVE_REQ start_request device_address: "
     // IEEE_ADDR_FMT " dst_addr:%04x
     // ",IEEE_ADDR_PRINT(s_req.device_address),s_req.dst_addr);
-    return zb_zdo_mgmt_bind_req(buf, &Base::req_cb);
+    return zb_zdo_mgmt_bind_req(buf, cb);
   }
   // const sourceEui64 = this.readIeeeAddr();
   // const sourceEndpoint = this.readUInt8();
@@ -1482,31 +1516,28 @@ struct zb_ncp::cmd_handle<ZDO_MGMT_BIND_REQ>
   //     continue;
   // }
 
-  static uint16_t format_response(uint8_t *outdata,
-                                  const zb_zdo_mgmt_bind_resp_t *resp) {
-    auto len = Base::format_response(outdata, resp);
-    auto outwrite = &outdata[len];
-    auto src =
-        reinterpret_cast<const zb_zdo_binding_table_record_t *>(resp + 1);
-    auto cnt = resp->binding_table_list_count;
-    if (cnt > 64) {
-      ESP_LOGE(TAG, "Truncate ZDO_MGMT_BIND_REQ %d", int(cnt));
-      cnt = 64;
-      reinterpret_cast<zb_zdo_mgmt_bind_resp_t *>(outdata)
-          ->binding_table_list_count = cnt;
-    }
-    for (uint8_t i = 0; i < cnt; ++i) {
-      memcpy(outwrite, src, sizeof(zb_zdo_binding_table_record_t));
-      outwrite += 8 + 1 + 2 + 1;
-      if (src->dst_addr_mode == 0x01) {
-        outwrite += 2; // short addr
-      } else if (src->dst_addr_mode == 0x03) {
-        outwrite += 8 + 1; // long and ep
-      }
-      ++src;
-    }
-    return outwrite - outdata;
-  }
+  using Resp = zb_zdo_mgmt_bind_resp_t;
+  using Record = zb_zdo_binding_table_record_t;
+  static const Record *records(const Resp &resp) {
+    return reinterpret_cast<const Record *>(&resp + 1);
+  }
+  static bool dst_is_group(const Record &r) { return r.dst_addr_mode == 0x01; }
+  static bool dst_is_long(const Record &r) { return r.dst_addr_mode == 0x03; }
+  using record_schema = wire::schema<
+      wire::field<&Record::src_address>, wire::field<&Record::src_endp>,
+      wire::field<&Record::cluster_id>, wire::field<&Record::dst_addr_mode>,
+      wire::when<&dst_is_group,
+                 wire::field<&Record::dst_address, &zb_addr_u::addr_short>>,
+      wire::when<&dst_is_long,
+                 wire::field<&Record::dst_address, &zb_addr_u::addr_long>,
+                 wire::field<&Record::dst_endp>>>;
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>, wire::field<&Resp::status>,
+      wire::field<&Resp::binding_table_entries>,
+      wire::field<&Resp::start_index>,
+      wire::count<&Resp::binding_table_list_count, 64>,
+      wire::list<&Resp::binding_table_list_count, &records, 64,
+                 record_schema>>;
 };
 
 // Sends a ZDO Mgmt NWK Update Request to a remote device
@@ -1532,30 +1563,23 @@ struct zb_ncp::cmd_handle<ZDO_MGMT_NWK_UPDATE_REQ>
   static constexpr size_t additional_buffer_size = 64;
   static constexpr bool request_is_data = false;
   static constexpr const char *name = "ZDO_MGMT_NWK_UPDATE_REQ";
-  static uint8_t start_request(uint8_t buf) {
+  static uint8_t start_request(uint8_t buf, zb_callback_t cb) {
     // ESP_LOGI(TAG,"S_ZDO_MGMT_LEAVE_REQ start_request device_address: "
     // IEEE_ADDR_FMT " dst_addr:%04x
     // ",IEEE_ADDR_PRINT(s_req.device_address),s_req.dst_addr);
-    return zb_zdo_mgmt_nwk_update_req(buf, &Base::req_cb);
-  }
-  static uint16_t
-  format_response(uint8_t *outdata,
-                  const zb_zdo_mgmt_nwk_update_notify_hdr_t *resp) {
-    auto len = Base::format_response(outdata, resp);
-    auto outwrite = &outdata[len];
-    auto src = reinterpret_cast<const uint8_t *>(resp + 1);
-    auto cnt = resp->scanned_channels_list_count;
-    if (cnt > 64) {
-      ESP_LOGE(TAG, "Truncate ZDO_MGMT_NWK_UPDATE_REQ %d", int(cnt));
-      cnt = 64;
-      reinterpret_cast<zb_zdo_mgmt_nwk_update_notify_hdr_t *>(outdata)
-          ->scanned_channels_list_count = cnt;
-    }
-    for (uint8_t i = 0; i < cnt; ++i) {
-      *outwrite++ = *src++;
-    }
-    return outwrite - outdata;
-  }
+    return zb_zdo_mgmt_nwk_update_req(buf, cb);
+  }
+  using Resp = zb_zdo_mgmt_nwk_update_notify_hdr_t;
+  static const uint8_t *energy_values(const Resp &resp) {
+    return reinterpret_cast<const uint8_t *>(&resp + 1);
+  }
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>, wire::field<&Resp::status>,
+      wire::field<&Resp::scanned_channels>,
+      wire::field<&Resp::total_transmissions>,
+      wire::field<&Resp::transmission_failures>,
+      wire::count<&Resp::scanned_channels_list_count, 64>,
+      wire::list<&Resp::scanned_channels_list_count, &energy_values, 64>>;
 };
 
 // APSDE-DATA.request
@@ -1650,7 +1674,7 @@ struct apsde_data_req_arg_nep_t {
   apsde_data_req_base_nep_t base;
 } __attribute__((packed));
 
-static constexpr size_t MAX_APSDE_DATA_REQ_SIZE = 256;
+static constexpr size_t MAX_APSDE_DATA_REQ_SIZE = zb_ncp::MAX_APS_PAYLOAD_SIZE;
 
 struct APSDE_DATA_REQ_max_arg_t {
   apsde_data_req_arg_t hdr;
@@ -1661,6 +1685,8 @@ struct APSDE_DATA_REQ_max_arg_nep_t {
   apsde_data_req_arg_nep_t hdr;
   uint8_t data[MAX_APSDE_DATA_REQ_SIZE];
 } __attribute__((packed));
+static_assert(sizeof(APSDE_DATA_REQ_max_arg_t) <= payload_arena::MAX_SIZE &&
+              sizeof(APSDE_DATA_REQ_max_arg_nep_t) <= payload_arena::MAX_SIZE);
 
 struct zb_apsde_data_resp_t {
   uint8_t addr[8];      // 0
@@ -1677,15 +1703,39 @@ static_assert(sizeof(zb_apsde_data_resp_t) == 0x19);
 
 template <>
 struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
-    : request_cmd_resolver<APSDE_DATA_REQ, APSDE_DATA_REQ_max_arg_t>,
-      cmd_base<cmd_handle<APSDE_DATA_REQ>> {
+    : cmd_base<cmd_handle<APSDE_DATA_REQ>> {
   static constexpr const char *name = "APSDE_DATA_REQ";
   using Cmd = cmd_handle<APSDE_DATA_REQ>;
   using CmdBase = cmd_base<zb_ncp::cmd_handle<APSDE_DATA_REQ>>;
-  using ResolveStrategy =
-      request_cmd_resolver<APSDE_DATA_REQ, APSDE_DATA_REQ_max_arg_t>;
   using Arg = apsde_data_req_arg_t;
 
+  // Requests waiting for their APS confirm, keyed by the ZCL tsn of the
+  // payload. Each waits in a coroutine frame, so there is room for all.
+  inline static zb_coro::keyed_waiters<zb_coro::FRAME_COUNT> s_confirms;
+  // ZBOSS always confirms, after its retries (and the indirect queue of a
+  // sleepy device) are used up; this only covers a confirm that is lost.
+  static constexpr uint32_t CONFIRM_TIMEOUT_MS = 30000;
+
+  // Frames sent without an APS ack (group and broadcast) take a lighter path
+  // than run(): no coroutine, the request waits in one of these slots for
+  // its buffer and is answered from the confirm, which comes as soon as the
+  // frame is on air. Their grants are held outside coroutines, see
+  // tx_sched::MAX_DIRECT_GRANTS.
+  static constexpr size_t MAX_UNACKED = tx_sched::MAX_DIRECT_GRANTS;
+  static constexpr uint32_t UNACKED_TIMEOUT_MS = 10000;
+  enum : uint8_t { UNACKED_FREE, UNACKED_BUFFER, UNACKED_SENT };
+  struct unacked_t {
+    std::atomic<uint8_t> state;
+    zb_ncp::cmd_t cmd;
+    uint8_t tsn;
+    uint8_t addr_mode;
+    uint8_t addr[8];
+    uint16_t len;
+    tx_sched::grant grant;
+    payload_arena::block payload;
+  };
+  inline static unacked_t s_unacked[MAX_UNACKED];
+
   //         {name: 'ieee', type: DataType.IEEE_ADDR},
   //         {name: 'dstEndpoint', type: DataType.UINT8,
   //                 condition: (payload) => [2, 3].includes(payload.dstAddrMode)},
@@ -1693,26 +1743,27 @@ struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
   //         {name: 'txTime', type: DataType.UINT32},
   //         {name: 'dstAddrMode', type: DataType.UINT8},
 
-  static void handle_response(ResolveStrategy::request_t &req,
+  using Resp = zb_apsde_data_resp_t;
+  static bool has_dst_endpoint(const Resp &resp) {
+    return resp.dst_addr_mode == 2 || resp.dst_addr_mode == 3;
+  }
+  using response_schema = wire::schema<
+      wire::constant<uint8_t(STATUS_CATEGORY_APS)>, wire::constant<uint8_t(0)>,
+      wire::field<&Resp::addr>,
+      wire::when<&has_dst_endpoint, wire::field<&Resp::dst_endpoint>>,
+      wire::field<&Resp::src_endpoint>, wire::field<&Resp::tx_time>,
+      wire::field<&Resp::dst_addr_mode>>;
+
+  static void handle_response(const zb_ncp::cmd_t &cmd,
                               const zb_apsde_data_resp_t *resp) {
-    uint8_t outdata[sizeof(zb_ncp::cmd_t) + 8 + 1 + 1 + 4 + 1];
+    uint8_t outdata[sizeof(zb_ncp::cmd_t) + 2 + 8 + 1 + 1 + 4 + 1];
     zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
-    *out_cmd = req.cmd;
+    *out_cmd = cmd;
     out_cmd->type = zb_ncp::RESPONSE;
-    auto out = reinterpret_cast<uint8_t *>(out_cmd + 1);
-    *out++ = STATUS_CATEGORY_APS;
-    *out++ = 0;
-    memcpy(out, resp->addr, 8);
-    out += 8;
-    if (resp->dst_addr_mode == 2 || resp->dst_addr_mode == 3) {
-      *out++ = resp->dst_endpoint;
-    }
-    *out++ = resp->src_endpoint;
-    *reinterpret_cast<uint32_t *>(out) = resp->tx_time;
-    out += 4;
-    *out++ = resp->dst_addr_mode;
-
-    zb_ncp::send_cmd_data(outdata, out - outdata);
+    auto len = response_schema::encode(
+        reinterpret_cast<uint8_t *>(out_cmd + 1),
+        sizeof(outdata) - sizeof(zb_ncp::cmd_t), *resp);
+    zb_ncp::send_cmd_data(outdata, sizeof(zb_ncp::cmd_t) + len);
   }
   static void aps_user_payload_callback(uint8_t param) {
     if (param) {
@@ -1728,22 +1779,23 @@ struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
           ind->dst_endpoint, ind->src_endpoint, IEEE_ADDR_PRINT(ind->addr),
           int(ind->dst_addr_mode), int(data_ptr[1]), int(len), data_ptr);
 
-      auto req = ResolveStrategy::resolve(data_ptr[1]);
-      if (req) {
-        ESP_LOGD(TAG, "%s::aps_user_payload_callback %d", Cmd::name,
-                 int(data_ptr[1]));
-        if (ind->status == 0) {
-          Cmd::handle_response(*req, ind);
-        } else {
-          report_failed(req->cmd, ind->status);
-        }
-        req->state = ResolveStrategy::request_t::S_NONE;
-      } else {
+      // The NCP's own OTA replies first: the host picks its tsns without
+      // knowing of them.
+      if (ota_server::on_confirm(ind->dst_addr_mode, ind->addr,
+                                 ind->dst_endpoint, data_ptr, len)) {
+        zb_buf_free(param);
+        return;
+      }
+      // Before the host's acked requests: those are matched on the tsn
+      // alone, and a group or broadcast frame may carry the same one.
+      if (unacked_confirm(*ind, data_ptr[1], param)) {
+        return;
+      }
+      if (!s_confirms.resume(data_ptr[1], param)) {
         ESP_LOGW(TAG, "%s not found request for response %d", Cmd::name,
                  int(data_ptr[1]));
+        zb_buf_free(param);
       }
-
-      zb_buf_free(param);
     }
   }
 
@@ -1755,19 +1807,36 @@ struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
     return 0;
   }
 
+  // Calls fn with the request in its layout: with or without dst_endpoint.
+  template <typename Fn>
+  static auto visit_arg(APSDE_DATA_REQ_max_arg_t &arg, Fn &&fn) {
+    if (arg.hdr.paramLength == 21) {
+      return fn(arg);
+    }
+    return fn(*reinterpret_cast<APSDE_DATA_REQ_max_arg_nep_t *>(&arg));
+  }
+
+  // Every unicast is acked, as before: hosts do not agree on the tx_options
+  // bits (zigbee-herdsman sends 2 for an acked unicast), so they cannot
+  // tell an unacked request apart.
+  template <typename Base>
+  static bool wants_ack(const Base &base) {
+    if (base.addr_mode == ZB_APS_ADDR_MODE_16_GROUP_ENDP_NOT_PRESENT) {
+      return false;
+    }
+    uint16_t short_addr;
+    memcpy(&short_addr, base.addr_data, sizeof(short_addr));
+    return base.addr_mode == ZB_APS_ADDR_MODE_64_ENDP_PRESENT ||
+           !ZB_NWK_IS_ADDRESS_BROADCAST(short_addr);
+  }
+
   template <typename ArgVar>
-  static zb_ret_t start_request(uint8_t buf, ArgVar &arg,
-                                ResolveStrategy::request_t &req) {
+  static zb_ret_t start_request(uint8_t buf, const ArgVar &arg) {
     zb_addr_u dst_addr;
     memcpy(&dst_addr, arg.hdr.base.addr_data, 8);
 
-    if (arg.hdr.base.tx_options & 2) {
-
-    } else {
-    }
-    req.tsn = arg.data[1];
     ESP_LOGI(TAG,"<<<<< zb_aps_send_user_payload %d -> %d, %d len: %d",int(arg.hdr.base.src_endpoint),
-      int(get_dst_endpoint(arg.hdr.base)),int(req.tsn),int(arg.hdr.dataLength));
+      int(get_dst_endpoint(arg.hdr.base)),int(arg.data[1]),int(arg.hdr.dataLength));
     ESP_LOGI(TAG, "paramLength = %i", (int)arg.hdr.paramLength);
     ESP_LOGI(TAG, "dataLength = %i", (int)arg.hdr.dataLength);
     ESP_LOGI(TAG, "hdr.addr_data(c) = 0x%04x", dst_addr.addr_short);
@@ -1787,33 +1856,172 @@ struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
     auto ret = zb_aps_send_user_payload(
         buf, dst_addr, arg.hdr.base.profile_id, arg.hdr.base.cluster_id,
         get_dst_endpoint(arg.hdr.base), arg.hdr.base.src_endpoint,
-        arg.hdr.base.addr_mode,
-        ZB_TRUE, // s->base.tx_options & 1 ? ZB_FALSE : ZB_TRUE,
-        arg.data, arg.hdr.dataLength);
+        arg.hdr.base.addr_mode, wants_ack(arg.hdr.base) ? ZB_TRUE : ZB_FALSE,
+        const_cast<uint8_t *>(arg.data), arg.hdr.dataLength);
 
     return ret;
   }
-  static void do_request(uint8_t buf, uint16_t req_arg) {
+
+  // The request stays in its arena block, only the handle is in the frame.
+  static zb_coro::task run(zb_ncp::cmd_t cmd, payload_arena::block payload,
+                           size_t len) {
+    auto &arg = *payload.as<APSDE_DATA_REQ_max_arg_t>();
+    // Wait for a turn of the destination (see tx_sched.h); released when the
+    // confirm arrives or the request fails. The outcome feeds the congestion
+    // window, when it is exhausted the host is told to back off.
+    if (!co_await zb_coro::schedule()) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    auto grant = co_await visit_arg(arg, [len](const auto &a) {
+      return tx_sched::admit(a.hdr.base.addr_mode, a.hdr.base.addr_data,
+                             a.hdr.base.cluster_id, len);
+    });
+    if (grant.busy()) {
+      report_failed(cmd, GENERIC_BUSY);
+      co_return;
+    }
+    auto buf = co_await zb_coro::buf_get_out(len);
+    if (!buf) {
+      grant.complete(false);
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
+    }
     zb_aps_set_user_data_tx_cb(&aps_user_payload_callback);
 
-    // Req* request_data;
-    auto &req = ResolveStrategy::get_by_index(req_arg);
+    auto ret = visit_arg(
+        arg, [buf](const auto &a) { return start_request(buf, a); });
+    if (ret != 0) {
+      ESP_LOGE(TAG, "failed zb_aps_send_user_payload %02x", int(ret));
+      grant.complete(false);
+      report_failed(cmd, ret);
+      co_return;
+    }
 
-    req.state = ResolveStrategy::request_t::S_EXEC;
-    zb_ret_t ret;
-    if (req.arg.hdr.paramLength == 21) {
-      auto &arg = req.arg;
-      ret = start_request(buf, arg, req);
+    // The confirm is delivered through the ZBOSS scheduler, never from
+    // inside zb_aps_send_user_payload, so waiting after the send is safe.
+    auto tsn = visit_arg(arg, [](const auto &a) { return a.data[1]; });
+    auto confirm = s_confirms.wait(tsn, CONFIRM_TIMEOUT_MS);
+    auto param = co_await confirm;
+    if (!param) {
+      // The frame went out, but its outcome is unknown.
+      ESP_LOGW(TAG, "%s no confirm for tsn %d", Cmd::name, int(tsn));
+      grant.complete(false);
+      report_failed(cmd, confirm.timed_out() ? GENERIC_TIMEOUT
+                                             : GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    auto resp = ZB_BUF_GET_PARAM(param, zb_apsde_data_resp_t);
+    ESP_LOGD(TAG, "%s::aps_user_payload_callback %d", Cmd::name, int(tsn));
+    grant.complete(resp->status == 0);
+    if (resp->status == 0) {
+      Cmd::handle_response(cmd, resp);
     } else {
-      auto &arg = *reinterpret_cast<APSDE_DATA_REQ_max_arg_nep_t *>(&req.arg);
-      ret = start_request(buf, arg, req);
+      report_failed(cmd, resp->status);
+    }
+    zb_buf_free(param);
+  }
+
+  static void send_unacked(const zb_ncp::cmd_t &cmd,
+                           payload_arena::block payload, size_t len) {
+    for (uint16_t slot = 0; slot < MAX_UNACKED; ++slot) {
+      auto &u = s_unacked[slot];
+      uint8_t expected = UNACKED_FREE;
+      if (!u.state.compare_exchange_strong(expected, UNACKED_BUFFER)) {
+        continue;
+      }
+      u.cmd = cmd;
+      u.len = len;
+      u.payload = std::move(payload);
+      if (zb_buf_get_out_delayed_ext(&unacked_buffer, slot, len) != RET_OK) {
+        u.payload.reset();
+        u.state = UNACKED_FREE;
+        report_failed(cmd, GENERIC_NO_RESOURCES);
+      }
+      return;
+    }
+    report_failed(cmd, GENERIC_BUSY);
+  }
+
+  static void unacked_buffer(zb_bufid_t buf, zb_uint16_t slot) {
+    auto &u = s_unacked[slot];
+    auto &arg = *u.payload.as<APSDE_DATA_REQ_max_arg_t>();
+    u.grant = visit_arg(arg, [&u](const auto &a) {
+      return tx_sched::try_admit(a.hdr.base.addr_mode, a.hdr.base.addr_data,
+                                 a.hdr.base.cluster_id, u.len);
+    });
+    if (u.grant.busy()) {
+      zb_buf_free(buf);
+      report_failed(u.cmd, GENERIC_BUSY);
+      u.payload.reset();
+      u.state = UNACKED_FREE;
+      return;
     }
+    zb_aps_set_user_data_tx_cb(&aps_user_payload_callback);
+    auto ret = visit_arg(
+        arg, [buf](const auto &a) { return start_request(buf, a); });
     if (ret != 0) {
       ESP_LOGE(TAG, "failed zb_aps_send_user_payload %02x", int(ret));
-      req.state = ResolveStrategy::request_t::S_NONE;
-      report_failed(req.cmd, ret);
+      u.grant.complete(false);
+      report_failed(u.cmd, ret);
+      u.payload.reset();
+      u.state = UNACKED_FREE;
+      return;
+    }
+    // ZBOSS has copied the payload into buf
+    visit_arg(arg, [&u](const auto &a) {
+      u.tsn = a.data[1];
+      u.addr_mode = a.hdr.base.addr_mode;
+      memcpy(u.addr, a.hdr.base.addr_data, sizeof(u.addr));
+    });
+    u.payload.reset();
+    u.state = UNACKED_SENT;
+    ZB_SCHEDULE_APP_ALARM(
+        &unacked_timeout, slot,
+        ZB_MILLISECONDS_TO_BEACON_INTERVAL(UNACKED_TIMEOUT_MS));
+  }
+
+  static bool unacked_matches(const unacked_t &u,
+                              const zb_apsde_data_resp_t &resp, uint8_t tsn) {
+    if (u.state != UNACKED_SENT || u.tsn != tsn ||
+        u.addr_mode != resp.dst_addr_mode) {
+      return false;
+    }
+    auto addr_len = u.addr_mode == ZB_APS_ADDR_MODE_64_ENDP_PRESENT ? 8 : 2;
+    return memcmp(u.addr, resp.addr, addr_len) == 0;
+  }
+
+  static bool unacked_confirm(const zb_apsde_data_resp_t &resp, uint8_t tsn,
+                              zb_bufid_t param) {
+    for (uint8_t slot = 0; slot < MAX_UNACKED; ++slot) {
+      auto &u = s_unacked[slot];
+      if (!unacked_matches(u, resp, tsn)) {
+        continue;
+      }
+      ZB_SCHEDULE_APP_ALARM_CANCEL(&unacked_timeout, slot);
+      u.grant.complete(resp.status == 0);
+      if (resp.status == 0) {
+        Cmd::handle_response(u.cmd, &resp);
+      } else {
+        report_failed(u.cmd, resp.status);
+      }
+      zb_buf_free(param);
+      u.state = UNACKED_FREE;
+      return true;
+    }
+    return false;
+  }
+
+  // No confirm came; a late one finds the slot free and is dropped.
+  static void unacked_timeout(uint8_t slot) {
+    auto &u = s_unacked[slot];
+    if (u.state != UNACKED_SENT) {
       return;
     }
+    ESP_LOGW(TAG, "%s no confirm for tsn %d", Cmd::name, int(u.tsn));
+    u.grant.complete(false);
+    report_failed(u.cmd, GENERIC_TIMEOUT);
+    u.state = UNACKED_FREE;
   }
 
   static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
@@ -1831,25 +2039,1027 @@ struct zb_ncp::cmd_handle<APSDE_DATA_REQ>
       report_failed(cmd, GENERIC_INVALID_PARAMETER);
       return;
     }
-    auto req = ResolveStrategy::start_resolve(cmd);
-    if (!req) {
-      report_failed(cmd, GENERIC_OUT_OF_RANGE);
+    if (offsetof(Arg, base) + arg->paramLength + arg->dataLength > len) {
+      report_failed(cmd, GENERIC_INVALID_PARAMETER);
       return;
     }
-    req->state = ResolveStrategy::request_t::S_ALLOCATION;
-    memcpy(&req->arg, buffer, len);
-    auto ret = zb_buf_get_out_delayed_ext(
-        &do_request, ResolveStrategy::get_req_idx(req), len);
-
-    //
-    // auto ret =
-    // zb_buf_get_out_delayed_ext(&do_request,ResolveStrategy::get_req_idx(req),sizeof(Req));
-    if (ret != 0) {
-      req->state = ResolveStrategy::request_t::S_NONE;
+    auto payload = payload_arena::copy(buffer, len);
+    if (!payload) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      return;
+    }
+    auto &req = *payload.as<APSDE_DATA_REQ_max_arg_t>();
+    if (!visit_arg(req, [](const auto &a) { return wants_ack(a.hdr.base); })) {
+      send_unacked(cmd, std::move(payload), len);
+      return;
+    }
+    if (!run(cmd, std::move(payload), len)) {
       report_failed(cmd, GENERIC_NO_RESOURCES);
     } else {
       ESP_LOGD(TAG, "%s::do_start", Cmd::name);
     }
-    // return ESP_OK;
+  }
+};
+
+// Address lookups are answered from addr_cache (see addr_cache.h), so the
+// host does not wait for the ZBOSS context on every frame it builds.
+
+// [CommandId.NWK_GET_IEEE_BY_SHORT]: {
+//     request: [{name: 'nwk', type: DataType.UINT16}],
+//     response: [...commonResponse, {name: 'ieee', type: DataType.IEEE_ADDR}],
+// },
+struct NWK_GET_IEEE_BY_SHORT_resp_t {
+  uint8_t ieee[8];
+} __attribute__((packed));
+template <>
+struct zb_ncp::cmd_handle<NWK_GET_IEEE_BY_SHORT>
+    : cached_lookup_process<NWK_GET_IEEE_BY_SHORT, uint16_t,
+                            NWK_GET_IEEE_BY_SHORT_resp_t> {
+  static constexpr const char *name = "NWK_GET_IEEE_BY_SHORT";
+  static bool lookup(uint16_t nwk, NWK_GET_IEEE_BY_SHORT_resp_t &res) {
+    addr_cache::entry_t e;
+    if (!addr_cache::find_by_nwk(nwk, e)) {
+      return false;
+    }
+    memcpy(res.ieee, e.ieee, sizeof(res.ieee));
+    return true;
+  }
+  static bool lookup_stack(uint16_t nwk, NWK_GET_IEEE_BY_SHORT_resp_t &res) {
+    if (zb_address_ieee_by_short(nwk, res.ieee) != RET_OK) {
+      return false;
+    }
+    addr_cache::update(res.ieee, nwk);
+    return true;
+  }
+};
+
+// [CommandId.NWK_GET_SHORT_BY_IEEE]: {
+//     request: [{name: 'ieee', type: DataType.IEEE_ADDR}],
+//     response: [...commonResponse, {name: 'nwk', type: DataType.UINT16}],
+// },
+struct NWK_GET_SHORT_BY_IEEE_arg_t {
+  uint8_t ieee[8];
+} __attribute__((packed));
+template <>
+struct zb_ncp::cmd_handle<NWK_GET_SHORT_BY_IEEE>
+    : cached_lookup_process<NWK_GET_SHORT_BY_IEEE, NWK_GET_SHORT_BY_IEEE_arg_t,
+                            uint16_t> {
+  static constexpr const char *name = "NWK_GET_SHORT_BY_IEEE";
+  static bool lookup(const NWK_GET_SHORT_BY_IEEE_arg_t &arg, uint16_t &nwk) {
+    addr_cache::entry_t e;
+    if (!addr_cache::find_by_ieee(arg.ieee, e)) {
+      return false;
+    }
+    nwk = e.nwk;
+    return true;
+  }
+  static bool lookup_stack(const NWK_GET_SHORT_BY_IEEE_arg_t &arg,
+                           uint16_t &nwk) {
+    nwk = zb_address_short_by_ieee(arg.ieee);
+    if (nwk == ZB_UNKNOWN_SHORT_ADDR) {
+      return false;
+    }
+    addr_cache::update(arg.ieee, nwk);
+    return true;
+  }
+};
+
+// [CommandId.NWK_GET_NEIGHBOR_BY_IEEE]: {
+//     request: [{name: 'ieee', type: DataType.IEEE_ADDR}],
+//     response: [
+//         ...commonResponse,
+//         {name: 'ieee', type: DataType.IEEE_ADDR},
+//         {name: 'nwk', type: DataType.UINT16},
+//         {name: 'role', type: DataType.UINT8},
+//         {name: 'rxOnWhenIdle', type: DataType.UINT8},
+//         {name: 'edConfig', type: DataType.UINT16},
+//         {name: 'timeoutCounter', type: DataType.UINT32},
+//         {name: 'deviceTimeout', type: DataType.UINT32},
+//         {name: 'relationship', type: DataType.UINT8},
+//         {name: 'transmitFailure', type: DataType.UINT8},
+//         {name: 'lqi', type: DataType.UINT8},
+//         {name: 'outgoingCost', type: DataType.UINT8},
+//         {name: 'age', type: DataType.UINT8},
+//         {name: 'keepaliveRcv', type: DataType.UINT8},
+//         {name: 'macIfaceIdx', type: DataType.UINT8},
+//     ],
+// },
+struct NWK_GET_NEIGHBOR_BY_IEEE_resp_t {
+  uint8_t ieee[8];
+  uint16_t nwk;
+  uint8_t role;
+  uint8_t rxOnWhenIdle;
+  uint16_t edConfig;
+  uint32_t timeoutCounter;
+  uint32_t deviceTimeout;
+  uint8_t relationship;
+  uint8_t transmitFailure;
+  uint8_t lqi;
+  uint8_t outgoingCost;
+  uint8_t age;
+  uint8_t keepaliveRcv;
+  uint8_t macIfaceIdx;
+} __attribute__((packed));
+template <>
+struct zb_ncp::cmd_handle<NWK_GET_NEIGHBOR_BY_IEEE>
+    : cached_lookup_process<NWK_GET_NEIGHBOR_BY_IEEE,
+                            NWK_GET_SHORT_BY_IEEE_arg_t,
+                            NWK_GET_NEIGHBOR_BY_IEEE_resp_t> {
+  static constexpr const char *name = "NWK_GET_NEIGHBOR_BY_IEEE";
+  // Only what the cache tracks is filled in; timeouts, costs and counters
+  // are reported as 0.
+  static bool lookup(const NWK_GET_SHORT_BY_IEEE_arg_t &arg,
+                     NWK_GET_NEIGHBOR_BY_IEEE_resp_t &res) {
+    addr_cache::entry_t e;
+    if (!addr_cache::find_by_ieee(arg.ieee, e) ||
+        !(e.flags & addr_cache::FLAG_NEIGHBOR)) {
+      return false;
+    }
+    memcpy(res.ieee, e.ieee, sizeof(res.ieee));
+    res.nwk = e.nwk;
+    if (e.flags & addr_cache::FLAG_CAPABILITY) {
+      bool router = e.capability & 0x02;
+      res.role = router ? 1 : 2;          // ZR : ZED
+      res.rxOnWhenIdle = (e.capability & 0x08) ? 1 : 0;
+      res.relationship = router ? 3 : 1;  // none : child
+    } else {
+      res.role = 1;
+      res.rxOnWhenIdle = 1;
+      res.relationship = 3;
+    }
+    res.lqi = e.lqi;
+    auto age = esp_timer_get_time() / 1000000 - e.last_seen;
+    res.age = age > 0xff ? 0xff : uint8_t(age);
+    return true;
+  }
+};
+
+// Vendor extensions. Request/response layouts follow the buffalo schema
+// notation used above.
+
+// Pack indications into VENDOR_IND_BATCH frames (see ind_sender.h)
+// [VendorCommandId.SET_IND_BATCHING]: {
+//     request: [
+//         {name: 'enabled', type: DataType.UINT8},
+//         {name: 'windowMs', type: DataType.UINT16},
+//         {name: 'maxFrame', type: DataType.UINT16},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_IND_BATCHING>
+    : immediate_cmd_process<VENDOR_SET_IND_BATCHING>,
+      general_status_arg<VENDOR_SET_IND_BATCHING, ind_sender::config_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const ind_sender::config_t &config) {
+    if (!ind_sender::configure(config)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// Hold indications while the host is away and replay them in
+// VENDOR_IND_REPLAY frames when it is back (see ind_store.h)
+// [VendorCommandId.SET_IND_STORE]: {
+//     request: [
+//         {name: 'enabled', type: DataType.UINT8},
+//         {name: 'spill', type: DataType.UINT8},
+//         {name: 'hostTimeoutMs', type: DataType.UINT16},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_IND_STORE>
+    : immediate_cmd_process<VENDOR_SET_IND_STORE>,
+      general_status_arg<VENDOR_SET_IND_STORE, ind_store::config_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const ind_store::config_t &config) {
+    if (!ind_store::configure(config)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// Bypass the ZDO descriptor cache, or drop what it holds (see desc_cache.h).
+// [VendorCommandId.SET_DESC_CACHE]: {
+//     request: [
+//         {name: 'enabled', type: DataType.UINT8},
+//         {name: 'clear', type: DataType.UINT8},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_DESC_CACHE>
+    : immediate_cmd_process<VENDOR_SET_DESC_CACHE>,
+      general_status_arg<VENDOR_SET_DESC_CACHE, desc_cache::config_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const desc_cache::config_t &config) {
+    if (!desc_cache::configure(config)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// Install a rule into the indication filter table (see ind_filter.h).
+// index 0xFF clears the whole table.
+// [VendorCommandId.SET_IND_FILTER]: {
+//     request: [
+//         {name: 'index', type: DataType.UINT8},
+//         {name: 'action', type: DataType.UINT8},
+//         {name: 'srcNwk', type: DataType.UINT16},
+//         {name: 'srcEndpoint', type: DataType.UINT8},
+//         {name: 'clusterID', type: DataType.UINT16},
+//         {name: 'commandID', type: DataType.UINT8},
+//         {name: 'minIntervalMs', type: DataType.UINT16},
+//     ],
+//     response: [...commonResponse],
+// },
+struct VENDOR_SET_IND_FILTER_arg_t {
+  uint8_t index;
+  ind_filter::rule_t rule;
+} __attribute__((packed));
+
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_IND_FILTER>
+    : immediate_cmd_process<VENDOR_SET_IND_FILTER>,
+      general_status_arg<VENDOR_SET_IND_FILTER, VENDOR_SET_IND_FILTER_arg_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const VENDOR_SET_IND_FILTER_arg_t &arg) {
+    if (arg.index == 0xFF) {
+      ind_filter::clear();
+    } else if (!ind_filter::set_rule(arg.index, arg.rule)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// Full ZDO discovery of one device in a single round trip: the node
+// descriptor, the active endpoints and the simple descriptor of every
+// endpoint, requested one after another on the NCP. Every record holds the
+// payload the matching ZDO_*_REQ command would have responded with.
+// Descriptors already in desc_cache are not requested again.
+// [VendorCommandId.INTERVIEW]: {
+//     request: [{name: 'nwk', type: DataType.UINT16}],
+//     response: [
+//         ...commonResponse,
+//         {name: 'count', type: DataType.UINT8},
+//         {name: 'records', type: LIST, options: (payload, options) =>
+//         (options.length = payload.count)}, // {commandId: UINT16, len: UINT8, payload}
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_INTERVIEW>
+    : cmd_base<cmd_handle<VENDOR_INTERVIEW>> {
+  static constexpr const char *name = "VENDOR_INTERVIEW";
+  static constexpr ncp_status_category_t status_category = STATUS_CATEGORY_ZDO;
+  static constexpr size_t MAX_RESPONSE = 1024;
+  static constexpr size_t MAX_ENDPOINTS = 16;
+  // Interviews run at the same time, each builds its response in one of
+  // these buffers.
+  static constexpr size_t MAX_INTERVIEWS = 2;
+  alignas(4) inline static uint8_t s_buffers[MAX_INTERVIEWS][MAX_RESPONSE];
+  inline static std::atomic<uint32_t> s_buffers_used{0};
+
+  struct record_hdr_t {
+    uint16_t command_id;
+    uint8_t len;
+  } __attribute__((packed));
+  static constexpr size_t HDR_SIZE =
+      sizeof(zb_ncp::cmd_t) + sizeof(generic_response_t) + 1;
+
+  struct response_t {
+    uint8_t *data = nullptr;
+    size_t len = HDR_SIZE;
+    uint8_t count = 0;
+    uint8_t eps[MAX_ENDPOINTS];
+    uint8_t ep_count = 0;
+
+    response_t() {
+      auto used = s_buffers_used.load();
+      while (true) {
+        auto free = ~used & ((uint32_t(1) << MAX_INTERVIEWS) - 1);
+        if (!free) {
+          return;
+        }
+        auto idx = __builtin_ctz(free);
+        if (s_buffers_used.compare_exchange_weak(used,
+                                                 used | (uint32_t(1) << idx))) {
+          data = s_buffers[idx];
+          return;
+        }
+      }
+    }
+    ~response_t() {
+      if (data) {
+        auto idx = (data - s_buffers[0]) / MAX_RESPONSE;
+        s_buffers_used.fetch_and(~(uint32_t(1) << idx));
+      }
+    }
+    response_t(const response_t &) = delete;
+    response_t &operator=(const response_t &) = delete;
+  };
+
+  // One request of the sequence.
+  struct step_t {
+    command_id_t command_id;
+    union {
+      zb_zdo_node_desc_req_t node;
+      uint16_t active_ep;
+      zb_zdo_simple_desc_req_t simple;
+    } arg;
+  };
+  template <command_id_t Step>
+  using step_tag = std::integral_constant<command_id_t, Step>;
+  template <typename F> static auto visit(const step_t &step, F &&f) {
+    switch (step.command_id) {
+    case ZDO_NODE_DESC_REQ:
+      return f(step_tag<ZDO_NODE_DESC_REQ>{}, step.arg.node);
+    case ZDO_ACTIVE_EP_REQ:
+      return f(step_tag<ZDO_ACTIVE_EP_REQ>{}, step.arg.active_ep);
+    default:
+      return f(step_tag<ZDO_SIMPLE_DESC_REQ>{}, step.arg.simple);
+    }
+  }
+
+  template <command_id_t Step>
+  static bool append(response_t &out,
+                     const typename cmd_handle<Step>::RespType *resp) {
+    using StepCmd = cmd_handle<Step>;
+    if (out.len + sizeof(record_hdr_t) + StepCmd::resp_buffer_size >
+        MAX_RESPONSE) {
+      return false;
+    }
+    auto rec = out.data + out.len;
+    auto len = StepCmd::format_response(rec + sizeof(record_hdr_t), resp);
+    if (!len) {
+      return false;
+    }
+    record_hdr_t hdr = {.command_id = Step, .len = static_cast<uint8_t>(len)};
+    memcpy(rec, &hdr, sizeof(hdr));
+    out.len += sizeof(hdr) + len;
+    ++out.count;
+    if constexpr (Step == ZDO_ACTIVE_EP_REQ) {
+      out.ep_count = std::min<size_t>(resp->ep_count, MAX_ENDPOINTS);
+      memcpy(out.eps, StepCmd::ep_list(*resp), out.ep_count);
+    }
+    return true;
+  }
+  static bool append_cached(response_t &out, const step_t &step) {
+    return visit(step, [&](auto tag, const auto &arg) {
+      using StepCmd = cmd_handle<decltype(tag)::value>;
+      alignas(4) uint8_t cached[desc_cache::MAX_DATA];
+      size_t len;
+      if (!desc_cache::get(StepCmd::cache_key(arg), cached, len)) {
+        return false;
+      }
+      return append<decltype(tag)::value>(
+          out,
+          reinterpret_cast<const typename StepCmd::RespType *>(cached));
+    });
+  }
+  static size_t request_size(const step_t &step) {
+    return visit(step, [](auto tag, const auto &arg) {
+      return cmd_handle<decltype(tag)::value>::get_request_alloc_size(arg);
+    });
+  }
+  static zb_coro::zdo_request::start_fn fill_request(zb_bufid_t buf,
+                                                    const step_t &step) {
+    return visit(step, [&](auto tag, const auto &arg) {
+      using StepCmd = cmd_handle<decltype(tag)::value>;
+      auto req = static_cast<typename StepCmd::ReqType *>(
+          zb_buf_initial_alloc(buf, StepCmd::get_request_alloc_size(arg)));
+      StepCmd::format_request(*req, arg);
+      return zb_coro::zdo_request::start_fn(&StepCmd::start_request);
+    });
+  }
+  // Appends the response in resp_buf and releases it; returns the status.
+  static uint8_t complete(response_t &out, const step_t &step,
+                          zb_bufid_t resp_buf) {
+    auto status = visit(step, [&](auto tag, const auto &arg) -> uint8_t {
+      using StepCmd = cmd_handle<decltype(tag)::value>;
+      using Resp = typename StepCmd::RespType;
+      auto resp = static_cast<const Resp *>(zb_buf_begin(resp_buf));
+      uint8_t status = resp_parser<Resp>::get_status(resp);
+      if (status != 0) {
+        return status;
+      }
+      desc_cache::put(StepCmd::cache_key(arg), resp, zb_buf_len(resp_buf));
+      return append<decltype(tag)::value>(out, resp) ? 0
+                                                     : GENERIC_OUT_OF_RANGE;
+    });
+    zb_buf_free(resp_buf);
+    return status;
+  }
+
+  static zb_coro::task run(zb_ncp::cmd_t cmd, uint16_t nwk) {
+    response_t out;
+    if (!out.data) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    step_t step = {.command_id = ZDO_NODE_DESC_REQ};
+    step.arg.node.nwk_addr = nwk;
+    size_t next_ep = 0;
+    while (true) {
+      if (!append_cached(out, step)) {
+        auto buf = co_await zb_coro::buf_get_out(request_size(step));
+        if (!buf) {
+          report_failed(cmd, GENERIC_NO_RESOURCES);
+          co_return;
+        }
+        auto start = fill_request(buf, step);
+        zb_coro::zdo_request request(buf, start);
+        auto resp_buf = co_await request;
+        if (!resp_buf) {
+          report_failed(cmd, request.timed_out() ? GENERIC_TIMEOUT
+                                                 : GENERIC_NO_RESOURCES);
+          co_return;
+        }
+        auto status = complete(out, step, resp_buf);
+        if (status != 0) {
+          ESP_LOGW(TAG, "%s %04x %s failed: %d", name, nwk,
+                   get_command_name(step.command_id), int(status));
+          report_failed(cmd, status);
+          co_return;
+        }
+      }
+      if (step.command_id == ZDO_NODE_DESC_REQ) {
+        step.command_id = ZDO_ACTIVE_EP_REQ;
+        step.arg.active_ep = nwk;
+      } else if (next_ep < out.ep_count) {
+        step.command_id = ZDO_SIMPLE_DESC_REQ;
+        step.arg.simple.nwk_addr = nwk;
+        step.arg.simple.endpoint = out.eps[next_ep++];
+      } else {
+        break;
+      }
+    }
+
+    auto out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(out.data);
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto status = reinterpret_cast<generic_response_t *>(out_cmd + 1);
+    status->category = STATUS_CATEGORY_ZDO;
+    status->status = GENERIC_OK;
+    out.data[HDR_SIZE - 1] = out.count;
+    zb_ncp::send_cmd_data(out.data, out.len);
+  }
+
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint16_t nwk;
+    if (len < sizeof(nwk)) {
+      report_failed(cmd, GENERIC_INVALID_PARAMETER);
+      return;
+    }
+    memcpy(&nwk, buffer, sizeof(nwk));
+    if (!run(cmd, nwk)) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+    }
+  }
+};
+
+// Start, stop or retune the topology crawler (see topology.h).
+// [VendorCommandId.SET_TOPOLOGY_CRAWL]: {
+//     request: [
+//         {name: 'enabled', type: DataType.UINT8},
+//         {name: 'requestIntervalMs', type: DataType.UINT16},
+//         {name: 'roundIntervalS', type: DataType.UINT16},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_TOPOLOGY_CRAWL>
+    : immediate_cmd_process<VENDOR_SET_TOPOLOGY_CRAWL>,
+      general_status_arg<VENDOR_SET_TOPOLOGY_CRAWL, topology::config_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const topology::config_t &config) {
+    if (!topology::configure(config)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// The network map collected by the crawler, in one (fragmented) response.
+// [VendorCommandId.GET_TOPOLOGY]: {
+//     request: [],
+//     response: [
+//         ...commonResponse,
+//         {name: 'nodeCount', type: DataType.UINT16},
+//         {name: 'linkCount', type: DataType.UINT16},
+//         {name: 'nodes', type: LIST, options: (payload, options) =>
+//         (options.length = payload.nodeCount)}, // {ieee: IEEE_ADDR, nwk: UINT16, typeFlags: UINT8, depth: UINT8}
+//         {name: 'links', type: LIST, options: (payload, options) =>
+//         (options.length = payload.linkCount)}, // {srcNwk: UINT16, dstNwk: UINT16, lqi: UINT8, relationship: UINT8}
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_GET_TOPOLOGY>
+    : cmd_base<cmd_handle<VENDOR_GET_TOPOLOGY>> {
+  static constexpr const char *name = "VENDOR_GET_TOPOLOGY";
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    std::vector<uint8_t> out(sizeof(zb_ncp::cmd_t) + sizeof(generic_response_t));
+    auto out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(out.data());
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto status = reinterpret_cast<generic_response_t *>(out_cmd + 1);
+    status->category = STATUS_CATEGORY_GENERIC;
+    status->status = GENERIC_OK;
+    topology::serialize(out);
+    zb_ncp::send_cmd_data(out.data(), out.size());
+  }
+};
+
+// Receive statistics of every device heard from (see dev_stats.h).
+// [VendorCommandId.GET_DEV_STATS]: {
+//     request: [],
+//     response: [
+//         ...commonResponse,
+//         {name: 'count', type: DataType.UINT16},
+//         {name: 'devices', type: LIST, options: (payload, options) =>
+//         (options.length = payload.count)},
+//         // {nwk: UINT16, lastHop: UINT16, ageS: UINT32, packets: UINT32,
+//         //  apsDuplicates: UINT16, lqi: UINT8, rssi: INT8}
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_GET_DEV_STATS>
+    : cmd_base<cmd_handle<VENDOR_GET_DEV_STATS>> {
+  static constexpr const char *name = "VENDOR_GET_DEV_STATS";
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    std::vector<uint8_t> out(sizeof(zb_ncp::cmd_t) + sizeof(generic_response_t));
+    auto out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(out.data());
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto status = reinterpret_cast<generic_response_t *>(out_cmd + 1);
+    status->category = STATUS_CATEGORY_GENERIC;
+    status->status = GENERIC_OK;
+    dev_stats::serialize(out);
+    zb_ncp::send_cmd_data(out.data(), out.size());
+  }
+};
+
+// Priority class of the APS frames of a cluster (see tx_sched.h):
+// 0 interactive, 1 normal, 2 bulk. 0xFF removes the cluster from the table.
+// [VendorCommandId.SET_TX_CLASS]: {
+//     request: [
+//         {name: 'clusterID', type: DataType.UINT16},
+//         {name: 'class', type: DataType.UINT8},
+//     ],
+//     response: [...commonResponse],
+// },
+struct VENDOR_SET_TX_CLASS_arg_t {
+  uint16_t cluster_id;
+  uint8_t cls;
+} __attribute__((packed));
+
+template <>
+struct zb_ncp::cmd_handle<VENDOR_SET_TX_CLASS>
+    : immediate_cmd_process<VENDOR_SET_TX_CLASS>,
+      general_status_arg<VENDOR_SET_TX_CLASS, VENDOR_SET_TX_CLASS_arg_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const VENDOR_SET_TX_CLASS_arg_t &arg) {
+    if (arg.cls >= tx_sched::CLASS_COUNT && arg.cls != 0xFF) {
+      status = GENERIC_INVALID_PARAMETER;
+    } else if (!tx_sched::set_class(arg.cluster_id, arg.cls)) {
+      status = GENERIC_NO_MEMORY;
+    }
+  }
+};
+
+static ncp_generic_status_t esp_err_status(esp_err_t err) {
+  switch (err) {
+  case ESP_OK:
+    return GENERIC_OK;
+  case ESP_ERR_INVALID_ARG:
+    return GENERIC_INVALID_PARAMETER;
+  case ESP_ERR_INVALID_SIZE:
+    return GENERIC_OUT_OF_RANGE;
+  case ESP_ERR_INVALID_STATE:
+    return GENERIC_INVALID_STATE;
+  case ESP_ERR_NOT_FOUND:
+    return GENERIC_NOT_FOUND;
+  case ESP_ERR_INVALID_CRC:
+  case ESP_ERR_INVALID_VERSION:
+  case ESP_ERR_OTA_VALIDATE_FAILED:
+    return GENERIC_INVALID_FORMAT;
+  case ESP_ERR_NO_MEM:
+    return GENERIC_NO_MEMORY;
+  case ESP_ERR_TIMEOUT:
+    return GENERIC_BUSY;
+  default:
+    return GENERIC_OPERATION_FAILED;
+  }
+}
+
+// Start uploading an OTA image for the NCP to serve (see ota_server.h).
+// Replaces the current image; a size of 0 just removes it.
+// [VendorCommandId.OTA_IMAGE_BEGIN]: {
+//     request: [
+//         {name: 'size', type: DataType.UINT32},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_OTA_IMAGE_BEGIN>
+    : immediate_cmd_process<VENDOR_OTA_IMAGE_BEGIN>,
+      general_status_arg<VENDOR_OTA_IMAGE_BEGIN, uint32_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const uint32_t &size) {
+    status = esp_err_status(ota_server::begin(size));
+  }
+};
+
+// Next chunk of the image. Chunks go in order; a repeated chunk is
+// acknowledged again.
+// [VendorCommandId.OTA_IMAGE_WRITE]: {
+//     request: [
+//         {name: 'offset', type: DataType.UINT32},
+//         {name: 'data', type: BuffaloZBOSSDataType.LIST_UINT8, options: (payload, options) =>
+//         (options.length = payload.length - 4)},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_OTA_IMAGE_WRITE>
+    : cmd_base<cmd_handle<VENDOR_OTA_IMAGE_WRITE>> {
+  static constexpr const char *name = "VENDOR_OTA_IMAGE_WRITE";
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint32_t offset;
+    if (len < sizeof(offset)) {
+      report_failed(cmd, GENERIC_INVALID_PARAMETER);
+      return;
+    }
+    memcpy(&offset, buffer, sizeof(offset));
+    auto data = static_cast<const uint8_t *>(buffer) + sizeof(offset);
+    report_failed(cmd, esp_err_status(ota_server::write(offset, data,
+                                                    len - sizeof(offset))));
+  }
+};
+
+// Completes the upload. The OTA file header is checked, then the image is
+// served and kept across restarts.
+// [VendorCommandId.OTA_IMAGE_END]: {
+//     request: [],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_OTA_IMAGE_END>
+    : cmd_base<cmd_handle<VENDOR_OTA_IMAGE_END>> {
+  static constexpr const char *name = "VENDOR_OTA_IMAGE_END";
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    report_failed(cmd, esp_err_status(ota_server::end()));
+  }
+};
+
+// Rate limits of the OTA server.
+// [VendorCommandId.OTA_SERVER_CONFIG]: {
+//     request: [
+//         {name: 'maxClients', type: DataType.UINT8},
+//         {name: 'blocksPerS', type: DataType.UINT16},
+//         {name: 'minBlockPeriodMs', type: DataType.UINT16},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_OTA_SERVER_CONFIG>
+    : immediate_cmd_process<VENDOR_OTA_SERVER_CONFIG>,
+      general_status_arg<VENDOR_OTA_SERVER_CONFIG, ota_server::config_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const ota_server::config_t &config) {
+    if (!ota_server::configure(config)) {
+      status = GENERIC_INVALID_PARAMETER;
+    }
+  }
+};
+
+// [VendorCommandId.OTA_SERVER_STATUS]: {
+//     request: [],
+//     response: [
+//         ...commonResponse,
+//         {name: 'state', type: DataType.UINT8}, // 0 empty, 1 uploading, 2 serving
+//         {name: 'manufacturerCode', type: DataType.UINT16},
+//         {name: 'imageType', type: DataType.UINT16},
+//         {name: 'fileVersion', type: DataType.UINT32},
+//         {name: 'imageSize', type: DataType.UINT32},
+//         {name: 'received', type: DataType.UINT32},
+//         {name: 'clients', type: DataType.UINT8},
+//         {name: 'blocksServed', type: DataType.UINT32},
+//         {name: 'upgradesFinished', type: DataType.UINT16},
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_OTA_SERVER_STATUS>
+    : immediate_cmd_process<VENDOR_OTA_SERVER_STATUS>,
+      general_status_res<VENDOR_OTA_SERVER_STATUS, ota_server::status_t> {
+  static void process_status_res(ncp_generic_status_t &status,
+                                 ota_server::status_t *res) {
+    ota_server::get_status(*res);
+  }
+};
+
+// Start streaming new NCP firmware (see fw_update.h). A size of 0 cancels
+// an update in progress.
+// [VendorCommandId.FW_UPDATE_BEGIN]: {
+//     request: [
+//         {name: 'size', type: DataType.UINT32},
+//         {name: 'crc32', type: DataType.UINT32},
+//     ],
+//     response: [...commonResponse],
+// },
+struct VENDOR_FW_UPDATE_BEGIN_arg_t {
+  uint32_t size;
+  uint32_t crc;
+} __attribute__((packed));
+
+template <>
+struct zb_ncp::cmd_handle<VENDOR_FW_UPDATE_BEGIN>
+    : immediate_cmd_process<VENDOR_FW_UPDATE_BEGIN>,
+      general_status_arg<VENDOR_FW_UPDATE_BEGIN, VENDOR_FW_UPDATE_BEGIN_arg_t> {
+  static void process_status_arg(ncp_generic_status_t &status,
+                                 const VENDOR_FW_UPDATE_BEGIN_arg_t &arg) {
+    status = esp_err_status(fw_update::begin(arg.size, arg.crc));
+  }
+};
+
+// Next chunk of the firmware, up to 1024 bytes. The response comes once the
+// chunk is queued for flash, so several chunks may be outstanding. BUSY
+// means the queue is full; nextOffset says where to go on in any case.
+// [VendorCommandId.FW_UPDATE_WRITE]: {
+//     request: [
+//         {name: 'offset', type: DataType.UINT32},
+//         {name: 'crc32', type: DataType.UINT32},
+//         {name: 'data', type: BuffaloZBOSSDataType.LIST_UINT8, options: (payload, options) =>
+//         (options.length = payload.length - 8)},
+//     ],
+//     response: [
+//         ...commonResponse,
+//         {name: 'nextOffset', type: DataType.UINT32},
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_FW_UPDATE_WRITE>
+    : cmd_base<cmd_handle<VENDOR_FW_UPDATE_WRITE>> {
+  static constexpr const char *name = "VENDOR_FW_UPDATE_WRITE";
+  struct FullRes {
+    generic_response_t status;
+    uint32_t next_offset;
+  } __attribute__((packed));
+
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint8_t outdata[sizeof(zb_ncp::cmd_t) + sizeof(FullRes)];
+    zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto res = reinterpret_cast<FullRes *>(out_cmd + 1);
+    uint32_t next_offset = 0;
+    ncp_generic_status_t status = GENERIC_INVALID_PARAMETER;
+    uint32_t hdr[2];
+    if (len >= sizeof(hdr)) {
+      memcpy(hdr, buffer, sizeof(hdr));
+      auto data = static_cast<const uint8_t *>(buffer) + sizeof(hdr);
+      status = esp_err_status(fw_update::write(hdr[0], hdr[1], data,
+                                           len - sizeof(hdr), next_offset));
+    }
+    report_status(status, res->status);
+    res->next_offset = next_offset;
+    zb_ncp::send_cmd_data(outdata, sizeof(outdata));
+  }
+};
+
+// Completes the update. On success the NCP restarts into the new firmware
+// shortly after this response.
+// [VendorCommandId.FW_UPDATE_END]: {
+//     request: [],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_FW_UPDATE_END>
+    : cmd_base<cmd_handle<VENDOR_FW_UPDATE_END>> {
+  static constexpr const char *name = "VENDOR_FW_UPDATE_END";
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    report_failed(cmd, esp_err_status(fw_update::end()));
+  }
+};
+
+// Snapshot of all network state, fetched in consecutive chunks of up to
+// net_backup::MAX_CHUNK_SIZE bytes, for VENDOR_RESTORE on this or another
+// stick (see net_backup.h). Offset 0 takes the snapshot; the host asks for
+// the next offset until it has total bytes.
+// [VendorCommandId.BACKUP]: {
+//     request: [{name: 'offset', type: DataType.UINT32}],
+//     response: [
+//         ...commonResponse,
+//         {name: 'offset', type: DataType.UINT32},
+//         {name: 'total', type: DataType.UINT32},
+//         {name: 'data', type: BuffaloZBOSSDataType.LIST_UINT8, options: (payload, options) =>
+//         (options.length = payload.length - 10)},
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_BACKUP>
+    : cmd_base<cmd_handle<VENDOR_BACKUP>> {
+  static constexpr const char *name = "VENDOR_BACKUP";
+
+  struct resp_t {
+    zb_ncp::cmd_t cmd;
+    generic_response_t status;
+    uint32_t offset;
+    uint32_t total;
+    uint8_t data[net_backup::MAX_CHUNK_SIZE];
+  } __attribute__((packed));
+  // Only used from the ZBOSS context, between two suspensions.
+  inline static resp_t s_out;
+
+  static zb_coro::task run(zb_ncp::cmd_t cmd, uint32_t offset) {
+    if (!co_await zb_coro::schedule()) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    size_t len = 0;
+    uint32_t total = 0;
+    auto ret = net_backup::backup_chunk(offset, s_out.data, len, total);
+    if (ret != ESP_OK) {
+      report_failed(cmd, esp_err_status(ret));
+      co_return;
+    }
+    s_out.cmd = cmd;
+    s_out.cmd.type = zb_ncp::RESPONSE;
+    report_status(GENERIC_OK, s_out.status);
+    s_out.offset = offset;
+    s_out.total = total;
+    zb_ncp::send_cmd_data(&s_out, offsetof(resp_t, data) + len);
+  }
+
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint32_t offset;
+    if (len < sizeof(offset)) {
+      report_failed(cmd, GENERIC_INVALID_PARAMETER);
+      return;
+    }
+    memcpy(&offset, buffer, sizeof(offset));
+    if (!run(cmd, offset)) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+    }
+  }
+};
+
+// Restore of a VENDOR_BACKUP snapshot, sent in consecutive chunks. The last
+// chunk is answered once the snapshot is written; the NCP then restarts
+// into the restored network.
+// [VendorCommandId.RESTORE]: {
+//     request: [
+//         {name: 'offset', type: DataType.UINT32},
+//         {name: 'total', type: DataType.UINT32},
+//         {name: 'data', type: BuffaloZBOSSDataType.LIST_UINT8, options: (payload, options) =>
+//         (options.length = payload.length - 8)},
+//     ],
+//     response: [...commonResponse],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_RESTORE>
+    : cmd_base<cmd_handle<VENDOR_RESTORE>> {
+  static constexpr const char *name = "VENDOR_RESTORE";
+
+  static zb_coro::task apply(zb_ncp::cmd_t cmd) {
+    if (!co_await zb_coro::schedule()) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+      co_return;
+    }
+    auto ret = net_backup::apply();
+    report_failed(cmd, esp_err_status(ret));
+    if (ret == ESP_OK) {
+      net_backup::restart();
+    }
+  }
+
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint32_t hdr[2];
+    if (len < sizeof(hdr)) {
+      report_failed(cmd, GENERIC_INVALID_PARAMETER);
+      return;
+    }
+    memcpy(hdr, buffer, sizeof(hdr));
+    auto data = static_cast<const uint8_t *>(buffer) + sizeof(hdr);
+    bool complete = false;
+    auto ret = net_backup::restore_chunk(hdr[0], hdr[1], data,
+                                         len - sizeof(hdr), complete);
+    if (ret != ESP_OK || !complete) {
+      report_failed(cmd, esp_err_status(ret));
+    } else if (!apply(cmd)) {
+      report_failed(cmd, GENERIC_NO_RESOURCES);
+    }
+  }
+};
+
+// Several SET_* commands in one round trip. Items are applied in order,
+// each exactly as if sent on its own; a failing item does not stop the
+// ones after it.
+// [VendorCommandId.APPLY_CONFIG]: {
+//     request: [
+//         {name: 'items', type: LIST}, // {commandId: UINT16, len: UINT8, value: LIST_UINT8}
+//     ],
+//     response: [
+//         ...commonResponse,
+//         {name: 'count', type: DataType.UINT8},
+//         {name: 'statuses', type: BuffaloZclDataType.LIST_UINT8, options: (payload, options) =>
+//         (options.length = payload.count)},
+//     ],
+// },
+template <>
+struct zb_ncp::cmd_handle<VENDOR_APPLY_CONFIG>
+    : cmd_base<cmd_handle<VENDOR_APPLY_CONFIG>> {
+  static constexpr const char *name = "VENDOR_APPLY_CONFIG";
+  static constexpr size_t MAX_ITEMS = 64;
+
+  struct item_hdr_t {
+    uint16_t command_id;
+    uint8_t len;
+  } __attribute__((packed));
+
+  // Builds the request, for callers on the NCP itself.
+  struct items_t {
+    std::vector<uint8_t> data;
+    template <typename Arg> void add(command_id_t command_id, const Arg &arg) {
+      static_assert(sizeof(Arg) <= 0xff);
+      item_hdr_t hdr = {uint16_t(command_id), uint8_t(sizeof(Arg))};
+      auto pos = data.size();
+      data.resize(pos + sizeof(hdr) + sizeof(Arg));
+      memcpy(data.data() + pos, &hdr, sizeof(hdr));
+      memcpy(data.data() + pos + sizeof(hdr), &arg, sizeof(Arg));
+    }
+  };
+
+  template <command_id_t Id>
+  static ncp_generic_status_t apply_one(const uint8_t *value, size_t len) {
+    using Item = cmd_handle<Id>;
+    uint8_t out[Item::resp_buffer_size];
+    Item::process_immediate(value, len, out, sizeof(out));
+    return reinterpret_cast<generic_response_t *>(out)->status;
+  }
+
+  template <command_id_t... Ids>
+  static ncp_generic_status_t dispatch(uint16_t command_id,
+                                       const uint8_t *value, size_t len) {
+    ncp_generic_status_t status = GENERIC_NOT_IMPLEMENTED;
+    ((command_id == Ids && (status = apply_one<Ids>(value, len), true)) || ...);
+    return status;
+  }
+
+  // Applies the items, one status each into statuses. Returns
+  // GENERIC_INVALID_PARAMETER when the list is cut short.
+  static ncp_generic_status_t apply(const void *buffer, size_t len,
+                                    uint8_t *statuses, size_t &count) {
+    auto p = static_cast<const uint8_t *>(buffer);
+    auto end = p + len;
+    count = 0;
+    while (p < end) {
+      item_hdr_t hdr;
+      if (size_t(end - p) < sizeof(hdr) || count == MAX_ITEMS) {
+        return GENERIC_INVALID_PARAMETER;
+      }
+      memcpy(&hdr, p, sizeof(hdr));
+      p += sizeof(hdr);
+      if (size_t(end - p) < hdr.len) {
+        return GENERIC_INVALID_PARAMETER;
+      }
+      statuses[count++] = dispatch<
+          SET_ZIGBEE_ROLE, SET_ZIGBEE_CHANNEL_MASK, SET_PAN_ID,
+          SET_EXTENDED_PAN_ID, SET_LOCAL_IEEE_ADDR, SET_RX_ON_WHEN_IDLE,
+          SET_NWK_KEY, SET_TC_POLICY, SET_MAX_CHILDREN,
+          VENDOR_SET_IND_BATCHING, VENDOR_SET_IND_STORE,
+          VENDOR_SET_IND_FILTER, VENDOR_SET_TOPOLOGY_CRAWL, VENDOR_SET_TX_CLASS,
+          VENDOR_OTA_SERVER_CONFIG, VENDOR_SET_DESC_CACHE>(hdr.command_id, p,
+                                                           hdr.len);
+      if (statuses[count - 1] != GENERIC_OK) {
+        ESP_LOGW(TAG, "%s: %s failed: %d", name,
+                 get_command_name(hdr.command_id), int(statuses[count - 1]));
+      }
+      p += hdr.len;
+    }
+    return GENERIC_OK;
+  }
+
+  static void process(const zb_ncp::cmd_t &cmd, const void *buffer,
+                      size_t len) {
+    uint8_t outdata[sizeof(zb_ncp::cmd_t) + sizeof(generic_response_t) + 1 +
+                    MAX_ITEMS];
+    zb_ncp::cmd_t *out_cmd = reinterpret_cast<zb_ncp::cmd_t *>(outdata);
+    *out_cmd = cmd;
+    out_cmd->type = zb_ncp::RESPONSE;
+    auto status = reinterpret_cast<generic_response_t *>(out_cmd + 1);
+    auto statuses = reinterpret_cast<uint8_t *>(status + 1) + 1;
+    size_t count = 0;
+    report_status(apply(buffer, len, statuses, count), *status);
+    statuses[-1] = count;
+    zb_ncp::send_cmd_data(outdata, statuses + count - outdata);
   }
 };
@@ -56,6 +56,36 @@
   COMMAND(NWK_REJOIN_FAILED_IND,       0x040a) \
   COMMAND(NWK_LEAVE_IND,               0x040b)
 
+// Commands not in the ZBOSS NCP protocol. Stock hosts never send them, so
+// every extension stays off unless the host asks for it.
+#define COMMANDS_LIST_VENDOR \
+  COMMAND(VENDOR_SET_IND_BATCHING,     0x0f01) \
+  COMMAND(VENDOR_SET_IND_FILTER,       0x0f02) \
+  COMMAND(VENDOR_INTERVIEW,            0x0f03) \
+  COMMAND(VENDOR_SET_TOPOLOGY_CRAWL,   0x0f04) \
+  COMMAND(VENDOR_GET_TOPOLOGY,         0x0f05) \
+  COMMAND(VENDOR_GET_DEV_STATS,        0x0f06) \
+  COMMAND(VENDOR_SET_TX_CLASS,         0x0f07) \
+  COMMAND(VENDOR_OTA_IMAGE_BEGIN,      0x0f08) \
+  COMMAND(VENDOR_OTA_IMAGE_WRITE,      0x0f09) \
+  COMMAND(VENDOR_OTA_IMAGE_END,        0x0f0a) \
+  COMMAND(VENDOR_OTA_SERVER_CONFIG,    0x0f0b) \
+  COMMAND(VENDOR_OTA_SERVER_STATUS,    0x0f0c) \
+  COMMAND(VENDOR_FW_UPDATE_BEGIN,      0x0f0d) \
+  COMMAND(VENDOR_FW_UPDATE_WRITE,      0x0f0e) \
+  COMMAND(VENDOR_FW_UPDATE_END,        0x0f0f) \
+  COMMAND(VENDOR_BACKUP,               0x0f10) \
+  COMMAND(VENDOR_RESTORE,              0x0f11) \
+  COMMAND(VENDOR_APPLY_CONFIG,         0x0f12) \
+  COMMAND(VENDOR_SET_IND_STORE,        0x0f13) \
+  COMMAND(VENDOR_SET_DESC_CACHE,       0x0f14)
+
+#define COMMANDS_LIST_VENDOR_IND \
+  COMMAND(VENDOR_IND_BATCH,            0x0f81) \
+  COMMAND(VENDOR_IND_REPLAY,           0x0f82)
+
 #define COMMANDS_LIST \
   COMMANDS_LIST_BASE \
-  COMMANDS_LIST_IND
+  COMMANDS_LIST_IND \
+  COMMANDS_LIST_VENDOR \
+  COMMANDS_LIST_VENDOR_IND
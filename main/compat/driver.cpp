@@ -11,6 +11,7 @@
 
 #include "commands_impl.h"
 #include "ind_impl.h"
+#include "boot_config.h"
 
 #define ARR8_INIT(arr8) { arr8[0], arr8[1], arr8[2], arr8[3], arr8[4], arr8[5], arr8[6], arr8[7] }
 
@@ -49,31 +50,49 @@ void ZBOSSDriver::addEndpoint(uint8_t endpoint, uint16_t profileId, uint16_t dev
   });
 }
 
-void ZBOSSDriver::initCommunication() {
-  auto _joined = zb_ncp::cmd_handle<GET_JOINED>::process_status_res_d();
-  auto _role = zb_ncp::cmd_handle<GET_ZIGBEE_ROLE>::process_status_res_d();
-  auto _ieee_addr = zb_ncp::cmd_handle<GET_LOCAL_IEEE_ADDR>::process_status_arg_res_d(0);
+void ZBOSSDriver::applyConfig(const std::vector<uint8_t>& items) {
+  using ApplyConfig = zb_ncp::cmd_handle<VENDOR_APPLY_CONFIG>;
+  uint8_t statuses[ApplyConfig::MAX_ITEMS];
+  size_t count = 0;
+  auto status = ApplyConfig::apply(items.data(), items.size(), statuses, count);
+  if (status != GENERIC_OK) {
+    ESP_LOGE(TAG, "VENDOR_APPLY_CONFIG failed after %d items", int(count));
+  }
+}
+
+// Network this coordinator runs.
+static boot_config::config_t networkConfig() {
+  return boot_config::config_t{
+    .version = boot_config::VERSION,
+    .role = ZB_NWK_DEVICE_TYPE_COORDINATOR,
+    .channel_mask = 1 << 11,
+    .pan_id = 0x0e94,
+    .nwk_key = {
+      0x1e, 0xc5, 0x82, 0x77, 0x7d, 0xcd, 0xfd, 0xdf,
+      0xd0, 0x72, 0xf7, 0x99, 0x5f, 0xfd, 0x82, 0x4f
+    },
+  };
+}
+
+void ZBOSSDriver::formNetwork() {
+  const auto config = networkConfig();
   auto _extended_pan_id = zb_ncp::cmd_handle<GET_EXTENDED_PAN_ID>::process_status_res_d();
-  auto _pan_id = zb_ncp::cmd_handle<GET_PAN_ID>::process_status_res_d();
-  auto _channel = zb_ncp::cmd_handle<GET_ZIGBEE_CHANNEL>::process_status_res_d();
-  zb_ncp::cmd_handle<SET_ZIGBEE_ROLE>::process_status_arg_d(ZB_NWK_DEVICE_TYPE_COORDINATOR);
-  zb_ncp::cmd_handle<SET_ZIGBEE_CHANNEL_MASK>::process_status_arg_d({
+  SET_NWK_KEY_arg_t key = { .nwkKey = {}, .index = 0 };
+  memcpy(key.nwkKey, config.nwk_key, sizeof(key.nwkKey));
+  zb_ncp::cmd_handle<VENDOR_APPLY_CONFIG>::items_t items;
+  items.add(SET_ZIGBEE_ROLE, config.role);
+  items.add(SET_ZIGBEE_CHANNEL_MASK, SET_ZIGBEE_CHANNEL_MASK_arg_t{
       .page = 0,
-      .mask = 1 << 11
-  });
-  zb_ncp::cmd_handle<SET_PAN_ID>::process_status_arg_d(0x0e94);
-  zb_ncp::cmd_handle<SET_NWK_KEY>::process_status_arg_d({
-      .nwkKey = {
-        0x1e, 0xc5, 0x82, 0x77, 0x7d, 0xcd, 0xfd, 0xdf,
-        0xd0, 0x72, 0xf7, 0x99, 0x5f, 0xfd, 0x82, 0x4f
-      },
-      .index = 0
+      .mask = config.channel_mask
   });
+  items.add(SET_PAN_ID, config.pan_id);
+  items.add(SET_NWK_KEY, key);
+  applyConfig(items.data);
 
   zb_ncp::cmd_handle<NWK_FORMATION>::process(
     NWK_FORMATION_arg_t{
       .channels = {
-        { .page = 0, .mask = 1 << 11 },
+        { .page = 0, .mask = config.channel_mask },
       },
       .duration = 0x05,
       .distrib_flag = 0x00,
@@ -82,34 +101,45 @@ void ZBOSSDriver::initCommunication() {
     },
     [](const NWK_FORMATION_resp_t& r) {
       ESP_LOGI(TAG, "NWK_FORMATION response: { 0x%x, 0x%x, 0x%x }", r.category, r.status, r.nwk);
+      if (r.status == GENERIC_OK) {
+        boot_config::save(networkConfig());
+        boot_config::network_ready(false);
+      }
     }
   );
+}
 
-  // Set policies
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = LINK_KEY_REQUIRED,
-      .value = 0
-  });
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = IC_REQUIRED,
-      .value = 0
-  });
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = TC_REJOIN_ENABLED,
-      .value = 1
-  });
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = IGNORE_TC_REJOIN,
-      .value = 0
-  });
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = APS_INSECURE_JOIN,
-      .value = 0
-  });
-  zb_ncp::cmd_handle<SET_TC_POLICY>::process_status_arg_d(SET_TC_POLICY_arg_t{
-      .type = DISABLE_NWK_MGMT_CHANNEL_UPDATE,
-      .value = 0
-  });
+void ZBOSSDriver::initCommunication() {
+  if (boot_config::matches(networkConfig())) {
+    // formed before with this configuration: the stack has it all in NVRAM
+    zb_ncp::cmd_handle<NWK_START_WITHOUT_FORMATION>::process(
+      NWK_START_WITHOUT_FORMATION_arg_t{},
+      [](const generic_response_t& r) {
+        ESP_LOGI(TAG, "NWK_START_WITHOUT_FORMATION response: { 0x%x, 0x%x }", r.category, r.status);
+        if (r.status == GENERIC_OK) {
+          boot_config::network_ready(true);
+        } else {
+          // from the stack's callback: the driver task forms it, after the
+          // rest of initCommunication
+          boot_config::clear();
+          instance().m_form_pending = true;
+        }
+      }
+    );
+  } else {
+    formNetwork();
+  }
+
+  // Not kept in NVRAM: set on every start
+  zb_ncp::cmd_handle<VENDOR_APPLY_CONFIG>::items_t items;
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = LINK_KEY_REQUIRED, .value = 0 });
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = IC_REQUIRED, .value = 0 });
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = TC_REJOIN_ENABLED, .value = 1 });
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = IGNORE_TC_REJOIN, .value = 0 });
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = APS_INSECURE_JOIN, .value = 0 });
+  items.add(SET_TC_POLICY, SET_TC_POLICY_arg_t{ .type = DISABLE_NWK_MGMT_CHANNEL_UPDATE, .value = 0 });
+  items.add(SET_RX_ON_WHEN_IDLE, uint8_t(1));
+  applyConfig(items.data);
 
   addEndpoint(1, 260, 0xbeef, {0x0000, 0x0003, 0x0006, 0x000a, 0x0019, 0x001a, 0x0300},
               {
@@ -118,8 +148,6 @@ void ZBOSSDriver::initCommunication() {
                 0xfc01, 0xfc02,
               });
   addEndpoint(242, 0xa1e0, 0x61, {}, { 0x0021 });
-
-  zb_ncp::cmd_handle<SET_RX_ON_WHEN_IDLE>::process_status_arg_d(1);
 }
 
 // TODO: Refactor
@@ -128,7 +156,7 @@ void ZBOSSDriver::task_int() {
 
   initCommunication();
 
-  zb_ncp::ind_handle<APSDE_DATA_IND>::connect([](const zb_apsde_data_indication_t& arg){
+  zb_ncp::ind_handle<APSDE_DATA_IND>::connect([](const zb_apsde_data_indication_t& arg, const uint8_t*, uint16_t){
     ESP_LOGI(TAG, "APSDE_DATA_IND: ClusterId: 0x%x, EndpointId: 0x%x -> 0x%x",
         arg.clusterid, arg.src_endpoint, arg.dst_endpoint);
 
@@ -153,25 +181,22 @@ void ZBOSSDriver::task_int() {
     uint8_t dst_addr[8] = {0};
     *reinterpret_cast<uint16_t*>(dst_addr) = arg.src_addr;
 
-    APSDE_DATA_REQ_max_arg_t req = {
-      .hdr = {
-        .paramLength = sizeof(apsde_data_req_base_t),
-        .dataLength = 0,
-        .base = {
-          .addr_data = ARR8_INIT(dst_addr),
-          .profile_id = arg.profileid,
-          .cluster_id = arg.clusterid,
-          .dst_endpoint = arg.src_endpoint,
-          .src_endpoint = arg.dst_endpoint,
-          .radius = arg.radius,
-          .addr_mode = ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
-          .tx_options = ZB_TRUE,
-          .use_alias = 0,
-          .alias_src_addr = 0,
-          .alias_seq_num = 0
-        },
+    apsde_data_req_arg_t req = {
+      .paramLength = sizeof(apsde_data_req_base_t),
+      .dataLength = 0,
+      .base = {
+        .addr_data = ARR8_INIT(dst_addr),
+        .profile_id = arg.profileid,
+        .cluster_id = arg.clusterid,
+        .dst_endpoint = arg.src_endpoint,
+        .src_endpoint = arg.dst_endpoint,
+        .radius = arg.radius,
+        .addr_mode = ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
+        .tx_options = ZB_APSDE_TX_OPT_ACK_TX,
+        .use_alias = 0,
+        .alias_src_addr = 0,
+        .alias_seq_num = 0
       },
-      .data = { 0 }
     };
 
     zb_ncp::cmd_t cmd = {
@@ -187,6 +212,10 @@ void ZBOSSDriver::task_int() {
   while (true) {
     auto recv_count = xStreamBufferReceive(m_input_buf, m_buffer.data(), m_buffer.size(), pdMS_TO_TICKS(RINGBUF_TIMEOUT_MS));
 
+    if (instance().m_form_pending.exchange(false)) {
+      formNetwork();
+    }
+
     if (recv_count == 0)
       continue;
 
@@ -6,6 +6,7 @@
 #include "esp_log.h"
 #include "freertos/idf_additions.h"
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <vector>
 
@@ -25,6 +26,7 @@ private:
 
 private:
   uint8_t m_tsn{ 1 };
+  std::atomic<bool> m_form_pending{ false };   // warm start failed: form anew
   static constexpr size_t BUFFER_SIZE = 256 * 4;
   std::array<uint8_t, BUFFER_SIZE>  m_buffer{};
 
@@ -40,6 +42,8 @@ private:
                    const std::vector<uint16_t>& inputClusters,
                    const std::vector<uint16_t>& outputClusters);
 
+  static void applyConfig(const std::vector<uint8_t>& items);
+  static void formNetwork();
   void initCommunication();
 
 public:
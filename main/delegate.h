@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Fixed-size replacement for std::function.
+//
+// The callable is stored inline, so binding never allocates and a call is
+// one indirect jump. Only trivially copyable callables fit (plain functions,
+// captureless lambdas, lambdas capturing a few pointers or values); anything
+// larger or owning resources is rejected at compile time.
+template <typename Sig, size_t Capacity = 2 * sizeof(void *)>
+class inplace_delegate;
+
+template <typename R, typename... Args, size_t Capacity>
+class inplace_delegate<R(Args...), Capacity> {
+public:
+  inplace_delegate() = default;
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<
+                            std::decay_t<F>, inplace_delegate>>>
+  inplace_delegate(F &&f) {
+    using Fn = std::decay_t<F>;
+    static_assert(sizeof(Fn) <= Capacity, "callable too big for delegate");
+    static_assert(alignof(Fn) <= alignof(void *),
+                  "callable over-aligned for delegate");
+    static_assert(std::is_trivially_copyable_v<Fn> &&
+                      std::is_trivially_destructible_v<Fn>,
+                  "delegate callables must be trivially copyable");
+    ::new (static_cast<void *>(m_storage)) Fn(std::forward<F>(f));
+    m_invoke = [](const void *storage, Args... args) -> R {
+      return (*static_cast<Fn *>(const_cast<void *>(storage)))(
+          std::forward<Args>(args)...);
+    };
+  }
+
+  R operator()(Args... args) const {
+    return m_invoke(m_storage, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return m_invoke != nullptr; }
+
+private:
+  alignas(void *) unsigned char m_storage[Capacity] = {};
+  R (*m_invoke)(const void *, Args...) = nullptr;
+};
+
+// Fixed set of delegates called in the order they were connected.
+//
+// connect() is meant for initialization; it may run while another task
+// dispatches, but connects must not race each other.
+template <size_t N, typename... Args> class delegate_list {
+public:
+  using delegate_t = inplace_delegate<void(Args...)>;
+
+  // Returns false if all N slots are taken.
+  bool connect(const delegate_t &delegate) {
+    auto count = m_count.load(std::memory_order_relaxed);
+    if (count >= N) {
+      return false;
+    }
+    m_delegates[count] = delegate;
+    m_count.store(count + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if nothing is connected.
+  bool operator()(const Args &...args) const {
+    auto count = m_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+      m_delegates[i](args...);
+    }
+    return count != 0;
+  }
+
+  size_t size() const { return m_count.load(std::memory_order_relaxed); }
+
+private:
+  delegate_t m_delegates[N];
+  std::atomic<size_t> m_count{0};
+};
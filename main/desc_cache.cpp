@@ -0,0 +1,241 @@
+#include "desc_cache.h"
+#include "addr_cache.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <nvs.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const char* TAG = "DESC";
+
+#ifdef CONFIG_NCP_DESC_CACHE_NVS
+static const char* NVS_NAMESPACE = "desc";
+
+static void nvs_key(size_t idx, char (&out)[NVS_KEY_NAME_MAX_SIZE]) {
+	snprintf(out, sizeof(out), "slot%02x", unsigned(idx));
+}
+#endif
+
+desc_cache::desc_cache() : m_stamp(0), m_dirty(0), m_flush_task(nullptr) {
+	memset(m_entries, 0, sizeof(m_entries));
+	memset(m_used, 0, sizeof(m_used));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+desc_cache& desc_cache::instance() {
+	static desc_cache s_desc_cache;
+	return s_desc_cache;
+}
+
+int desc_cache::find_locked(const key_t& key) const {
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		auto& k = m_entries[i].key;
+		if (m_used[i] && k.nwk == key.nwk && k.command_id == key.command_id && k.endpoint == key.endpoint)
+			return i;
+	}
+	return -1;
+}
+
+void desc_cache::erase_locked(size_t idx) {
+	m_used[idx] = 0;
+	mark_dirty_locked(idx);
+}
+
+void desc_cache::mark_dirty_locked(size_t idx) {
+#ifdef CONFIG_NCP_DESC_CACHE_NVS
+	bool first = !m_dirty;
+	m_dirty |= uint64_t(1) << idx;
+	if (first && m_flush_task) {
+		xTaskNotifyGive(m_flush_task);
+	}
+#endif
+}
+
+void desc_cache::flush_task(void* arg) {
+	auto& self = instance();
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		// let the rest of an interview (or a burst of announcements) in
+		vTaskDelay(pdMS_TO_TICKS(FLUSH_DELAY_MS));
+		self.flush();
+	}
+}
+
+// Writes the dirty slots one by one, taking the lock only to copy each, and
+// commits them together.
+void desc_cache::flush() {
+#ifdef CONFIG_NCP_DESC_CACHE_NVS
+	nvs_handle_t h;
+	auto ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "nvs_open failed: %d", ret);
+		return;
+	}
+	size_t count = 0;
+	while (true) {
+		entry_t e;
+		bool used;
+		size_t idx;
+		{
+			utils::sem_lock l(m_sem);
+			if (!m_dirty) {
+				break;
+			}
+			idx = __builtin_ctzll(m_dirty);
+			m_dirty &= ~(uint64_t(1) << idx);
+			used = m_used[idx] != 0;
+			e = m_entries[idx];
+		}
+		char name[NVS_KEY_NAME_MAX_SIZE];
+		nvs_key(idx, name);
+		if (used) {
+			ret = nvs_set_blob(h, name, &e, offsetof(entry_t, data) + e.len);
+		} else {
+			ret = nvs_erase_key(h, name);
+			if (ret == ESP_ERR_NVS_NOT_FOUND)
+				ret = ESP_OK;
+		}
+		if (ret != ESP_OK)
+			ESP_LOGE(TAG, "store %s failed: %d", name, ret);
+		++count;
+	}
+	ret = nvs_commit(h);
+	if (ret != ESP_OK)
+		ESP_LOGE(TAG, "commit failed: %d", ret);
+	nvs_close(h);
+	ESP_LOGD(TAG, "flushed %d slots", int(count));
+#endif
+}
+
+void desc_cache::init_int() {
+#ifdef CONFIG_NCP_DESC_CACHE_NVS
+	{
+		utils::sem_lock l(m_sem);
+		nvs_handle_t h;
+		if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+			nvs_iterator_t it = nullptr;
+			size_t count = 0;
+			bool by_key = false;
+			auto ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_NAMESPACE, NVS_TYPE_BLOB, &it);
+			while (ret == ESP_OK) {
+				nvs_entry_info_t info;
+				nvs_entry_info(it, &info);
+				ret = nvs_entry_next(&it);
+				size_t idx = CAPACITY;
+				if (strncmp(info.key, "slot", 4) == 0) {
+					idx = strtoul(info.key + 4, nullptr, 16);
+				} else {
+					// stored by key by an older firmware, into the first free slot
+					by_key = true;
+					for (idx = 0; idx < CAPACITY && m_used[idx]; ++idx) {
+					}
+				}
+				if (idx >= CAPACITY || m_used[idx]) {
+					continue;
+				}
+				auto& e = m_entries[idx];
+				size_t size = sizeof(e);
+				if (nvs_get_blob(h, info.key, &e, &size) == ESP_OK && size >= offsetof(entry_t, data)
+						&& size == offsetof(entry_t, data) + e.len) {
+					m_used[idx] = ++m_stamp;
+					++count;
+				}
+			}
+			nvs_release_iterator(it);
+			if (by_key) {
+				nvs_erase_all(h);
+				nvs_commit(h);
+				for (size_t i = 0; i < CAPACITY; ++i) {
+					if (m_used[i])
+						m_dirty |= uint64_t(1) << i;
+				}
+			}
+			nvs_close(h);
+			ESP_LOGI(TAG, "loaded %d descriptors", int(count));
+		}
+	}
+	if (xTaskCreate(&flush_task, "desc_flush", FLUSH_STACK, nullptr, FLUSH_PRIORITY,
+		&m_flush_task) != pdTRUE) {
+		ESP_LOGE(TAG, "no flush task, descriptors are not stored");
+		m_flush_task = nullptr;
+	} else if (m_dirty) {
+		xTaskNotifyGive(m_flush_task);
+	}
+#endif
+}
+
+bool desc_cache::configure_int(const config_t& config) {
+	m_enabled = config.enabled != 0;
+	if (config.clear) {
+		utils::sem_lock l(m_sem);
+		for (size_t i = 0; i < CAPACITY; ++i) {
+			if (m_used[i])
+				erase_locked(i);
+		}
+	}
+	ESP_LOGI(TAG, "cache %s%s", config.enabled ? "on" : "bypassed", config.clear ? ", cleared" : "");
+	return true;
+}
+
+bool desc_cache::get_int(const key_t& key, void* out, size_t& len) {
+	utils::sem_lock l(m_sem);
+	auto idx = find_locked(key);
+	if (idx < 0) {
+		return false;
+	}
+	m_used[idx] = ++m_stamp;
+	len = m_entries[idx].len;
+	memcpy(out, m_entries[idx].data, len);
+	return true;
+}
+
+void desc_cache::put_int(const key_t& key, const void* data, size_t len) {
+	if (key.nwk >= 0xfff8) {
+		return; // broadcast
+	}
+	if (len > MAX_DATA) {
+		ESP_LOGD(TAG, "%04x cmd: %04x too long: %d", key.nwk, key.command_id, int(len));
+		return;
+	}
+	addr_cache::entry_t device;
+	bool known = addr_cache::find_by_nwk(key.nwk, device);
+
+	utils::sem_lock l(m_sem);
+	auto idx = find_locked(key);
+	if (idx < 0) {
+		idx = 0;
+		for (size_t i = 0; i < CAPACITY; ++i) {
+			if (!m_used[i]) {
+				idx = i;
+				break;
+			}
+			if (m_used[i] < m_used[idx])
+				idx = i;
+		}
+		if (m_used[idx])
+			erase_locked(idx);
+	}
+	auto& e = m_entries[idx];
+	if (known)
+		memcpy(e.ieee, device.ieee, sizeof(e.ieee));
+	else
+		memset(e.ieee, 0, sizeof(e.ieee));
+	e.key = key;
+	e.len = static_cast<uint8_t>(len);
+	memcpy(e.data, data, len);
+	m_used[idx] = ++m_stamp;
+	mark_dirty_locked(idx);
+}
+
+void desc_cache::invalidate_int(const uint8_t* ieee, uint16_t nwk) {
+	utils::sem_lock l(m_sem);
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		if (m_used[i] && (m_entries[i].key.nwk == nwk || memcmp(m_entries[i].ieee, ieee, 8) == 0)) {
+			ESP_LOGD(TAG, "drop %04x cmd: %04x ep: %d", m_entries[i].key.nwk,
+				m_entries[i].key.command_id, int(m_entries[i].key.endpoint));
+			erase_locked(i);
+		}
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include "zboss_decl.h"
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// ZDO descriptor responses (node, power, active endpoints, simple) kept on
+// the NCP, so a repeated interview of a known device is answered without
+// going on air.
+//
+// Entries hold the raw ZDO response as ZBOSS delivered it and are keyed by
+// (nwk, command, endpoint). The IEEE address is recorded too, so a device
+// announcement drops everything cached for that device and for the nwk it
+// announced with. When the table is full the least recently used entry is
+// replaced.
+//
+// With CONFIG_NCP_DESC_CACHE_NVS the table is kept in the "desc" NVS
+// namespace, one blob per slot, and loaded back on start, so it survives a
+// restart of the NCP. Changed slots are only marked; a task of its own
+// writes them FLUSH_DELAY_MS after the first change, with one commit for
+// all of them, so flash never blocks the ZBOSS context.
+//
+// The host can bypass the cache (VENDOR_SET_DESC_CACHE): lookups then miss
+// and every request goes on air, while the responses still refresh the
+// table.
+class desc_cache {
+public:
+	struct config_t {
+		uint8_t enabled;
+		uint8_t clear;          /*!< drop every entry */
+	} __attribute__((packed));
+
+	static constexpr size_t CAPACITY = 64;
+	static constexpr size_t MAX_DATA = 96;
+
+	struct key_t {
+		uint16_t nwk;
+		uint16_t command_id;
+		uint8_t endpoint;       /*!< 0 for per-device descriptors */
+	};
+
+private:
+	struct entry_t {
+		uint8_t ieee[8];
+		key_t key;
+		uint8_t len;
+		uint8_t data[MAX_DATA];
+	} __attribute__((packed));
+
+	desc_cache();
+	static desc_cache& instance();
+
+	static constexpr uint32_t FLUSH_DELAY_MS = 2000;
+	static constexpr uint32_t FLUSH_STACK = 3072;
+	static constexpr UBaseType_t FLUSH_PRIORITY = 2;
+	static_assert(CAPACITY <= 64);
+
+	entry_t m_entries[CAPACITY];
+	uint32_t m_used[CAPACITY];     /*!< last use stamp, 0 when free */
+	uint32_t m_stamp;
+	uint64_t m_dirty;              /*!< slots that differ from NVS */
+	std::atomic<bool> m_enabled{true};
+	SemaphoreHandle_t m_sem;
+	TaskHandle_t m_flush_task;
+
+	int find_locked(const key_t& key) const;
+	void erase_locked(size_t idx);
+	void mark_dirty_locked(size_t idx);
+
+	static void flush_task(void* arg);
+	void flush();
+
+	void init_int();
+	bool configure_int(const config_t& config);
+	bool get_int(const key_t& key, void* out, size_t& len);
+	void put_int(const key_t& key, const void* data, size_t len);
+	void invalidate_int(const uint8_t* ieee, uint16_t nwk);
+
+public:
+	// Loads the persisted entries; call before the ZBOSS task starts.
+	static void init() { instance().init_int(); }
+	static bool configure(const config_t& config) {
+		return instance().configure_int(config);
+	}
+	// The cache in use again, for a new host session; entries are kept.
+	static void reset() { instance().m_enabled = true; }
+	// Copies the cached response into out (at least MAX_DATA bytes). Misses
+	// while the host bypasses the cache.
+	static bool get(const key_t& key, void* out, size_t& len) {
+		auto& self = instance();
+		return self.m_enabled && self.get_int(key, out, len);
+	}
+	// Responses longer than MAX_DATA are not cached.
+	static void put(const key_t& key, const void* data, size_t len) {
+		instance().put_int(key, data, len);
+	}
+	static void invalidate(const uint8_t* ieee, uint16_t nwk) {
+		instance().invalidate_int(ieee, nwk);
+	}
+};
@@ -0,0 +1,145 @@
+#include "dev_stats.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+#include <algorithm>
+
+static const char* TAG = "STATS";
+
+// weight of a new sample: 1 / (1 << EWMA_SHIFT)
+static constexpr int EWMA_SHIFT = 3;
+
+static uint32_t now_s() {
+	return static_cast<uint32_t>(esp_timer_get_time() / 1000000);
+}
+
+dev_stats::dev_stats() {
+	memset(m_nwk, 0, sizeof(m_nwk));
+	memset(m_used, 0, sizeof(m_used));
+	memset(m_entries, 0, sizeof(m_entries));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+dev_stats& dev_stats::instance() {
+	static dev_stats s_dev_stats;
+	return s_dev_stats;
+}
+
+int dev_stats::find_locked(uint16_t nwk) const {
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		if (m_nwk[i] == nwk && m_used[i])
+			return i;
+	}
+	return -1;
+}
+
+size_t dev_stats::alloc_locked(uint16_t nwk) {
+	size_t idx = 0;
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		if (!m_used[i]) {
+			idx = i;
+			break;
+		}
+		if (m_entries[i].last_seen < m_entries[idx].last_seen)
+			idx = i;
+	}
+	if (m_used[idx]) {
+		ESP_LOGD(TAG, "full, replace %04x", m_nwk[idx]);
+	}
+	m_used[idx] = true;
+	m_nwk[idx] = nwk;
+	memset(&m_entries[idx], 0, sizeof(entry_t));
+	return idx;
+}
+
+bool dev_stats::check_duplicate(entry_t& e, uint8_t aps_counter) {
+	int8_t ahead = static_cast<int8_t>(aps_counter - e.aps_counter);
+	if (ahead > 0) {
+		e.aps_window = ahead < DUP_WINDOW ? (e.aps_window << ahead) | 1 : 1;
+		e.aps_counter = aps_counter;
+		return false;
+	}
+	uint8_t behind = -ahead;
+	if (behind >= DUP_WINDOW) {
+		// far behind: the device restarted its counter
+		e.aps_window = 1;
+		e.aps_counter = aps_counter;
+		return false;
+	}
+	if (e.aps_window & (1u << behind)) {
+		return true;
+	}
+	e.aps_window |= 1u << behind;
+	return false;
+}
+
+bool dev_stats::on_rx_int(const zb_apsde_data_indication_t& ind) {
+	utils::sem_lock l(m_sem);
+	auto idx = find_locked(ind.src_addr);
+	bool first = idx < 0;
+	if (first) {
+		idx = alloc_locked(ind.src_addr);
+	}
+	auto& e = m_entries[idx];
+	auto now = now_s();
+	if (first || now - e.last_seen > DUP_WINDOW_S) {
+		e.aps_counter = ind.aps_counter;
+		e.aps_window = 1;
+	} else if (check_duplicate(e, ind.aps_counter)) {
+		if (e.duplicates != UINT16_MAX)
+			++e.duplicates;
+		e.last_seen = now;
+		ESP_LOGD(TAG, "%04x duplicate aps_counter: %d", ind.src_addr, int(ind.aps_counter));
+		return false;
+	}
+	int32_t lqi = int32_t(ind.lqi) << 8;
+	int32_t rssi = int32_t(ind.rssi) * 256;
+	if (first) {
+		e.lqi_avg = lqi;
+		e.rssi_avg = rssi;
+	} else {
+		e.lqi_avg += (lqi - e.lqi_avg) >> EWMA_SHIFT;
+		e.rssi_avg += (rssi - e.rssi_avg) >> EWMA_SHIFT;
+	}
+	e.last_hop = ind.mac_src_addr;
+	e.last_seen = now;
+	++e.packets;
+	return true;
+}
+
+void dev_stats::remove_int(uint16_t nwk) {
+	utils::sem_lock l(m_sem);
+	auto idx = find_locked(nwk);
+	if (idx >= 0) {
+		m_used[idx] = false;
+	}
+}
+
+void dev_stats::serialize(std::vector<uint8_t>& out) {
+	auto& self = instance();
+	auto now = now_s();
+	utils::sem_lock l(self.m_sem);
+	auto count_pos = out.size();
+	uint16_t count = 0;
+	out.resize(out.size() + sizeof(count));
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		if (!self.m_used[i])
+			continue;
+		auto& e = self.m_entries[i];
+		record_t rec = {
+			.nwk = self.m_nwk[i],
+			.last_hop = e.last_hop,
+			.age_s = now - e.last_seen,
+			.packets = e.packets,
+			.duplicates = e.duplicates,
+			.lqi = static_cast<uint8_t>(std::min(0xff, (e.lqi_avg + 0x80) >> 8)),
+			.rssi = static_cast<int8_t>((e.rssi_avg + 0x80) >> 8),
+		};
+		auto p = reinterpret_cast<const uint8_t*>(&rec);
+		out.insert(out.end(), p, p + sizeof(rec));
+		++count;
+	}
+	memcpy(&out[count_pos], &count, sizeof(count));
+}
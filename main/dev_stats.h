@@ -0,0 +1,73 @@
+#pragma once
+#include "zboss_decl.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Per-device receive statistics, taken from the metadata of every APS data
+// indication: when the device was last heard, smoothed LQI/RSSI, the MAC
+// source of the last frame (the parent or last hop router), frame and APS
+// duplicate counts.
+//
+// It also detects APS retransmissions: a frame whose aps_counter was already
+// seen from the same source within the last DUP_WINDOW counters (and
+// DUP_WINDOW_S seconds) is a duplicate and is not passed on.
+//
+// Keyed by nwk address. When the table is full the device heard from
+// longest ago is replaced.
+class dev_stats {
+public:
+	// Record of the bulk query (VENDOR_GET_DEV_STATS).
+	struct record_t {
+		uint16_t nwk;
+		uint16_t last_hop;
+		uint32_t age_s;         /*!< since the last frame */
+		uint32_t packets;
+		uint16_t duplicates;
+		uint8_t lqi;            /*!< moving average */
+		int8_t rssi;            /*!< moving average */
+	} __attribute__((packed));
+
+	static constexpr size_t CAPACITY = 128;
+	static constexpr uint8_t DUP_WINDOW = 32;
+	static constexpr uint32_t DUP_WINDOW_S = 10;
+
+private:
+	struct entry_t {
+		uint16_t last_hop;
+		uint32_t last_seen;     /*!< seconds since boot */
+		uint32_t packets;
+		uint16_t duplicates;
+		uint16_t lqi_avg;       /*!< 8.8 fixed point */
+		int16_t rssi_avg;       /*!< 8.8 fixed point */
+		uint8_t aps_counter;    /*!< newest aps_counter seen */
+		uint32_t aps_window;    /*!< bit n: aps_counter - n was seen */
+	};
+
+	dev_stats();
+	static dev_stats& instance();
+
+	uint16_t m_nwk[CAPACITY];   /*!< scanned on every indication, kept apart */
+	bool m_used[CAPACITY];
+	entry_t m_entries[CAPACITY];
+	SemaphoreHandle_t m_sem;
+
+	int find_locked(uint16_t nwk) const;
+	size_t alloc_locked(uint16_t nwk);
+
+	static bool check_duplicate(entry_t& e, uint8_t aps_counter);
+	bool on_rx_int(const zb_apsde_data_indication_t& ind);
+	void remove_int(uint16_t nwk);
+
+public:
+	// False when the indication is an APS duplicate and should be dropped.
+	static bool on_rx(const zb_apsde_data_indication_t& ind) {
+		return instance().on_rx_int(ind);
+	}
+	static void remove(uint16_t nwk) { instance().remove_int(nwk); }
+	// Appends the record count (uint16) and one record_t per device.
+	static void serialize(std::vector<uint8_t>& out);
+};
@@ -0,0 +1,283 @@
+#include "fw_update.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+static const char* TAG = "FWU";
+
+static constexpr uint32_t WRITER_STACK = 3072;
+static constexpr UBaseType_t WRITER_PRIORITY = 3;
+static constexpr TickType_t FINISH_WAIT = pdMS_TO_TICKS(10000);
+
+fw_update::fw_update() : m_partition(nullptr), m_active(false), m_size(0), m_crc(0),
+	m_received(0), m_received_crc(0), m_writer(nullptr) {
+	m_sem = xSemaphoreCreateMutex();
+}
+
+fw_update& fw_update::instance() {
+	static fw_update s_fw_update;
+	return s_fw_update;
+}
+
+void fw_update::write_sector(writer_t& w, size_t len) {
+	if (w.error != ESP_OK || w.state == WRITER_ORPHANED) {
+		return;
+	}
+	auto ret = esp_ota_write(w.handle, w.sector, len);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "write failed: %d", ret);
+		w.error = ret;
+	}
+}
+
+void fw_update::destroy(writer_t* w) {
+	chunk_t* chunk = nullptr;
+	while (xQueueReceive(w->queue, &chunk, 0) == pdTRUE) {
+		free(chunk);
+	}
+	vQueueDelete(w->queue);
+	vSemaphoreDelete(w->done);
+	delete w;
+}
+
+void fw_update::writer_task(void* arg) {
+	auto w = static_cast<writer_t*>(arg);
+	while (true) {
+		chunk_t* chunk = nullptr;
+		// an orphaned writer only drains what is left
+		if (xQueueReceive(w->queue, &chunk, w->state == WRITER_ORPHANED ? 0 : portMAX_DELAY) != pdTRUE ||
+			!chunk) {
+			break;
+		}
+		size_t pos = 0;
+		while (pos < chunk->len) {
+			auto n = std::min(chunk->len - pos, SECTOR_SIZE - w->sector_len);
+			memcpy(w->sector + w->sector_len, chunk->data + pos, n);
+			w->sector_len += n;
+			pos += n;
+			if (w->sector_len == SECTOR_SIZE) {
+				write_sector(*w, SECTOR_SIZE);
+				w->sector_len = 0;
+			}
+		}
+		free(chunk);
+	}
+	if (w->sector_len) {
+		write_sector(*w, w->sector_len);
+		w->sector_len = 0;
+	}
+	uint8_t running = WRITER_RUNNING;
+	if (w->state.compare_exchange_strong(running, WRITER_DONE)) {
+		xSemaphoreGive(w->done);
+	} else {
+		ESP_LOGW(TAG, "orphaned writer done");
+		esp_ota_abort(w->handle);
+		destroy(w);
+	}
+	vTaskDelete(nullptr);
+}
+
+// Leaves the writer to finish on its own and abort its update.
+void fw_update::orphan(writer_t* w) {
+	w->state = WRITER_ORPHANED;
+	chunk_t* stop = nullptr;
+	xQueueSend(w->queue, &stop, 0); // wakes it if it waits; a full queue is drained
+}
+
+// Stops the writer and waits for it to write what it has; without the lock,
+// the writer is the caller's alone by now. A writer that takes too long is
+// orphaned.
+esp_err_t fw_update::finish(writer_t* w) {
+	chunk_t* stop = nullptr;
+	if (xQueueSend(w->queue, &stop, FINISH_WAIT) != pdTRUE ||
+		xSemaphoreTake(w->done, FINISH_WAIT) != pdTRUE) {
+		uint8_t running = WRITER_RUNNING;
+		if (w->state.compare_exchange_strong(running, WRITER_ORPHANED)) {
+			ESP_LOGE(TAG, "writer did not finish");
+			chunk_t* wake = nullptr;
+			xQueueSend(w->queue, &wake, 0);
+			return ESP_ERR_TIMEOUT;
+		}
+		xSemaphoreTake(w->done, portMAX_DELAY); // it just made it
+	}
+	return w->error;
+}
+
+void fw_update::abort_locked() {
+	if (!m_active) {
+		return;
+	}
+	orphan(m_writer);
+	m_writer = nullptr;
+	m_active = false;
+	ESP_LOGI(TAG, "aborted at %lu", (unsigned long)m_received);
+}
+
+esp_err_t fw_update::begin(uint32_t size, uint32_t crc) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	self.abort_locked();
+	if (!size) {
+		return ESP_OK;
+	}
+	if (self.m_finishing) {
+		return ESP_ERR_INVALID_STATE; // end() of the last update still running
+	}
+	auto partition = esp_ota_get_next_update_partition(nullptr);
+	if (!partition) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (size > partition->size) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	auto w = new (std::nothrow) writer_t;
+	if (!w) {
+		return ESP_ERR_NO_MEM;
+	}
+	w->queue = xQueueCreate(QUEUE_DEPTH, sizeof(chunk_t*));
+	w->done = xSemaphoreCreateBinary();
+	if (!w->queue || !w->done) {
+		if (w->queue)
+			vQueueDelete(w->queue);
+		if (w->done)
+			vSemaphoreDelete(w->done);
+		delete w;
+		return ESP_ERR_NO_MEM;
+	}
+	// sequential writes: each sector is erased when reached, not all up front
+	auto ret = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &w->handle);
+	if (ret == ESP_OK && xTaskCreate(&writer_task, "fw_update", WRITER_STACK, w,
+		WRITER_PRIORITY, nullptr) != pdTRUE) {
+		esp_ota_abort(w->handle);
+		ret = ESP_ERR_NO_MEM;
+	}
+	if (ret != ESP_OK) {
+		destroy(w);
+		return ret;
+	}
+	self.m_writer = w;
+	self.m_partition = partition;
+	self.m_active = true;
+	self.m_size = size;
+	self.m_crc = crc;
+	self.m_received = 0;
+	self.m_received_crc = 0;
+	ESP_LOGI(TAG, "update of %lu bytes into %s", (unsigned long)size, partition->label);
+	return ESP_OK;
+}
+
+esp_err_t fw_update::write(uint32_t offset, uint32_t crc, const uint8_t* data, size_t len,
+	uint32_t& next_offset) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	next_offset = self.m_received;
+	if (!self.m_active) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (self.m_writer->error != ESP_OK) {
+		return self.m_writer->error;
+	}
+	if (!len || len > MAX_CHUNK || esp_rom_crc32_le(0, data, len) != crc) {
+		return ESP_ERR_INVALID_CRC;
+	}
+	if (offset + len <= self.m_received) {
+		return ESP_OK; // repeated chunk
+	}
+	if (offset != self.m_received || offset + len > self.m_size) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	auto chunk = static_cast<chunk_t*>(malloc(sizeof(chunk_t) + len));
+	if (!chunk) {
+		return ESP_ERR_NO_MEM;
+	}
+	chunk->len = len;
+	memcpy(chunk->data, data, len);
+	if (xQueueSend(self.m_writer->queue, &chunk, 0) != pdTRUE) {
+		free(chunk);
+		return ESP_ERR_TIMEOUT; // busy, the host sends it again
+	}
+	self.m_received += len;
+	self.m_received_crc = esp_rom_crc32_le(self.m_received_crc, data, len);
+	next_offset = self.m_received;
+	return ESP_OK;
+}
+
+esp_err_t fw_update::end() {
+	auto& self = instance();
+	writer_t* w;
+	const esp_partition_t* partition;
+	{
+		utils::sem_lock l(self.m_sem);
+		if (!self.m_active) {
+			return ESP_ERR_INVALID_STATE;
+		}
+		if (self.m_received != self.m_size) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		if (self.m_received_crc != self.m_crc) {
+			ESP_LOGE(TAG, "image crc %08lx, expected %08lx", (unsigned long)self.m_received_crc,
+				(unsigned long)self.m_crc);
+			self.abort_locked();
+			return ESP_ERR_INVALID_CRC;
+		}
+		w = self.m_writer;
+		partition = self.m_partition;
+		self.m_writer = nullptr;
+		self.m_active = false;
+		self.m_finishing = true;
+	}
+	auto ret = finish(w);
+	if (ret == ESP_ERR_TIMEOUT) {
+		self.m_finishing = false;
+		return ret; // the orphaned writer aborts the update
+	}
+	auto handle = w->handle;
+	destroy(w);
+	if (ret != ESP_OK) {
+		esp_ota_abort(handle);
+		self.m_finishing = false;
+		return ret;
+	}
+	ret = esp_ota_end(handle);
+	if (ret == ESP_OK) {
+		ret = esp_ota_set_boot_partition(partition);
+	}
+	self.m_finishing = false;
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "image rejected: %d", ret);
+		return ret;
+	}
+
+	// restart once the response is out
+	static esp_timer_handle_t s_restart = nullptr;
+	esp_timer_create_args_t args = {
+		.callback = [](void*) { esp_restart(); },
+		.arg = nullptr,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "fw_restart",
+		.skip_unhandled_events = false,
+	};
+	if (!s_restart && esp_timer_create(&args, &s_restart) != ESP_OK) {
+		esp_restart();
+	}
+	esp_timer_start_once(s_restart, RESTART_DELAY_MS * 1000);
+	ESP_LOGI(TAG, "booting %s in %lu ms", partition->label, (unsigned long)RESTART_DELAY_MS);
+	return ESP_OK;
+}
+
+void fw_update::confirm_running() {
+	esp_ota_img_states_t state;
+	if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+		state == ESP_OTA_IMG_PENDING_VERIFY) {
+		ESP_LOGI(TAG, "new firmware confirmed");
+		esp_ota_mark_app_valid_cancel_rollback();
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <esp_err.h>
+#include <esp_ota_ops.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+// Update of the NCP's own firmware over the NCP protocol.
+//
+// The host streams the application image into the OTA slot not running:
+// begin(size, crc), write() of consecutive chunks, end(). Every chunk
+// carries its own CRC-32 and is acknowledged as soon as it is checked and
+// queued, so the host can keep sending while earlier chunks go to flash.
+// A writer task collects them into whole flash sectors before writing, and
+// erases sector by sector as it goes, so the flash is never busy for long
+// and Zigbee traffic carries on during the upload. end() checks the CRC of
+// the whole image, lets esp_ota verify it, switches the boot partition and
+// restarts shortly after the response has gone out.
+//
+// write() never waits for the writer: a chunk that finds the queue full is
+// refused (ESP_ERR_TIMEOUT) and the host sends it again. A writer that is
+// stuck in flash is left behind by begin() and end(); it cleans up after
+// itself once it returns, so the next update can start right away.
+//
+// CRCs are CRC-32/ISO-HDLC, as computed by zlib's crc32().
+class fw_update {
+public:
+	static constexpr size_t MAX_CHUNK = 1024;
+	static constexpr size_t QUEUE_DEPTH = 8;  /*!< two sectors of full chunks */
+	static constexpr size_t SECTOR_SIZE = 4096;
+	static constexpr uint32_t RESTART_DELAY_MS = 500;
+
+private:
+	struct chunk_t {
+		size_t len;
+		uint8_t data[];
+	};
+
+	enum writer_state_t : uint8_t {
+		WRITER_RUNNING,
+		WRITER_DONE,            /*!< wrote everything, owned by the caller again */
+		WRITER_ORPHANED,        /*!< given up on, frees itself when it returns */
+	};
+	// Everything the writer task touches, so an orphaned writer can finish
+	// while the next update already runs.
+	struct writer_t {
+		QueueHandle_t queue;                /*!< chunk_t*, nullptr to finish */
+		SemaphoreHandle_t done;
+		esp_ota_handle_t handle;
+		std::atomic<esp_err_t> error{ESP_OK};  /*!< first write error */
+		std::atomic<uint8_t> state{WRITER_RUNNING};
+		size_t sector_len = 0;
+		uint8_t sector[SECTOR_SIZE];
+	};
+
+	fw_update();
+	static fw_update& instance();
+
+	const esp_partition_t* m_partition;
+	bool m_active;
+	uint32_t m_size;
+	uint32_t m_crc;
+	uint32_t m_received;
+	uint32_t m_received_crc;
+	writer_t* m_writer;                 /*!< while m_active */
+	std::atomic<bool> m_finishing{false};   /*!< end() waits for the writer */
+	SemaphoreHandle_t m_sem;
+
+	static void writer_task(void* arg);
+	static void write_sector(writer_t& w, size_t len);
+	static void destroy(writer_t* w);
+	static void orphan(writer_t* w);
+	static esp_err_t finish(writer_t* w);
+	void abort_locked();
+
+public:
+	static esp_err_t begin(uint32_t size, uint32_t crc);
+	// next_offset is where the host is to continue, also on errors.
+	static esp_err_t write(uint32_t offset, uint32_t crc, const uint8_t* data, size_t len,
+		uint32_t& next_offset);
+	static esp_err_t end();
+
+	// Called once the stack is up: a new image that got this far is kept.
+	static void confirm_running();
+};
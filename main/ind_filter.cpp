@@ -0,0 +1,106 @@
+#include "ind_filter.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+static const char* TAG = "FILTER";
+
+ind_filter::ind_filter() {
+	memset(m_slots, 0, sizeof(m_slots));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+ind_filter& ind_filter::instance() {
+	static ind_filter s_ind_filter;
+	return s_ind_filter;
+}
+
+// ZCL header: frame control, [manufacturer code], tsn, command id
+static bool get_zcl_command(const uint8_t* data, size_t len, uint8_t& command_id) {
+	if (len < 3) {
+		return false;
+	}
+	size_t pos = (data[0] & 0x04) ? 4 : 2;
+	if (pos >= len) {
+		return false;
+	}
+	command_id = data[pos];
+	return true;
+}
+
+static bool matches(const ind_filter::rule_t& rule, const zb_apsde_data_indication_t& ind,
+		bool has_command, uint8_t command_id) {
+	if (rule.src_addr != 0xFFFF && rule.src_addr != ind.src_addr)
+		return false;
+	if (rule.src_endpoint != 0xFF && rule.src_endpoint != ind.src_endpoint)
+		return false;
+	if (rule.cluster_id != 0xFFFF && rule.cluster_id != ind.clusterid)
+		return false;
+	if (rule.command_id != 0xFF && (!has_command || rule.command_id != command_id))
+		return false;
+	return true;
+}
+
+// Finds the source in the slot, or takes the entry that passed longest ago.
+bool ind_filter::rate_pass(slot_t& slot, uint16_t src_addr) {
+	auto now = esp_timer_get_time();
+	source_t* src = &slot.sources[0];
+	for (auto& s : slot.sources) {
+		if (s.last_pass_us && s.src_addr == src_addr) {
+			src = &s;
+			break;
+		}
+		if (s.last_pass_us < src->last_pass_us) {
+			src = &s;
+		}
+	}
+	if (src->src_addr == src_addr && src->last_pass_us &&
+		now - src->last_pass_us < int64_t(slot.rule.min_interval_ms) * 1000) {
+		return false;
+	}
+	src->src_addr = src_addr;
+	src->last_pass_us = now;
+	return true;
+}
+
+bool ind_filter::pass_int(const zb_apsde_data_indication_t& ind, const uint8_t* data, size_t len) {
+	uint8_t command_id = 0;
+	bool has_command = get_zcl_command(data, len, command_id);
+
+	utils::sem_lock l(m_sem);
+	for (auto& slot : m_slots) {
+		if (slot.rule.action == ACTION_NONE || !matches(slot.rule, ind, has_command, command_id)) {
+			continue;
+		}
+		if (slot.rule.action == ACTION_RATE_LIMIT && rate_pass(slot, ind.src_addr)) {
+			return true;
+		}
+		++slot.dropped;
+		ESP_LOGV(TAG, "drop %04x ep: %d cluster: %04x", ind.src_addr, int(ind.src_endpoint), ind.clusterid);
+		return false;
+	}
+	return true;
+}
+
+bool ind_filter::set_rule_int(uint8_t index, const rule_t& rule) {
+	if (index >= MAX_RULES || rule.action > ACTION_RATE_LIMIT) {
+		return false;
+	}
+	utils::sem_lock l(m_sem);
+	auto& slot = m_slots[index];
+	if (slot.rule.action != ACTION_NONE && slot.dropped) {
+		ESP_LOGI(TAG, "rule %d replaced, dropped %d", int(index), int(slot.dropped));
+	}
+	slot.rule = rule;
+	memset(slot.sources, 0, sizeof(slot.sources));
+	slot.dropped = 0;
+	return true;
+}
+
+void ind_filter::clear() {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	memset(self.m_slots, 0, sizeof(self.m_slots));
+}
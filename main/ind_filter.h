@@ -0,0 +1,73 @@
+#pragma once
+#include "zboss_decl.h"
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Host-installed rules that keep APS indications from being sent to the
+// host at all.
+//
+// The first enabled rule matching an indication decides: DROP discards it,
+// RATE_LIMIT lets one through per min_interval_ms and discards the rest.
+// Indications matching no rule are sent. Wildcards: src_addr 0xFFFF,
+// endpoint 0xFF, cluster_id 0xFFFF, command_id 0xFF.
+//
+// A RATE_LIMIT rule keeps the interval per source device, so with a
+// wildcard src_addr every device still gets one indication through per
+// interval. Up to SOURCES_PER_RULE devices are tracked per rule; beyond
+// that the one that passed longest ago is forgotten, and a device without
+// history is let through.
+//
+// In-process subscribers of APSDE_DATA_IND still see every indication.
+class ind_filter {
+public:
+	enum action_t : uint8_t {
+		ACTION_NONE = 0,        /*!< Slot unused */
+		ACTION_DROP = 1,
+		ACTION_RATE_LIMIT = 2,
+	};
+	struct rule_t {
+		action_t action;
+		uint16_t src_addr;
+		uint8_t src_endpoint;
+		uint16_t cluster_id;
+		uint8_t command_id;     /*!< ZCL command id */
+		uint16_t min_interval_ms;
+	} __attribute__((packed));
+
+	static constexpr size_t MAX_RULES = 16;
+	static constexpr size_t SOURCES_PER_RULE = 8;
+
+private:
+	ind_filter();
+	static ind_filter& instance();
+
+	struct source_t {
+		uint16_t src_addr;
+		int64_t last_pass_us;   /*!< 0 when unused */
+	};
+	struct slot_t {
+		rule_t rule;
+		source_t sources[SOURCES_PER_RULE];
+		uint32_t dropped;
+	};
+	slot_t m_slots[MAX_RULES];
+	SemaphoreHandle_t m_sem;
+
+	static bool rate_pass(slot_t& slot, uint16_t src_addr);
+	bool pass_int(const zb_apsde_data_indication_t& ind, const uint8_t* data, size_t len);
+	bool set_rule_int(uint8_t index, const rule_t& rule);
+
+public:
+	// Called from data_indication before the indication is serialized.
+	static bool pass(const zb_apsde_data_indication_t& ind, const uint8_t* data, size_t len) {
+		return instance().pass_int(ind, data, len);
+	}
+	// ACTION_NONE clears the slot.
+	static bool set_rule(uint8_t index, const rule_t& rule) {
+		return instance().set_rule_int(index, rule);
+	}
+	static void clear();
+};
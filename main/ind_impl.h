@@ -1,18 +1,30 @@
 #pragma once
 #include "zb_ncp.h"
-#include <functional>
+#include "delegate.h"
 
+// Indications are dispatched from the ZBOSS context, so subscribers are
+// stored inline in a fixed list; nothing on this path touches the heap.
 template<command_id_t CmdId, typename... TArgs>
 struct default_unhandled_ind {
-  using CallbackFunc = std::function<void(TArgs...)>;
+  static constexpr size_t MAX_SUBSCRIBERS = 4;
+  using CallbackFunc = inplace_delegate<void(TArgs...)>;
 
-  inline static CallbackFunc m_callback {
-    [](TArgs...){
+  inline static delegate_list<MAX_SUBSCRIBERS, TArgs...> m_subscribers;
+
+  static void dispatch(TArgs... args) {
+    if (!m_subscribers(args...)) {
       ESP_LOGD("ind_impl", "Unhandled indication: %s", get_command_name(CmdId));
     }
-  };
+  }
 
-  static void connect(const CallbackFunc &callback) { m_callback = callback; }
+  // Adds a subscriber; all connected subscribers see every indication.
+  static bool connect(const CallbackFunc &callback) {
+    if (!m_subscribers.connect(callback)) {
+      ESP_LOGE("ind_impl", "Too many subscribers: %s", get_command_name(CmdId));
+      return false;
+    }
+    return true;
+  }
 };
 
 template <command_id_t CmdId>
@@ -23,7 +35,8 @@ struct zb_ncp::ind_handle { };
   struct zb_ncp::ind_handle<cmd_id> \
     : public default_unhandled_ind<cmd_id, __VA_ARGS__> {}
 
-DECLARE_IND_HANDLE(APSDE_DATA_IND, const zb_apsde_data_indication_t&);
+// APS indication with its payload (data, len).
+DECLARE_IND_HANDLE(APSDE_DATA_IND, const zb_apsde_data_indication_t&, const uint8_t*, uint16_t);
 DECLARE_IND_HANDLE(ZDO_DEV_ANNCE_IND, const zb_zdo_signal_device_annce_params_t&);
 DECLARE_IND_HANDLE(NWK_LEAVE_IND, const zb_zdo_signal_leave_indication_params_t&);
 DECLARE_IND_HANDLE(ZDO_DEV_UPDATE_IND, const zb_zdo_signal_device_update_params_t&);
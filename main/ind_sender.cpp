@@ -0,0 +1,112 @@
+#include "ind_sender.h"
+#include "zb_ncp.h"
+#include "zboss_decl.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+static const char* TAG = "IND";
+
+static constexpr size_t BATCH_HDR_SIZE = sizeof(zb_ncp::ind_t) + 1;
+
+ind_sender::ind_sender() : m_batch_len(BATCH_HDR_SIZE), m_batch_count(0), m_batch_gen(0) {
+	auto hdr = reinterpret_cast<zb_ncp::ind_t*>(m_batch);
+	hdr->version = 0;
+	hdr->type = zb_ncp::INDICATION;
+	hdr->command_id = VENDOR_IND_BATCH;
+}
+
+ind_sender& ind_sender::instance() {
+	static ind_sender s_ind_sender;
+	return s_ind_sender;
+}
+
+bool ind_sender::configure(const config_t& config) {
+	if (config.max_frame < BATCH_HDR_SIZE + sizeof(record_hdr_t) || config.max_frame > MAX_FRAME_SIZE) {
+		return false;
+	}
+	if (config.window_ms == 0 || config.window_ms > MAX_WINDOW_MS) {
+		return false;
+	}
+	auto& self = instance();
+	self.m_window_ms = config.window_ms;
+	self.m_max_frame = config.max_frame;
+	self.m_enabled = config.enabled != 0;
+	ESP_LOGI(TAG, "batching %s window: %d ms frame: %d", config.enabled ? "on" : "off",
+		int(config.window_ms), int(config.max_frame));
+	return true;
+}
+
+void ind_sender::send_single(command_id_t command_id, const void* data, size_t size) {
+	if (size > MAX_IND_SIZE) {
+		ESP_LOGE(TAG, "indication %s too long: %d", get_command_name(command_id), int(size));
+		return;
+	}
+	auto hdr = reinterpret_cast<zb_ncp::ind_t*>(m_frame);
+	hdr->version = 0;
+	hdr->type = zb_ncp::INDICATION;
+	hdr->command_id = command_id;
+	memcpy(hdr + 1, data, size);
+	zb_ncp::send_cmd_data(m_frame, sizeof(zb_ncp::ind_t) + size);
+	ind_store::sent(1);
+}
+
+void ind_sender::reset() {
+	auto& self = instance();
+	self.m_enabled = false;
+	self.m_window_ms = DEFAULT_WINDOW_MS;
+	self.m_max_frame = MAX_FRAME_SIZE;
+	if (self.m_batch_count) {
+		ESP_LOGW(TAG, "batch of %d indications dropped", int(self.m_batch_count));
+	}
+	self.m_batch_len = BATCH_HDR_SIZE;
+	self.m_batch_count = 0;
+	++self.m_batch_gen;
+}
+
+void ind_sender::flush() {
+	if (!m_batch_count) {
+		return;
+	}
+	m_batch[sizeof(zb_ncp::ind_t)] = m_batch_count;
+	ESP_LOGD(TAG, "flush %d indications, %d bytes", int(m_batch_count), int(m_batch_len));
+	zb_ncp::send_cmd_data(m_batch, m_batch_len);
+	ind_store::sent(m_batch_count);
+	m_batch_len = BATCH_HDR_SIZE;
+	m_batch_count = 0;
+	// invalidate the window alarm of the batch just sent
+	++m_batch_gen;
+}
+
+void ind_sender::on_window(uint8_t gen) {
+	auto& self = instance();
+	if (gen == self.m_batch_gen) {
+		self.flush();
+	}
+}
+
+void ind_sender::send_int(command_id_t command_id, const void* data, size_t size) {
+	size_t max_frame = m_max_frame;
+	bool fits = BATCH_HDR_SIZE + sizeof(record_hdr_t) + size <= max_frame;
+	if (!m_enabled || !fits) {
+		// keep the order: anything queued goes out first
+		flush();
+		send_single(command_id, data, size);
+		return;
+	}
+
+	if (m_batch_len + sizeof(record_hdr_t) + size > max_frame) {
+		flush();
+	}
+	record_hdr_t rec = {
+		.command_id = command_id,
+		.len = static_cast<uint8_t>(size)
+	};
+	memcpy(&m_batch[m_batch_len], &rec, sizeof(rec));
+	memcpy(&m_batch[m_batch_len + sizeof(rec)], data, size);
+	m_batch_len += sizeof(rec) + size;
+	if (m_batch_count++ == 0) {
+		ZB_SCHEDULE_APP_ALARM(&ind_sender::on_window, m_batch_gen,
+			ZB_MILLISECONDS_TO_BEACON_INTERVAL(m_window_ms.load()));
+	}
+}
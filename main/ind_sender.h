@@ -0,0 +1,72 @@
+#pragma once
+#include "commands.h"
+#include "ind_store.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Sends indications to the host.
+//
+// By default every indication is one NCP frame, as stock hosts expect.
+// A host that sends VENDOR_SET_IND_BATCHING gets them packed into
+// VENDOR_IND_BATCH frames instead:
+//
+//   count:u8, { command_id:u16, len:u8, payload[len] } * count
+//
+// A batch is sent when the next record would not fit into max_frame bytes
+// or window_ms after its first record, whichever comes first.
+//
+// send() is called from the ZBOSS context only.
+class ind_sender {
+public:
+	struct config_t {
+		uint8_t enabled;
+		uint16_t window_ms;
+		uint16_t max_frame;
+	} __attribute__((packed));
+
+	static constexpr size_t MAX_FRAME_SIZE = 240;
+	// An APSDE_DATA_IND with a reassembled payload is the longest indication.
+	static constexpr size_t MAX_IND_SIZE = 64 + zb_ncp::MAX_APS_PAYLOAD_SIZE;
+	static constexpr uint16_t MAX_WINDOW_MS = 1000;
+	static constexpr uint16_t DEFAULT_WINDOW_MS = 20;
+
+private:
+	ind_sender();
+	static ind_sender& instance();
+
+	struct record_hdr_t {
+		command_id_t command_id;
+		uint8_t len;
+	} __attribute__((packed));
+
+	std::atomic<bool> m_enabled{false};
+	std::atomic<uint16_t> m_window_ms{DEFAULT_WINDOW_MS};
+	std::atomic<uint16_t> m_max_frame{MAX_FRAME_SIZE};
+
+	uint8_t m_batch[MAX_FRAME_SIZE];
+	size_t m_batch_len;
+	uint8_t m_batch_count;
+	uint8_t m_batch_gen;
+	uint8_t m_frame[sizeof(zb_ncp::ind_t) + MAX_IND_SIZE];
+
+	void send_int(command_id_t command_id, const void* data, size_t size);
+	void send_single(command_id_t command_id, const void* data, size_t size);
+	void flush();
+	static void on_window(uint8_t gen);
+
+public:
+	static void send(command_id_t command_id, const void* data, size_t size) {
+		if (!ind_store::hold(command_id, data, size)) {
+			instance().send_int(command_id, data, size);
+		}
+	}
+	static bool configure(const config_t& config);
+	// Sends the batch being collected now; from the ZBOSS context.
+	static void flush_batch() {
+		instance().flush();
+	}
+	// Back to one frame per indication, for a new host session; the batch
+	// being collected is dropped. From the ZBOSS context.
+	static void reset();
+};
@@ -0,0 +1,473 @@
+#include "ind_store.h"
+#include "ind_sender.h"
+#include "protocol.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <nvs_flash.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static const char* TAG = "INDS";
+
+static const char* NVS_PARTITION = "ind_store";
+static const char* NVS_NAMESPACE = "ind_store";
+static const char* NVS_KEY_META = "meta";
+
+static uint32_t now_ms() {
+	return static_cast<uint32_t>(esp_timer_get_time() / 1000);
+}
+
+static void segment_key(uint8_t index, char (&key)[8]) {
+	snprintf(key, sizeof(key), "seg%u", unsigned(index));
+}
+
+ind_store::ind_store() : m_head(0), m_unsent(0), m_pending(0), m_tail(0), m_dropped(0),
+	m_spill_task(nullptr), m_nvs(0), m_spill_meta{0, 0}, m_spill_old(0), m_loaded_old(false),
+	m_out_len(0), m_in_len(0) {
+	m_sem = xSemaphoreCreateMutex();
+}
+
+ind_store& ind_store::instance() {
+	static ind_store s_ind_store;
+	return s_ind_store;
+}
+
+esp_err_t ind_store::init() {
+	auto& self = instance();
+	auto ret = nvs_flash_init_partition(NVS_PARTITION);
+	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		// only spilled indications are lost
+		nvs_flash_erase_partition(NVS_PARTITION);
+		ret = nvs_flash_init_partition(NVS_PARTITION);
+	}
+	if (ret == ESP_OK) {
+		ret = nvs_open_from_partition(NVS_PARTITION, NVS_NAMESPACE, NVS_READWRITE, &self.m_nvs);
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "no %s partition, spill disabled: %d", NVS_PARTITION, ret);
+		return ESP_OK;
+	}
+	meta_t meta;
+	size_t size = sizeof(meta);
+	ret = nvs_get_blob(self.m_nvs, NVS_KEY_META, &meta, &size);
+	if (ret == ESP_OK && size == sizeof(meta) && meta.first < MAX_SPILL_SEGMENTS &&
+		meta.count <= MAX_SPILL_SEGMENTS) {
+		self.m_spill_meta = meta;
+		self.m_spill_old = meta.count;
+		self.m_spill_count = meta.count;
+		if (meta.count) {
+			ESP_LOGI(TAG, "%d spilled segments from before the restart", int(meta.count));
+		}
+	}
+	if (xTaskCreate(&spill_task, "ind_spill", SPILL_STACK, nullptr, SPILL_PRIORITY,
+		&self.m_spill_task) != pdTRUE) {
+		self.m_spill_task = nullptr;
+		self.m_spill_count = 0;
+		nvs_close(self.m_nvs);
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+bool ind_store::configure(const config_t& config) {
+	if (config.host_timeout_ms < MIN_HOST_TIMEOUT_MS) {
+		return false;
+	}
+	auto& self = instance();
+	bool spill = config.spill != 0;
+	if (spill && !self.m_spill_task) {
+		ESP_LOGW(TAG, "no spill partition, spill stays off");
+		spill = false;
+	}
+	self.m_host_timeout_ms = config.host_timeout_ms;
+	self.m_spill = spill;
+	bool was_enabled = self.m_enabled.exchange(config.enabled != 0);
+	ESP_LOGI(TAG, "store %s spill: %s host timeout: %d ms", config.enabled ? "on" : "off",
+		spill ? "on" : "off", int(config.host_timeout_ms));
+	if (config.enabled && !was_enabled && self.m_spill_count) {
+		// the host is talking to us; what was spilled before goes out now
+		self.m_host_up = true;
+		self.schedule_replay(REPLAY_DELAY_MS);
+	}
+	return true;
+}
+
+void ind_store::read(uint32_t pos, void* out, size_t len) const {
+	auto p = static_cast<uint8_t*>(out);
+	size_t index = pos % RING_SIZE;
+	size_t first = std::min(len, RING_SIZE - index);
+	memcpy(p, &m_ring[index], first);
+	memcpy(p + first, m_ring, len - first);
+}
+
+void ind_store::write(uint32_t pos, const void* data, size_t len) {
+	auto p = static_cast<const uint8_t*>(data);
+	size_t index = pos % RING_SIZE;
+	size_t first = std::min(len, RING_SIZE - index);
+	memcpy(&m_ring[index], p, first);
+	memcpy(m_ring, p + first, len - first);
+}
+
+size_t ind_store::record_size(uint32_t pos) const {
+	record_hdr_t hdr;
+	read(pos, &hdr, sizeof(hdr));
+	return sizeof(hdr) + hdr.len;
+}
+
+void ind_store::clear() {
+	if (m_pending != m_tail) {
+		ESP_LOGW(TAG, "store off, %d bytes of held indications dropped", int(m_tail - m_pending));
+	}
+	m_head = m_unsent = m_pending = m_tail;
+}
+
+bool ind_store::hold_int(command_id_t command_id, const void* data, size_t size) {
+	check_host();
+	bool live = m_host_up && m_pending == m_tail && !m_spill_count && !m_replay_scheduled;
+	if (size > MAX_PAYLOAD) {
+		if (live) {
+			return false; // goes out, but is not kept for a later replay
+		}
+		ESP_LOGW(TAG, "%s too long to hold, dropped", get_command_name(command_id));
+		++m_dropped;
+		return true;
+	}
+	auto now = now_ms();
+	record_hdr_t hdr = {
+		.time_ms = now,
+		.sent_ms = now,
+		.command_id = command_id,
+		.len = static_cast<uint16_t>(size)
+	};
+	while (RING_SIZE - (m_tail - m_head) < sizeof(hdr) + size) {
+		make_room();
+	}
+	write(m_tail, &hdr, sizeof(hdr));
+	write(m_tail + sizeof(hdr), data, size);
+	m_tail += sizeof(hdr) + size;
+	if (live) {
+		m_pending = m_tail; // sent_ms is set by sent()
+		return false;
+	}
+	if (m_host_up) {
+		schedule_replay(0);
+	}
+	return true;
+}
+
+// Records go out in the order they were taken, so the oldest unsent ones
+// are those on the link now.
+void ind_store::sent_int(size_t count) {
+	auto now = now_ms();
+	for (; count && m_unsent != m_pending; --count) {
+		record_hdr_t hdr;
+		read(m_unsent, &hdr, sizeof(hdr));
+		hdr.sent_ms = now;
+		write(m_unsent, &hdr, sizeof(hdr));
+		m_unsent += sizeof(hdr) + hdr.len;
+	}
+}
+
+void ind_store::make_room() {
+	if (m_head != m_pending) {
+		// with the host already, or on its way in a batch
+		auto size = record_size(m_head);
+		if (m_unsent == m_head) {
+			m_unsent += size;
+		}
+		m_head += size;
+		return;
+	}
+	if (m_spill && spill_segment()) {
+		return;
+	}
+	m_head += record_size(m_head);
+	m_unsent = m_pending = m_head;
+	if (m_dropped++ % 64 == 0) {
+		ESP_LOGW(TAG, "ring full, held indications dropped: %lu", (unsigned long)m_dropped);
+	}
+}
+
+// Moves the oldest held records into m_out, for spill_task to write as the
+// next NVS segment:
+//   count:u16, { record_hdr_t, payload } * count
+// False while the previous segment is still being written or the spill is
+// full.
+bool ind_store::spill_segment() {
+	if (!m_spill_task || m_writing || m_spill_count >= MAX_SPILL_SEGMENTS) {
+		return false;
+	}
+	uint16_t count = 0;
+	size_t len = sizeof(count);
+	uint32_t pos = m_head;
+	while (pos != m_tail) {
+		auto size = record_size(pos);
+		if (len + size > SPILL_SEGMENT_SIZE) {
+			break;
+		}
+		read(pos, m_out + len, size);
+		len += size;
+		pos += size;
+		++count;
+	}
+	memcpy(m_out, &count, sizeof(count));
+	m_out_len = len;
+	m_head = m_unsent = m_pending = pos;
+	++m_spill_count;
+	m_writing = true;
+	xTaskNotifyGive(m_spill_task);
+	ESP_LOGD(TAG, "spilling %d indications", int(count));
+	return true;
+}
+
+void ind_store::check_host() {
+	if (m_host_up && !protocol::host_alive(m_host_timeout_ms)) {
+		host_lost();
+	}
+}
+
+void ind_store::host_lost() {
+	m_host_up = false;
+	// whatever went out after the host's last packet may be lost with it,
+	// and what is still batched has not gone out at all
+	auto last_rx = protocol::last_rx_ms();
+	uint32_t pos = m_head;
+	while (pos != m_unsent) {
+		record_hdr_t hdr;
+		read(pos, &hdr, sizeof(hdr));
+		if (int32_t(hdr.sent_ms - last_rx) >= 0) {
+			break;
+		}
+		pos += sizeof(hdr) + hdr.len;
+	}
+	size_t taken_back = 0;
+	for (auto p = pos; p != m_pending; p += record_size(p)) {
+		++taken_back;
+	}
+	m_unsent = m_pending = pos;
+	ESP_LOGW(TAG, "host lost, %d indications taken back", int(taken_back));
+}
+
+void ind_store::on_host_rx() {
+	auto& self = instance();
+	if (self.m_enabled && !self.m_host_up.exchange(true)) {
+		ESP_LOGI(TAG, "host back");
+		// An NCP_RESET as its first packet turns the store off first (soft,
+		// reset()) or spills the ring and restarts (plain, restart()); the
+		// replay then waits for the store to be enabled.
+		self.schedule_replay(REPLAY_DELAY_MS);
+	}
+}
+
+void ind_store::reset() {
+	auto& self = instance();
+	self.m_enabled = false;
+	self.m_spill = false;
+	self.m_host_timeout_ms = DEFAULT_HOST_TIMEOUT_MS;
+	self.m_host_up = true;
+	self.clear();
+}
+
+void ind_store::spill_task(void* arg) {
+	auto& self = instance();
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		self.spill_work();
+	}
+}
+
+// The segment replayed last is erased first: the one being written may
+// need its slot.
+void ind_store::spill_work() {
+	utils::sem_lock l(m_sem);
+	if (m_consumed.exchange(false)) {
+		drop_segment();
+		save_meta();
+	}
+	if (m_writing) {
+		write_segment();
+		m_writing = false;
+	}
+	if (m_load_wanted.exchange(false) && !m_loaded) {
+		load_segment();
+	}
+}
+
+void ind_store::write_segment() {
+	if (m_spill_meta.count == MAX_SPILL_SEGMENTS) {
+		ESP_LOGW(TAG, "spill full, oldest segment dropped");
+		drop_segment();
+	}
+	char key[8];
+	segment_key((m_spill_meta.first + m_spill_meta.count) % MAX_SPILL_SEGMENTS, key);
+	auto ret = nvs_set_blob(m_nvs, key, m_out, m_out_len);
+	if (ret == ESP_OK) {
+		++m_spill_meta.count;
+		if (!save_meta()) {
+			--m_spill_meta.count;
+			ret = ESP_FAIL;
+		}
+	}
+	if (ret != ESP_OK) {
+		--m_spill_count;
+		ESP_LOGE(TAG, "spill failed, indications dropped: %d", ret);
+		return;
+	}
+	ESP_LOGD(TAG, "spilled %d bytes to %s", int(m_out_len), key);
+}
+
+void ind_store::drop_segment() {
+	if (!m_spill_meta.count) {
+		return;
+	}
+	char key[8];
+	segment_key(m_spill_meta.first, key);
+	nvs_erase_key(m_nvs, key);
+	m_spill_meta.first = (m_spill_meta.first + 1) % MAX_SPILL_SEGMENTS;
+	--m_spill_meta.count;
+	if (m_spill_old) {
+		--m_spill_old;
+	}
+}
+
+// Reads the oldest segment into m_in; one that cannot be read is skipped.
+void ind_store::load_segment() {
+	while (m_spill_meta.count) {
+		char key[8];
+		segment_key(m_spill_meta.first, key);
+		size_t size = sizeof(m_in);
+		auto ret = nvs_get_blob(m_nvs, key, m_in, &size);
+		if (ret == ESP_OK && size >= sizeof(uint16_t)) {
+			m_in_len = size;
+			m_loaded_old = m_spill_old > 0;
+			m_loaded = true;
+			return;
+		}
+		ESP_LOGE(TAG, "%s not readable: %d, skipped", key, ret);
+		drop_segment();
+		save_meta();
+		--m_spill_count;
+	}
+}
+
+bool ind_store::save_meta() {
+	return nvs_set_blob(m_nvs, NVS_KEY_META, &m_spill_meta, sizeof(m_spill_meta)) == ESP_OK &&
+		nvs_commit(m_nvs) == ESP_OK;
+}
+
+void ind_store::schedule_replay(uint32_t delay_ms) {
+	if (!m_replay_scheduled.exchange(true)) {
+		ZB_SCHEDULE_APP_ALARM(&ind_store::on_replay, 0, ZB_MILLISECONDS_TO_BEACON_INTERVAL(delay_ms));
+	}
+}
+
+void ind_store::on_replay(zb_uint8_t param) {
+	instance().replay();
+}
+
+void ind_store::replay() {
+	check_host();
+	if (!m_enabled || !m_host_up) {
+		m_replay_scheduled = false;
+		return;
+	}
+	// what is still batched is older than anything held
+	ind_sender::flush_batch();
+	if (m_spill_count) {
+		replay_segment();
+		ZB_SCHEDULE_APP_ALARM(&ind_store::on_replay, 0, ZB_MILLISECONDS_TO_BEACON_INTERVAL(REPLAY_PERIOD_MS));
+		return;
+	}
+	auto now = now_ms();
+	for (size_t n = 0; n < REPLAY_BURST && m_pending != m_tail; ++n) {
+		record_hdr_t hdr;
+		read(m_pending, &hdr, sizeof(hdr));
+		read(m_pending + sizeof(hdr), &m_frame[sizeof(replay_hdr_t)], hdr.len);
+		send_replay(now - hdr.time_ms, hdr.command_id, hdr.len);
+		hdr.sent_ms = now;
+		write(m_pending, &hdr, sizeof(hdr));
+		m_pending += sizeof(hdr) + hdr.len;
+		m_unsent = m_pending;
+	}
+	if (m_pending != m_tail) {
+		ZB_SCHEDULE_APP_ALARM(&ind_store::on_replay, 0, ZB_MILLISECONDS_TO_BEACON_INTERVAL(REPLAY_PERIOD_MS));
+		return;
+	}
+	m_replay_scheduled = false;
+	ESP_LOGI(TAG, "replay done");
+}
+
+// Replays the oldest spilled segment once spill_task has loaded it, and
+// asks for the next one.
+void ind_store::replay_segment() {
+	if (!m_loaded) {
+		m_load_wanted = true;
+		xTaskNotifyGive(m_spill_task);
+		return;
+	}
+	uint16_t count;
+	memcpy(&count, m_in, sizeof(count));
+	size_t pos = sizeof(count);
+	auto now = now_ms();
+	for (uint16_t i = 0; i < count && pos + sizeof(record_hdr_t) <= m_in_len; ++i) {
+		record_hdr_t hdr;
+		memcpy(&hdr, &m_in[pos], sizeof(hdr));
+		pos += sizeof(hdr);
+		if (hdr.len > MAX_PAYLOAD || pos + hdr.len > m_in_len) {
+			break;
+		}
+		memcpy(&m_frame[sizeof(replay_hdr_t)], &m_in[pos], hdr.len);
+		pos += hdr.len;
+		send_replay(m_loaded_old ? AGE_UNKNOWN : now - hdr.time_ms, hdr.command_id, hdr.len);
+	}
+	m_loaded = false;
+	m_consumed = true;
+	if (--m_spill_count) {
+		m_load_wanted = true;
+	}
+	xTaskNotifyGive(m_spill_task);
+}
+
+void ind_store::send_replay(uint32_t age_ms, command_id_t command_id, size_t len) {
+	auto hdr = reinterpret_cast<replay_hdr_t*>(m_frame);
+	hdr->ind.version = 0;
+	hdr->ind.type = zb_ncp::INDICATION;
+	hdr->ind.command_id = VENDOR_IND_REPLAY;
+	hdr->age_ms = age_ms;
+	hdr->command_id = command_id;
+	zb_ncp::send_cmd_data(m_frame, sizeof(replay_hdr_t) + len);
+}
+
+void ind_store::restart() {
+	auto& self = instance();
+	if (self.m_enabled && self.m_spill && self.m_pending != self.m_tail &&
+		ZB_SCHEDULE_APP_CALLBACK(&ind_store::on_restart, 0) == RET_OK) {
+		return;
+	}
+	esp_restart();
+}
+
+// The stack goes down with the restart, so waiting for spill_task in its
+// context does no harm here. What the host already has is let go.
+void ind_store::on_restart(zb_uint8_t param) {
+	auto& self = instance();
+	auto start = now_ms();
+	self.m_head = self.m_unsent = self.m_pending;
+	while ((self.m_pending != self.m_tail || self.m_writing) &&
+		now_ms() - start < RESTART_SPILL_MS) {
+		if (self.m_pending == self.m_tail || !self.spill_segment()) {
+			if (!self.m_writing && self.m_spill_count >= MAX_SPILL_SEGMENTS) {
+				break;
+			}
+			vTaskDelay(pdMS_TO_TICKS(10));
+		}
+	}
+	if (self.m_pending != self.m_tail) {
+		ESP_LOGW(TAG, "%d bytes of held indications not spilled", int(self.m_tail - self.m_pending));
+	}
+	esp_restart();
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include "commands.h"
+#include "zb_ncp.h"
+#include "zboss_decl.h"
+#include <esp_err.h>
+#include <nvs.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// Store-and-forward of indications while the host is away.
+//
+// With the store enabled (VENDOR_SET_IND_STORE) every indication to the host
+// is kept in a RAM ring. The host counts as away once it has left a link
+// packet unacknowledged for host_timeout_ms (protocol::host_alive()); from
+// then on indications are held in the ring. Those sent after the host's last
+// packet are taken back as well, they may never have reached it.
+//
+// The host is back with the next packet it sends. The held indications are
+// then replayed in order, each in its own VENDOR_IND_REPLAY frame:
+//
+//   age_ms:u32, command_id:u16, payload
+//
+// age_ms is the time since the indication arrived, AGE_UNKNOWN when it was
+// held before the NCP restarted. New indications wait behind the replay, so
+// the host sees everything in the order it arrived.
+//
+// When the ring is full, the oldest held indications are spilled in segments
+// of up to SPILL_SEGMENT_SIZE bytes if spill is on. The spill is the NVS
+// partition "ind_store" of its own, so it cannot crowd out the other
+// namespaces. Spilled segments survive a restart and are replayed once the
+// host enables the store again. With spill off, without the partition, or
+// while the spill is full or busy, the oldest indications in RAM are
+// dropped.
+//
+// hold() and the replay run in the ZBOSS context. They only copy records
+// between the ring and two static segment buffers; NVS is written and read
+// by a task of its own (spill_task), so flash never blocks the stack.
+//
+// A soft NCP_RESET turns the store off, as a restart would (reset()): the
+// new host may not know the replay frames. Indications held in RAM are
+// dropped, spilled ones stay until a host enables the store again. A plain
+// NCP_RESET restarts the NCP and spills the held indications first
+// (restart()).
+class ind_store {
+public:
+	struct config_t {
+		uint8_t enabled;
+		uint8_t spill;
+		uint16_t host_timeout_ms;
+	} __attribute__((packed));
+
+	static constexpr size_t RING_SIZE = 8 * 1024;  /*!< power of two */
+	static constexpr size_t SPILL_SEGMENT_SIZE = 2048;
+	static constexpr size_t MAX_SPILL_SEGMENTS = 8;  /*!< 16K of the 32K partition */
+	static constexpr uint16_t MIN_HOST_TIMEOUT_MS = 100;
+	static constexpr uint16_t DEFAULT_HOST_TIMEOUT_MS = 2000;
+	static constexpr uint32_t AGE_UNKNOWN = 0xffffffff;
+
+private:
+	ind_store();
+	static ind_store& instance();
+
+	struct record_hdr_t {
+		uint32_t time_ms;        /*!< arrival, ms since boot */
+		uint32_t sent_ms;        /*!< last time it went to the host */
+		command_id_t command_id;
+		uint16_t len;
+	} __attribute__((packed));
+	struct replay_hdr_t {
+		zb_ncp::ind_t ind;
+		uint32_t age_ms;
+		command_id_t command_id;
+	} __attribute__((packed));
+	struct meta_t {
+		uint8_t first;
+		uint8_t count;
+	} __attribute__((packed));
+
+	static constexpr size_t MAX_PAYLOAD = SPILL_SEGMENT_SIZE - sizeof(uint16_t) - sizeof(record_hdr_t);
+	static constexpr size_t REPLAY_BURST = 16;
+	static constexpr uint32_t REPLAY_DELAY_MS = 100;
+	static constexpr uint32_t REPLAY_PERIOD_MS = 10;
+	static constexpr uint32_t SPILL_STACK = 3072;
+	static constexpr UBaseType_t SPILL_PRIORITY = 3;
+	static constexpr uint32_t RESTART_SPILL_MS = 2000;
+	static_assert((RING_SIZE & (RING_SIZE - 1)) == 0);
+
+	std::atomic<bool> m_enabled{false};
+	std::atomic<bool> m_spill{false};
+	std::atomic<uint16_t> m_host_timeout_ms{DEFAULT_HOST_TIMEOUT_MS};
+	std::atomic<bool> m_host_up{true};
+	std::atomic<bool> m_replay_scheduled{false};
+
+	// Positions only grow, the ring index is pos % RING_SIZE. Records from
+	// m_head to m_pending went to the host, the rest are held. Of those
+	// that went, the ones from m_unsent on still wait in ind_sender's batch.
+	uint8_t m_ring[RING_SIZE];
+	uint32_t m_head;
+	uint32_t m_unsent;
+	uint32_t m_pending;
+	uint32_t m_tail;
+	uint32_t m_dropped;
+
+	// Spill, shared with spill_task. m_spill_count counts the segments in
+	// NVS and the one being written; it is what the ZBOSS context goes by.
+	// The segment buffers belong to spill_task while m_writing / before
+	// m_loaded is set.
+	TaskHandle_t m_spill_task;
+	SemaphoreHandle_t m_sem;        /*!< NVS handle and m_spill_meta */
+	nvs_handle_t m_nvs;
+	meta_t m_spill_meta;
+	uint8_t m_spill_old;            /*!< segments spilled before the restart */
+	std::atomic<uint8_t> m_spill_count{0};
+	std::atomic<bool> m_writing{false};
+	std::atomic<bool> m_load_wanted{false};
+	std::atomic<bool> m_loaded{false};
+	std::atomic<bool> m_consumed{false};
+	bool m_loaded_old;
+	uint8_t m_out[SPILL_SEGMENT_SIZE];
+	size_t m_out_len;
+	uint8_t m_in[SPILL_SEGMENT_SIZE];
+	size_t m_in_len;
+
+	uint8_t m_frame[sizeof(replay_hdr_t) + MAX_PAYLOAD];
+
+	void read(uint32_t pos, void* out, size_t len) const;
+	void write(uint32_t pos, const void* data, size_t len);
+	size_t record_size(uint32_t pos) const;
+
+	bool hold_int(command_id_t command_id, const void* data, size_t size);
+	void sent_int(size_t count);
+	void clear();
+	void make_room();
+	bool spill_segment();
+	void check_host();
+	void host_lost();
+
+	static void spill_task(void* arg);
+	void spill_work();
+	void write_segment();
+	void drop_segment();
+	void load_segment();
+	bool save_meta();
+
+	void schedule_replay(uint32_t delay_ms);
+	static void on_replay(zb_uint8_t param);
+	void replay();
+	void replay_segment();
+	void send_replay(uint32_t age_ms, command_id_t command_id, size_t len);
+	static void on_restart(zb_uint8_t param);
+
+public:
+	// Loads the spill state; before the ZBOSS task starts.
+	static esp_err_t init();
+	static bool configure(const config_t& config);
+
+	// Takes an indication on its way to the host. False when it is to be
+	// sent right away (it is kept, as sent once sent() says so), true when
+	// it is held.
+	static bool hold(command_id_t command_id, const void* data, size_t size) {
+		auto& self = instance();
+		if (!self.m_enabled) {
+			if (self.m_tail != self.m_head) {
+				self.clear();
+			}
+			return false;
+		}
+		return self.hold_int(command_id, data, size);
+	}
+
+	// ind_sender put the next count indications it was given on the link;
+	// they count as sent from now, not from when they were taken.
+	static void sent(size_t count) {
+		auto& self = instance();
+		if (self.m_enabled) {
+			self.sent_int(count);
+		}
+	}
+
+	// Any valid packet from the host; from the app task.
+	static void on_host_rx();
+
+	// Restarts the NCP for a plain NCP_RESET, once the held indications are
+	// spilled so they are replayed after it.
+	static void restart();
+	// Back to the defaults for a new host session; from the ZBOSS context.
+	static void reset();
+};
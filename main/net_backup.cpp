@@ -0,0 +1,280 @@
+#include "net_backup.h"
+#include "utils.h"
+#include "zboss_decl.h"
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_system.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+
+static const char* TAG = "BKP";
+
+// Partitions in a snapshot, by section id. zb_fct holds factory data that
+// is not erasable in place and stays with the stick.
+static const char* const SECTIONS[] = {
+	"zb_storage",
+};
+
+static constexpr size_t MAX_LITERAL = 128;
+static constexpr size_t MIN_RUN = 3;
+static constexpr size_t MAX_RUN = 130;
+
+static const esp_partition_t* find_section(uint8_t id) {
+	if (id >= std::size(SECTIONS)) {
+		return nullptr;
+	}
+	return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SECTIONS[id]);
+}
+
+net_backup::net_backup() : m_restore_total(0) {
+	m_sem = xSemaphoreCreateMutex();
+}
+
+net_backup& net_backup::instance() {
+	static net_backup s_net_backup;
+	return s_net_backup;
+}
+
+// PackBits: a control byte c < 128 is followed by c + 1 literal bytes,
+// c >= 128 by one byte repeated c - 125 times.
+void net_backup::pack(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+	size_t pos = 0;
+	while (pos < len) {
+		size_t run = 1;
+		while (pos + run < len && run < MAX_RUN && data[pos + run] == data[pos]) {
+			++run;
+		}
+		if (run >= MIN_RUN) {
+			out.push_back(uint8_t(run + 125));
+			out.push_back(data[pos]);
+			pos += run;
+			continue;
+		}
+		// literals up to the next run worth packing
+		size_t lit = 0;
+		while (pos + lit < len && lit < MAX_LITERAL) {
+			auto p = pos + lit;
+			if (p + MIN_RUN <= len && data[p] == data[p + 1] && data[p] == data[p + 2]) {
+				break;
+			}
+			++lit;
+		}
+		out.push_back(uint8_t(lit - 1));
+		out.insert(out.end(), data + pos, data + pos + lit);
+		pos += lit;
+	}
+}
+
+bool net_backup::unpack(const uint8_t* data, size_t len, uint8_t* out, size_t out_len) {
+	size_t in = 0, o = 0;
+	while (in < len) {
+		auto c = data[in++];
+		if (c < 128) {
+			size_t n = c + 1;
+			if (in + n > len || o + n > out_len) {
+				return false;
+			}
+			memcpy(out + o, data + in, n);
+			in += n;
+			o += n;
+		} else {
+			size_t n = c - 125;
+			if (in >= len || o + n > out_len) {
+				return false;
+			}
+			memset(out + o, data[in++], n);
+			o += n;
+		}
+	}
+	return o == out_len;
+}
+
+esp_err_t net_backup::serialize(std::vector<uint8_t>& out) {
+	header_t hdr = {
+		.magic = MAGIC,
+		.version = VERSION,
+		.section_count = uint8_t(std::size(SECTIONS)),
+		.stack_version = zboss_version_get(),
+	};
+	auto hdr_pos = out.size();
+	out.resize(hdr_pos + sizeof(hdr));
+	memcpy(out.data() + hdr_pos, &hdr, sizeof(hdr));
+
+	for (uint8_t id = 0; id < std::size(SECTIONS); ++id) {
+		auto part = find_section(id);
+		if (!part) {
+			ESP_LOGE(TAG, "no partition %s", SECTIONS[id]);
+			return ESP_ERR_NOT_FOUND;
+		}
+		std::unique_ptr<uint8_t[]> raw(new (std::nothrow) uint8_t[part->size]);
+		if (!raw) {
+			return ESP_ERR_NO_MEM;
+		}
+		auto ret = esp_partition_read(part, 0, raw.get(), part->size);
+		if (ret != ESP_OK) {
+			return ret;
+		}
+		auto sec_pos = out.size();
+		out.resize(sec_pos + sizeof(section_t));
+		pack(raw.get(), part->size, out);
+		section_t sec = {
+			.id = id,
+			.raw_size = part->size,
+			.packed_size = uint32_t(out.size() - sec_pos - sizeof(section_t)),
+			.crc = esp_rom_crc32_le(0, raw.get(), part->size),
+		};
+		memcpy(out.data() + sec_pos, &sec, sizeof(sec));
+		ESP_LOGI(TAG, "%s: %lu bytes packed to %lu", SECTIONS[id], (unsigned long)sec.raw_size,
+			(unsigned long)sec.packed_size);
+	}
+	return ESP_OK;
+}
+
+esp_err_t net_backup::backup_chunk(uint32_t offset, uint8_t* out, size_t& len, uint32_t& total) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	len = 0;
+	if (offset == 0) {
+		self.m_backup.clear();
+		auto ret = serialize(self.m_backup);
+		if (ret != ESP_OK) {
+			self.m_backup.clear();
+			self.m_backup.shrink_to_fit();
+			return ret;
+		}
+	}
+	total = self.m_backup.size();
+	if (!total || offset >= total) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	len = std::min<size_t>(MAX_CHUNK_SIZE, total - offset);
+	memcpy(out, self.m_backup.data() + offset, len);
+	if (offset + len == total) {
+		self.m_backup.clear();
+		self.m_backup.shrink_to_fit();
+	}
+	return ESP_OK;
+}
+
+// Checks the collected snapshot; unpacks the sections when asked to.
+esp_err_t net_backup::check_locked(std::vector<std::vector<uint8_t>>* sections) {
+	auto data = m_restore.data();
+	auto len = m_restore.size();
+	header_t hdr;
+	if (len < sizeof(hdr)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.magic != MAGIC) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (hdr.version != VERSION) {
+		return ESP_ERR_INVALID_VERSION;
+	}
+	if (hdr.stack_version != zboss_version_get()) {
+		ESP_LOGE(TAG, "snapshot of stack %08lx, running %08lx", (unsigned long)hdr.stack_version,
+			(unsigned long)zboss_version_get());
+		return ESP_ERR_INVALID_VERSION;
+	}
+	size_t pos = sizeof(hdr);
+	for (uint8_t i = 0; i < hdr.section_count; ++i) {
+		section_t sec;
+		if (pos + sizeof(sec) > len) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		memcpy(&sec, data + pos, sizeof(sec));
+		pos += sizeof(sec);
+		auto part = find_section(sec.id);
+		if (!part || sec.raw_size != part->size) {
+			ESP_LOGE(TAG, "section %d does not fit this partition table", int(sec.id));
+			return ESP_ERR_NOT_FOUND;
+		}
+		if (pos + sec.packed_size > len) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		std::vector<uint8_t> raw(sec.raw_size);
+		if (!unpack(data + pos, sec.packed_size, raw.data(), raw.size()) ||
+			esp_rom_crc32_le(0, raw.data(), raw.size()) != sec.crc) {
+			return ESP_ERR_INVALID_CRC;
+		}
+		pos += sec.packed_size;
+		if (sections) {
+			sections->resize(std::max<size_t>(sections->size(), sec.id + 1));
+			(*sections)[sec.id] = std::move(raw);
+		}
+	}
+	return pos == len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t net_backup::restore_chunk(uint32_t offset, uint32_t total, const uint8_t* data, size_t len,
+	bool& complete) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	complete = false;
+	if (total > MAX_SNAPSHOT_SIZE) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if (offset == 0) {
+		self.m_restore.clear();
+		self.m_restore.reserve(total);
+		self.m_restore_total = total;
+	}
+	if (total != self.m_restore_total || offset != self.m_restore.size() || offset + len > total) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	self.m_restore.insert(self.m_restore.end(), data, data + len);
+	if (self.m_restore.size() < total) {
+		return ESP_OK;
+	}
+	auto ret = self.check_locked(nullptr);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "snapshot rejected: %d", ret);
+		self.m_restore.clear();
+		self.m_restore.shrink_to_fit();
+		return ret;
+	}
+	complete = true;
+	return ESP_OK;
+}
+
+esp_err_t net_backup::apply() {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	std::vector<std::vector<uint8_t>> sections;
+	auto ret = self.check_locked(&sections);
+	self.m_restore.clear();
+	self.m_restore.shrink_to_fit();
+	if (ret != ESP_OK) {
+		return ret;
+	}
+	for (uint8_t id = 0; id < sections.size(); ++id) {
+		auto& raw = sections[id];
+		if (raw.empty()) {
+			continue;
+		}
+		auto part = find_section(id);
+		ret = esp_partition_erase_range(part, 0, part->size);
+		if (ret == ESP_OK) {
+			ret = esp_partition_write(part, 0, raw.data(), raw.size());
+		}
+		if (ret != ESP_OK) {
+			// the NVRAM is damaged now; the host has to send the snapshot again
+			ESP_LOGE(TAG, "%s: write failed: %d", SECTIONS[id], ret);
+			return ret;
+		}
+		ESP_LOGI(TAG, "%s restored", SECTIONS[id]);
+	}
+	return ESP_OK;
+}
+
+// Blocks the ZBOSS context on purpose: the stack runs no more between the
+// NVRAM write and the restart, so it cannot write its old state back.
+void net_backup::restart() {
+	vTaskDelay(pdMS_TO_TICKS(RESTART_DELAY_MS));
+	esp_restart();
+}
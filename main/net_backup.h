@@ -0,0 +1,86 @@
+#pragma once
+#include <esp_err.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Snapshot of the whole network state of the coordinator, for moving it to
+// another stick without re-pairing.
+//
+// All persistent state of the stack lives in its NVRAM (the "zb_storage"
+// partition): network parameters and keys, the address map, neighbours,
+// bindings, security material. A snapshot is that partition, packed:
+//
+//   header_t, then per section: section_t, packed data
+//
+// Data is run-length packed (PackBits); NVRAM is mostly erased flash and
+// shrinks to a fraction. Every section carries the CRC-32 of its raw
+// content.
+//
+// A backup is taken in the ZBOSS context, so no dataset is half-written
+// while it reads, and kept in RAM while the host fetches it chunk by chunk.
+// A snapshot is only restored by the stack version that wrote it, the NVRAM
+// layout is private to the stack. A restore is collected in RAM chunk by chunk, checked as
+// a whole, then written over the NVRAM from the ZBOSS context, which stays
+// blocked until the NCP restarts into the restored network: the stack does
+// not run in between and cannot write its old state back.
+//
+// The coordinator IEEE address is not part of a snapshot: it is read from
+// the eFuse MAC of the stick (zb_fct stays behind too), so a restored
+// network runs under the IEEE address of the stick it is restored on.
+class net_backup {
+public:
+	static constexpr uint32_t MAGIC = 0x4b42425a;   /*!< "ZBBK" */
+	static constexpr uint8_t VERSION = 1;
+	static constexpr size_t MAX_SNAPSHOT_SIZE = 32 * 1024;
+	static constexpr uint32_t RESTART_DELAY_MS = 200;
+	static constexpr size_t MAX_CHUNK_SIZE = 1024;
+
+	struct header_t {
+		uint32_t magic;
+		uint8_t version;
+		uint8_t section_count;
+		uint32_t stack_version;     /*!< of the stack that wrote it */
+	} __attribute__((packed));
+
+	struct section_t {
+		uint8_t id;                 /*!< index into the partition list */
+		uint32_t raw_size;
+		uint32_t packed_size;
+		uint32_t crc;
+	} __attribute__((packed));
+
+private:
+	net_backup();
+	static net_backup& instance();
+
+	std::vector<uint8_t> m_backup;
+	std::vector<uint8_t> m_restore;
+	uint32_t m_restore_total;
+	SemaphoreHandle_t m_sem;
+
+	static void pack(const uint8_t* data, size_t len, std::vector<uint8_t>& out);
+	static bool unpack(const uint8_t* data, size_t len, uint8_t* out, size_t out_len);
+	esp_err_t check_locked(std::vector<std::vector<uint8_t>>* sections);
+	static esp_err_t serialize(std::vector<uint8_t>& out);
+
+public:
+	// Copies up to MAX_CHUNK_SIZE bytes of the snapshot at offset to out and
+	// sets len and the snapshot's total size. Offset 0 takes a new snapshot,
+	// from the ZBOSS context; it is let go once its last chunk is read.
+	static esp_err_t backup_chunk(uint32_t offset, uint8_t* out, size_t& len, uint32_t& total);
+
+	// Collects a chunk of a snapshot of total bytes; complete is set once
+	// all of it is there and valid. A chunk at offset 0 starts over.
+	static esp_err_t restore_chunk(uint32_t offset, uint32_t total, const uint8_t* data, size_t len,
+		bool& complete);
+	// Writes the collected snapshot over the NVRAM. From the ZBOSS context;
+	// on success restart() must follow before the stack runs again.
+	static esp_err_t apply();
+	// Restarts after RESTART_DELAY_MS, time for the response to go out.
+	// From the ZBOSS context, which it does not give back.
+	static void restart();
+};
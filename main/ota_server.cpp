@@ -0,0 +1,566 @@
+#include "ota_server.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <algorithm>
+#include <cstring>
+
+static const char* TAG = "OTA";
+
+static const char* PARTITION_LABEL = "zb_ota";
+static const char* NVS_NAMESPACE = "ota";
+static const char* NVS_KEY_SIZE = "size";
+
+static constexpr uint16_t OTA_CLUSTER_ID = 0x0019;
+static constexpr uint8_t OTA_ENDPOINT = 1;
+
+// ZCL OTA Upgrade cluster commands
+static constexpr uint8_t CMD_QUERY_NEXT_IMAGE_REQ = 0x01;
+static constexpr uint8_t CMD_QUERY_NEXT_IMAGE_RESP = 0x02;
+static constexpr uint8_t CMD_IMAGE_BLOCK_REQ = 0x03;
+static constexpr uint8_t CMD_IMAGE_PAGE_REQ = 0x04;
+static constexpr uint8_t CMD_IMAGE_BLOCK_RESP = 0x05;
+static constexpr uint8_t CMD_UPGRADE_END_REQ = 0x06;
+static constexpr uint8_t CMD_UPGRADE_END_RESP = 0x07;
+
+static constexpr uint8_t ZCL_STATUS_SUCCESS = 0x00;
+static constexpr uint8_t ZCL_STATUS_WAIT_FOR_DATA = 0x97;
+static constexpr uint8_t ZCL_STATUS_NO_IMAGE_AVAILABLE = 0x98;
+
+// cluster specific, server to client, no default response
+static constexpr uint8_t ZCL_FC_REPLY = 0x19;
+
+// OTA file header, see ZCL spec 11.4.2
+static constexpr uint32_t OTA_FILE_ID = 0x0BEEF11E;
+static constexpr size_t OTA_HEADER_MIN = 56;
+static constexpr uint16_t OTA_FC_SECURITY_CREDENTIAL = 0x01;
+static constexpr uint16_t OTA_FC_DEVICE_SPECIFIC = 0x02;
+static constexpr uint16_t OTA_FC_HW_VERSIONS = 0x04;
+
+// a device over the client limit asks again after this long
+static constexpr uint32_t CLIENT_WAIT_S = 30;
+
+template <typename T>
+static T get(const uint8_t* p) {
+	T v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+template <typename T>
+static uint8_t* put(uint8_t* p, T v) {
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static uint32_t now_s() {
+	return static_cast<uint32_t>(esp_timer_get_time() / 1000000);
+}
+
+ota_server::ota_server() : m_partition(nullptr), m_state(STATE_EMPTY), m_upload_size(0),
+	m_written(0), m_erased(0), m_tokens_ms(0), m_tokens_at(0), m_blocks_served(0), m_upgrades_finished(0) {
+	memset(&m_image, 0, sizeof(m_image));
+	memset(m_clients, 0, sizeof(m_clients));
+	memset(m_pending, 0, sizeof(m_pending));
+	m_config = {
+		.max_clients = 4,
+		.blocks_per_s = 20,
+		.min_block_period_ms = 0,
+	};
+	m_sem = xSemaphoreCreateMutex();
+}
+
+ota_server& ota_server::instance() {
+	static ota_server s_ota_server;
+	return s_ota_server;
+}
+
+esp_err_t ota_server::init() {
+	auto& self = instance();
+	self.m_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL);
+	if (!self.m_partition) {
+		ESP_LOGW(TAG, "no %s partition, OTA server disabled", PARTITION_LABEL);
+		return ESP_ERR_NOT_FOUND;
+	}
+	nvs_handle_t h;
+	if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+		return ESP_OK; // nothing staged yet
+	}
+	uint32_t size = 0;
+	auto ret = nvs_get_u32(h, NVS_KEY_SIZE, &size);
+	nvs_close(h);
+	if (ret != ESP_OK) {
+		return ESP_OK;
+	}
+	utils::sem_lock l(self.m_sem);
+	self.m_upload_size = size;
+	self.m_written = size;
+	ret = self.load_image_locked();
+	if (ret == ESP_OK) {
+		self.m_state = STATE_ACTIVE;
+	} else {
+		ESP_LOGE(TAG, "staged image invalid: %d", ret);
+	}
+	return ret;
+}
+
+// Reads the OTA header of the uploaded image into m_image.
+esp_err_t ota_server::load_image_locked() {
+	uint8_t hdr[OTA_HEADER_MIN + 1 + 8 + 4];
+	auto ret = esp_partition_read(m_partition, 0, hdr, sizeof(hdr));
+	if (ret != ESP_OK) {
+		return ret;
+	}
+	auto header_len = get<uint16_t>(hdr + 6);
+	auto fc = get<uint16_t>(hdr + 8);
+	if (get<uint32_t>(hdr) != OTA_FILE_ID || header_len < OTA_HEADER_MIN || header_len > m_written) {
+		return ESP_ERR_INVALID_VERSION;
+	}
+	image_t image = {
+		.manufacturer_code = get<uint16_t>(hdr + 10),
+		.image_type = get<uint16_t>(hdr + 12),
+		.file_version = get<uint32_t>(hdr + 14),
+		.size = get<uint32_t>(hdr + 52),
+		.min_hw_version = 0,
+		.max_hw_version = 0xffff,
+	};
+	if (image.size != m_written) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	size_t pos = OTA_HEADER_MIN;
+	if (fc & OTA_FC_SECURITY_CREDENTIAL)
+		pos += 1;
+	if (fc & OTA_FC_DEVICE_SPECIFIC)
+		pos += 8;
+	if (fc & OTA_FC_HW_VERSIONS) {
+		if (pos + 4 > header_len) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		image.min_hw_version = get<uint16_t>(hdr + pos);
+		image.max_hw_version = get<uint16_t>(hdr + pos + 2);
+	}
+	m_image = image;
+	ESP_LOGI(TAG, "image %04x/%04x version: %08lx size: %lu", image.manufacturer_code,
+		image.image_type, (unsigned long)image.file_version, (unsigned long)image.size);
+	return ESP_OK;
+}
+
+esp_err_t ota_server::begin(uint32_t size) {
+	auto& self = instance();
+	if (!self.m_partition) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (size && (size < OTA_HEADER_MIN || size > self.m_partition->size)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	utils::sem_lock l(self.m_sem);
+	nvs_handle_t h;
+	if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+		nvs_erase_key(h, NVS_KEY_SIZE);
+		nvs_commit(h);
+		nvs_close(h);
+	}
+	self.m_state = size ? STATE_UPLOADING : STATE_EMPTY;
+	self.m_upload_size = size;
+	self.m_written = 0;
+	self.m_erased = 0;
+	memset(&self.m_image, 0, sizeof(self.m_image));
+	memset(self.m_clients, 0, sizeof(self.m_clients));
+	ESP_LOGI(TAG, size ? "upload of %lu bytes" : "image cleared", (unsigned long)size);
+	return ESP_OK;
+}
+
+esp_err_t ota_server::write(uint32_t offset, const uint8_t* data, size_t len) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	if (self.m_state != STATE_UPLOADING) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (offset + len <= self.m_written) {
+		return ESP_OK; // repeated chunk
+	}
+	if (offset != self.m_written || offset + len > self.m_upload_size) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	// erase ahead of the data, one sector at a time
+	auto sector = self.m_partition->erase_size;
+	while (self.m_erased < offset + len) {
+		auto ret = esp_partition_erase_range(self.m_partition, self.m_erased, sector);
+		if (ret != ESP_OK) {
+			return ret;
+		}
+		self.m_erased += sector;
+	}
+	auto ret = esp_partition_write(self.m_partition, offset, data, len);
+	if (ret != ESP_OK) {
+		return ret;
+	}
+	self.m_written += len;
+	return ESP_OK;
+}
+
+esp_err_t ota_server::end() {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	if (self.m_state != STATE_UPLOADING) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (self.m_written != self.m_upload_size) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	auto ret = self.load_image_locked();
+	if (ret != ESP_OK) {
+		return ret;
+	}
+	nvs_handle_t h;
+	ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h);
+	if (ret == ESP_OK) {
+		ret = nvs_set_u32(h, NVS_KEY_SIZE, self.m_written);
+		if (ret == ESP_OK) {
+			ret = nvs_commit(h);
+		}
+		nvs_close(h);
+	}
+	if (ret != ESP_OK) {
+		ESP_LOGW(TAG, "image not persisted: %d", ret);
+	}
+	self.m_blocks_served = 0;
+	self.m_upgrades_finished = 0;
+	self.m_state = STATE_ACTIVE;
+	return ESP_OK;
+}
+
+bool ota_server::configure(const config_t& config) {
+	if (config.max_clients == 0 || config.max_clients > MAX_CLIENTS || config.blocks_per_s == 0) {
+		return false;
+	}
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	self.m_config = config;
+	ESP_LOGI(TAG, "clients: %d blocks: %d/s period: %d ms", int(config.max_clients),
+		int(config.blocks_per_s), int(config.min_block_period_ms));
+	return true;
+}
+
+void ota_server::get_status(status_t& status) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	auto now = now_s();
+	uint8_t clients = 0;
+	for (auto& c : self.m_clients) {
+		if (c.last_seen && now - c.last_seen < CLIENT_TIMEOUT_S)
+			++clients;
+	}
+	status = {
+		.state = self.m_state,
+		.manufacturer_code = self.m_image.manufacturer_code,
+		.image_type = self.m_image.image_type,
+		.file_version = self.m_image.file_version,
+		.image_size = self.m_upload_size,
+		.received = self.m_written,
+		.clients = clients,
+		.blocks_served = self.m_blocks_served,
+		.upgrades_finished = self.m_upgrades_finished,
+	};
+}
+
+bool ota_server::admit_client(uint16_t nwk, uint32_t now) {
+	client_t* free_slot = nullptr;
+	size_t active = 0;
+	for (auto& c : m_clients) {
+		bool live = c.last_seen && now - c.last_seen < CLIENT_TIMEOUT_S;
+		if (live && c.nwk == nwk) {
+			c.last_seen = now;
+			return true;
+		}
+		if (live) {
+			++active;
+		} else if (!free_slot) {
+			free_slot = &c;
+		}
+	}
+	if (active >= m_config.max_clients || !free_slot) {
+		return false;
+	}
+	ESP_LOGI(TAG, "%04x started download", nwk);
+	*free_slot = {.nwk = nwk, .last_seen = now ? now : 1};
+	return true;
+}
+
+bool ota_server::take_token() {
+	// m_tokens_ms holds blocks * 1000, up to one second worth of blocks
+	auto now = esp_timer_get_time() / 1000;
+	uint32_t cap = uint32_t(m_config.blocks_per_s) * 1000;
+	m_tokens_ms = std::min<uint64_t>(cap, m_tokens_ms + (now - m_tokens_at) * m_config.blocks_per_s);
+	m_tokens_at = now;
+	if (m_tokens_ms < 1000) {
+		return false;
+	}
+	m_tokens_ms -= 1000;
+	return true;
+}
+
+// Image Block Response with data from offset, status SUCCESS.
+size_t ota_server::build_block(uint8_t* out, uint32_t offset, uint8_t max_size) {
+	uint8_t size = std::min<uint32_t>({max_size, MAX_BLOCK_SIZE, m_image.size - offset});
+	auto p = out;
+	*p++ = ZCL_STATUS_SUCCESS;
+	p = put(p, m_image.manufacturer_code);
+	p = put(p, m_image.image_type);
+	p = put(p, m_image.file_version);
+	p = put(p, offset);
+	*p++ = size;
+	if (esp_partition_read(m_partition, offset, p, size) != ESP_OK) {
+		return 0;
+	}
+	++m_blocks_served;
+	return p + size - out;
+}
+
+// Image Block Response with WAIT_FOR_DATA; a current time of 0 makes the
+// request time relative.
+size_t ota_server::build_wait(uint8_t* out, uint32_t delay_s) {
+	auto p = out;
+	*p++ = ZCL_STATUS_WAIT_FOR_DATA;
+	p = put(p, uint32_t(0));
+	p = put(p, delay_s);
+	p = put(p, m_config.min_block_period_ms);
+	return p - out;
+}
+
+void ota_server::query_next_image(const dest_t& dest, const uint8_t* payload, size_t len) {
+	std::array<uint8_t, MAX_REPLY> out;
+	auto p = out.data();
+	*p++ = ZCL_STATUS_SUCCESS;
+	p = put(p, m_image.manufacturer_code);
+	p = put(p, m_image.image_type);
+	p = put(p, m_image.file_version);
+	p = put(p, m_image.size);
+	ESP_LOGI(TAG, "%04x: image %08lx available", dest.nwk, (unsigned long)m_image.file_version);
+	reply(dest, CMD_QUERY_NEXT_IMAGE_RESP, p - out.data(), out);
+}
+
+void ota_server::image_block(const dest_t& dest, const uint8_t* payload, size_t len) {
+	auto offset = get<uint32_t>(payload + 9);
+	auto max_size = payload[13];
+	std::array<uint8_t, MAX_REPLY> out;
+	size_t n;
+	if (!admit_client(dest.nwk, now_s())) {
+		n = build_wait(out.data(), CLIENT_WAIT_S);
+	} else if (!take_token()) {
+		n = build_wait(out.data(), 1);
+	} else {
+		n = build_block(out.data(), offset, max_size);
+	}
+	if (n) {
+		reply(dest, CMD_IMAGE_BLOCK_RESP, n, out);
+	}
+}
+
+void ota_server::image_page(const dest_t& dest, const uint8_t* payload, size_t len) {
+	page_t p = {
+		.dest = dest,
+		.offset = get<uint32_t>(payload + 9),
+		.end = 0,
+		.block_size = payload[13],
+		.spacing_ms = get<uint16_t>(payload + 16),
+	};
+	p.end = std::min<uint32_t>(m_image.size, p.offset + get<uint16_t>(payload + 14));
+	if (!admit_client(dest.nwk, now_s())) {
+		std::array<uint8_t, MAX_REPLY> out;
+		reply(dest, CMD_IMAGE_BLOCK_RESP, build_wait(out.data(), CLIENT_WAIT_S), out);
+		return;
+	}
+	if (!page(p)) {
+		ESP_LOGW(TAG, "%04x: no frame for page", dest.nwk);
+	}
+}
+
+void ota_server::upgrade_end(const dest_t& dest, const uint8_t* payload, size_t len) {
+	auto status = payload[0];
+	for (auto& c : m_clients) {
+		if (c.last_seen && c.nwk == dest.nwk)
+			c.last_seen = 0;
+	}
+	ESP_LOGI(TAG, "%04x: upgrade end status: %02x", dest.nwk, int(status));
+	if (status != ZCL_STATUS_SUCCESS) {
+		return; // no response to a failed download
+	}
+	++m_upgrades_finished;
+	std::array<uint8_t, MAX_REPLY> out;
+	auto p = out.data();
+	p = put(p, m_image.manufacturer_code);
+	p = put(p, m_image.image_type);
+	p = put(p, m_image.file_version);
+	p = put(p, uint32_t(0));    // current time
+	p = put(p, uint32_t(0));    // upgrade time: now
+	reply(dest, CMD_UPGRADE_END_RESP, p - out.data(), out);
+}
+
+bool ota_server::on_rx(const zb_apsde_data_indication_t& ind, const uint8_t* data, size_t len) {
+	if (ind.clusterid != OTA_CLUSTER_ID || ind.dst_endpoint != OTA_ENDPOINT || len < 3) {
+		return false;
+	}
+	auto& self = instance();
+	if (self.m_state != STATE_ACTIVE) {
+		return false;
+	}
+	auto fc = data[0];
+	// cluster specific, client to server, not manufacturer specific
+	if ((fc & 0x0f) != 0x01) {
+		return false;
+	}
+	dest_t dest = {.nwk = ind.src_addr, .endpoint = ind.src_endpoint, .tsn = data[1]};
+	auto command_id = data[2];
+	auto payload = data + 3;
+	len -= 3;
+
+	size_t min_len = 0;
+	switch (command_id) {
+	case CMD_QUERY_NEXT_IMAGE_REQ: min_len = 9; break;
+	case CMD_IMAGE_BLOCK_REQ: min_len = 14; break;
+	case CMD_IMAGE_PAGE_REQ: min_len = 18; break;
+	case CMD_UPGRADE_END_REQ: min_len = 9; break;
+	}
+	if (!min_len || len < min_len) {
+		return false;
+	}
+	// every request carries manufacturer code, image type and file version,
+	// after the status in Upgrade End and the field control in the others
+	auto ident = payload + 1;
+	utils::sem_lock l(self.m_sem);
+	auto& image = self.m_image;
+	if (self.m_state != STATE_ACTIVE || get<uint16_t>(ident) != image.manufacturer_code ||
+		get<uint16_t>(ident + 2) != image.image_type) {
+		return false;
+	}
+	auto version = get<uint32_t>(ident + 4);
+	switch (command_id) {
+	case CMD_QUERY_NEXT_IMAGE_REQ: {
+		if (version >= image.file_version) {
+			return false;
+		}
+		if ((payload[0] & 0x01) && len >= 11) {
+			auto hw_version = get<uint16_t>(payload + 9);
+			if (hw_version < image.min_hw_version || hw_version > image.max_hw_version) {
+				return false;
+			}
+		}
+		self.query_next_image(dest, payload, len);
+		return true;
+	}
+	case CMD_IMAGE_BLOCK_REQ:
+		if (version != image.file_version || get<uint32_t>(payload + 9) >= image.size) {
+			return false;
+		}
+		self.image_block(dest, payload, len);
+		return true;
+	case CMD_IMAGE_PAGE_REQ:
+		if (version != image.file_version || get<uint32_t>(payload + 9) >= image.size) {
+			return false;
+		}
+		self.image_page(dest, payload, len);
+		return true;
+	case CMD_UPGRADE_END_REQ:
+		if (version == image.file_version) {
+			self.upgrade_end(dest, payload, len);
+		}
+		return false; // the host learns of it too
+	}
+	return false;
+}
+
+bool ota_server::send(zb_bufid_t buf, const dest_t& dest, uint8_t command_id,
+	const uint8_t* payload, size_t len) {
+	uint8_t frame[MAX_REPLY];
+	frame[0] = ZCL_FC_REPLY;
+	frame[1] = dest.tsn;
+	frame[2] = command_id;
+	memcpy(frame + 3, payload, len);
+
+	auto& self = instance();
+	pending_t* pending = nullptr;
+	auto now = now_s();
+	for (auto& p : self.m_pending) {
+		if (!p.used || now - p.sent_s > PENDING_TIMEOUT_S) {
+			pending = &p;
+			break;
+		}
+	}
+	// without a slot its confirm would be taken for one of the host's
+	if (!pending) {
+		ESP_LOGW(TAG, "%04x: too many frames unconfirmed", dest.nwk);
+		zb_buf_free(buf);
+		return false;
+	}
+	zb_addr_u addr = {};
+	addr.addr_short = dest.nwk;
+	auto ret = zb_aps_send_user_payload(buf, addr, ZB_AF_HA_PROFILE_ID, OTA_CLUSTER_ID,
+		dest.endpoint, OTA_ENDPOINT, ZB_APS_ADDR_MODE_16_ENDP_PRESENT, ZB_TRUE, frame, len + 3);
+	if (ret != RET_OK) {
+		ESP_LOGW(TAG, "%04x: send failed %d", dest.nwk, int(ret));
+		return false;
+	}
+	*pending = {.nwk = dest.nwk, .endpoint = dest.endpoint, .tsn = dest.tsn,
+		.command_id = command_id, .used = true, .sent_s = now};
+	return true;
+}
+
+bool ota_server::on_confirm(uint8_t addr_mode, const uint8_t* addr, uint8_t endpoint,
+	const uint8_t* data, size_t len) {
+	if (addr_mode != ZB_APS_ADDR_MODE_16_ENDP_PRESENT || len < 3 || data[0] != ZCL_FC_REPLY) {
+		return false;
+	}
+	auto nwk = get<uint16_t>(addr);
+	for (auto& p : instance().m_pending) {
+		if (p.used && p.nwk == nwk && p.endpoint == endpoint && p.tsn == data[1] &&
+			p.command_id == data[2]) {
+			p.used = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+zb_coro::task ota_server::reply(dest_t dest, uint8_t command_id, uint8_t len,
+	std::array<uint8_t, MAX_REPLY> payload) {
+	auto buf = co_await zb_coro::buf_get_out(len + 3);
+	if (buf) {
+		send(buf, dest, command_id, payload.data(), len);
+	}
+}
+
+// Image Page Response: the blocks of a page, response_spacing apart. It
+// stops early when the rate limit is hit; the device asks again for what
+// it missed.
+zb_coro::task ota_server::page(page_t p) {
+	auto& self = instance();
+	// started from on_rx, which still holds m_sem
+	if (!co_await zb_coro::schedule()) {
+		co_return;
+	}
+	while (p.offset < p.end) {
+		std::array<uint8_t, MAX_REPLY> out;
+		size_t n;
+		{
+			utils::sem_lock l(self.m_sem);
+			if (self.m_state != STATE_ACTIVE || !self.take_token()) {
+				break;
+			}
+			n = self.build_block(out.data(), p.offset, std::min<uint32_t>(p.block_size, p.end - p.offset));
+		}
+		if (!n) {
+			break;
+		}
+		auto buf = co_await zb_coro::buf_get_out(n + 3);
+		if (!buf || !send(buf, p.dest, CMD_IMAGE_BLOCK_RESP, out.data(), n)) {
+			break;
+		}
+		p.offset += out[13];
+		if (!co_await zb_coro::schedule(p.spacing_ms)) {
+			break;
+		}
+	}
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include "zboss_decl.h"
+#include "zb_coro.h"
+#include <esp_err.h>
+#include <esp_partition.h>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// OTA Upgrade cluster server (0x0019) of endpoint 1, serving one image kept
+// in the "zb_ota" flash partition.
+//
+// The host uploads the image once: begin(size), write() in order, end().
+// From then on the NCP answers Query Next Image, Image Block and Image Page
+// requests for it by itself, so no block crosses the serial link. A request
+// is answered when its manufacturer code and image type match the image
+// (and, for Query Next Image, the device runs an older version and its
+// hardware version is in range); anything else goes to the host as before.
+// Upgrade End requests for the image are answered with "upgrade now" and
+// passed to the host as well.
+//
+// Block traffic is rate-limited: at most max_clients devices download at a
+// time and at most blocks_per_s blocks go out per second. A device over
+// either limit is told to come back later (WAIT_FOR_DATA), and every device
+// is asked to keep min_block_period_ms between its block requests.
+//
+// The image survives a restart: its size is kept in NVS once complete.
+class ota_server {
+public:
+	struct config_t {
+		uint8_t max_clients;
+		uint16_t blocks_per_s;
+		uint16_t min_block_period_ms;
+	} __attribute__((packed));
+
+	struct status_t {
+		uint8_t state;              /*!< state_t */
+		uint16_t manufacturer_code;
+		uint16_t image_type;
+		uint32_t file_version;
+		uint32_t image_size;
+		uint32_t received;          /*!< bytes uploaded so far */
+		uint8_t clients;            /*!< devices downloading now */
+		uint32_t blocks_served;
+		uint16_t upgrades_finished;
+	} __attribute__((packed));
+
+	enum state_t : uint8_t {
+		STATE_EMPTY = 0,
+		STATE_UPLOADING = 1,
+		STATE_ACTIVE = 2,
+	};
+
+	static constexpr size_t MAX_CLIENTS = 8;
+	static constexpr size_t MAX_BLOCK_SIZE = 64;
+	static constexpr uint32_t CLIENT_TIMEOUT_S = 60;
+
+private:
+	struct image_t {
+		uint16_t manufacturer_code;
+		uint16_t image_type;
+		uint32_t file_version;
+		uint32_t size;
+		uint16_t min_hw_version;
+		uint16_t max_hw_version;
+	};
+	struct client_t {
+		uint16_t nwk;
+		uint32_t last_seen;         /*!< seconds since boot, 0 when unused */
+	};
+	struct dest_t {
+		uint16_t nwk;
+		uint8_t endpoint;
+		uint8_t tsn;
+	};
+	struct page_t {
+		dest_t dest;
+		uint32_t offset;
+		uint32_t end;
+		uint8_t block_size;
+		uint16_t spacing_ms;
+	};
+	// ZCL frames sent and not confirmed yet, to pick their confirms out of
+	// the host's.
+	struct pending_t {
+		uint16_t nwk;
+		uint8_t endpoint;
+		uint8_t tsn;
+		uint8_t command_id;
+		bool used;
+		uint32_t sent_s;
+	};
+	static constexpr size_t MAX_PENDING = 16;
+	// a slot whose confirm never came is taken again after this long
+	static constexpr uint32_t PENDING_TIMEOUT_S = 30;
+	static constexpr size_t MAX_REPLY = 3 + 17 + MAX_BLOCK_SIZE;
+
+	ota_server();
+	static ota_server& instance();
+
+	const esp_partition_t* m_partition;
+	std::atomic<uint8_t> m_state;
+	image_t m_image;
+	uint32_t m_upload_size;
+	uint32_t m_written;
+	uint32_t m_erased;
+	SemaphoreHandle_t m_sem;
+
+	config_t m_config;
+	client_t m_clients[MAX_CLIENTS];
+	uint32_t m_tokens_ms;           /*!< token bucket, in ms worth of blocks */
+	int64_t m_tokens_at;
+	uint32_t m_blocks_served;
+	uint16_t m_upgrades_finished;
+	pending_t m_pending[MAX_PENDING];
+
+	esp_err_t load_image_locked();
+	bool admit_client(uint16_t nwk, uint32_t now);
+	bool take_token();
+	size_t build_block(uint8_t* out, uint32_t offset, uint8_t max_size);
+	size_t build_wait(uint8_t* out, uint32_t delay_s);
+
+	void query_next_image(const dest_t& dest, const uint8_t* payload, size_t len);
+	void image_block(const dest_t& dest, const uint8_t* payload, size_t len);
+	void image_page(const dest_t& dest, const uint8_t* payload, size_t len);
+	void upgrade_end(const dest_t& dest, const uint8_t* payload, size_t len);
+
+	static bool send(zb_bufid_t buf, const dest_t& dest, uint8_t command_id,
+		const uint8_t* payload, size_t len);
+	static zb_coro::task reply(dest_t dest, uint8_t command_id, uint8_t len, std::array<uint8_t, MAX_REPLY> payload);
+	static zb_coro::task page(page_t page);
+
+public:
+	static esp_err_t init();
+	static esp_err_t begin(uint32_t size);
+	static esp_err_t write(uint32_t offset, const uint8_t* data, size_t len);
+	static esp_err_t end();
+	static bool configure(const config_t& config);
+	static void get_status(status_t& status);
+
+	// From the ZBOSS context. True when the frame was answered here and must
+	// not go to the host.
+	static bool on_rx(const zb_apsde_data_indication_t& ind, const uint8_t* data, size_t len);
+	// True when the confirmed frame (destination, APS payload) was sent from
+	// here. Checked before the host's requests, whose tsn may be the same.
+	static bool on_confirm(uint8_t addr_mode, const uint8_t* addr, uint8_t endpoint,
+		const uint8_t* data, size_t len);
+};
@@ -0,0 +1,110 @@
+#include "payload_arena.h"
+
+#include <esp_log.h>
+#include <atomic>
+#include <cstring>
+
+static const char* TAG = "ARENA";
+
+namespace {
+	struct size_class_t {
+		size_t size;
+		size_t count;
+	};
+
+	// A full class spills into the larger ones, so short frames have all of
+	// them. The 288-byte class alone holds 16 requests of any length without
+	// a fragmented payload, as many as could be in flight before the arena.
+	constexpr size_class_t CLASSES[payload_arena::CLASS_COUNT] = {
+		{32, 24},
+		{64, 12},
+		{128, 6},
+		{288, 16},
+		{payload_arena::MAX_SIZE, 2},
+	};
+
+	constexpr size_t class_offset(size_t cls) {
+		size_t offset = 0;
+		for (size_t i = 0; i < cls; ++i) {
+			offset += CLASSES[i].size * CLASSES[i].count;
+		}
+		return offset;
+	}
+
+	constexpr bool classes_valid() {
+		for (size_t i = 0; i < payload_arena::CLASS_COUNT; ++i) {
+			if (CLASSES[i].count > 32 || CLASSES[i].size % alignof(std::max_align_t))
+				return false;
+			if (i && CLASSES[i].size <= CLASSES[i - 1].size)
+				return false;
+		}
+		return CLASSES[payload_arena::CLASS_COUNT - 1].size == payload_arena::MAX_SIZE;
+	}
+	static_assert(classes_valid(), "bad size classes");
+}
+
+alignas(std::max_align_t) static uint8_t s_storage[class_offset(payload_arena::CLASS_COUNT)];
+static std::atomic<uint32_t> s_used[payload_arena::CLASS_COUNT];
+
+payload_arena::block payload_arena::copy(const void* data, size_t size) {
+	for (size_t cls = 0; cls < CLASS_COUNT; ++cls) {
+		if (CLASSES[cls].size < size)
+			continue;
+		// a full class spills into the next larger one
+		auto used = s_used[cls].load();
+		while (true) {
+			auto free = ~used;
+			if (CLASSES[cls].count < 32) {
+				free &= (uint32_t(1) << CLASSES[cls].count) - 1;
+			}
+			if (!free) {
+				break;
+			}
+			auto idx = __builtin_ctz(free);
+			if (s_used[cls].compare_exchange_weak(used, used | (uint32_t(1) << idx))) {
+				auto p = &s_storage[class_offset(cls) + idx * CLASSES[cls].size];
+				memcpy(p, data, size);
+				memset(p + size, 0, CLASSES[cls].size - size);
+				return block(p);
+			}
+		}
+	}
+	ESP_LOGW(TAG, "no free block for %d bytes", int(size));
+	return block();
+}
+
+void payload_arena::release(uint8_t* data) {
+	size_t offset = data - s_storage;
+	for (size_t cls = 0; cls < CLASS_COUNT; ++cls) {
+		if (offset < class_offset(cls + 1)) {
+			auto idx = (offset - class_offset(cls)) / CLASSES[cls].size;
+			s_used[cls].fetch_and(~(uint32_t(1) << idx));
+			return;
+		}
+	}
+	ESP_LOGE(TAG, "release of foreign block %p", data);
+}
+
+size_t payload_arena::used() {
+	size_t n = 0;
+	for (auto& used : s_used) {
+		n += __builtin_popcount(used.load());
+	}
+	return n;
+}
+
+payload_arena::block& payload_arena::block::operator=(block&& other) {
+	if (this != &other) {
+		reset();
+		m_data = other.m_data;
+		other.m_data = nullptr;
+	}
+	return *this;
+}
+
+void payload_arena::block::reset() {
+	if (m_data) {
+		release(m_data);
+		m_data = nullptr;
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Size-classed pool for request payloads that outlive the host frame they
+// came in, such as an APSDE_DATA_REQ waiting for its turn and its buffer.
+// A payload takes the smallest free block that holds it, so a typical ZCL
+// frame of a few bytes does not pin a block sized for the largest one.
+// The largest class holds a request with a fragmented APS payload, so no
+// payload comes from the heap.
+//
+// Blocks are taken in the command task and returned from the ZBOSS task;
+// every class keeps a lock-free bitmap, like the coroutine frame pool.
+class payload_arena {
+public:
+	static constexpr size_t CLASS_COUNT = 5;
+	static constexpr size_t MAX_SIZE = 1088;
+
+	// Owns one block until destroyed. Movable, so it can be passed by value
+	// into a coroutine.
+	class block {
+	public:
+		block() : m_data(nullptr) {}
+		block(block&& other) : m_data(other.m_data) { other.m_data = nullptr; }
+		block& operator=(block&& other);
+		block(const block&) = delete;
+		block& operator=(const block&) = delete;
+		~block() { reset(); }
+
+		explicit operator bool() const { return m_data != nullptr; }
+		uint8_t* data() const { return m_data; }
+		template <typename T>
+		T* as() const { return reinterpret_cast<T*>(m_data); }
+		void reset();
+
+	private:
+		friend class payload_arena;
+		explicit block(uint8_t* data) : m_data(data) {}
+		uint8_t* m_data;
+	};
+
+	// Copies size bytes of data into the smallest free block that holds them
+	// and zeroes the rest of the block. Empty if no block is free.
+	static block copy(const void* data, size_t size);
+	// Blocks in use, over all classes.
+	static size_t used();
+
+private:
+	static void release(uint8_t* data);
+};
@@ -1,10 +1,13 @@
 #include "protocol.h"
 #include "transport.h"
 #include "app.h"
+#include "ind_store.h"
 #include "utils.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
+#include <algorithm>
 
 static const char* TAG = "PROT";
 
@@ -32,6 +35,10 @@ static uint8_t* find_signature(uint8_t* s,const uint8_t* end) {
 	return nullptr;
 }
 
+static uint32_t now_ms() {
+	return static_cast<uint32_t>(esp_timer_get_time() / 1000);
+}
+
 static const uint8_t next_seq_map[4] = {
 	0x01,
 	0x02,
@@ -84,40 +91,89 @@ void protocol::send_nack(const ncp_header_t& hdr) {
 	}
 }
 
+// Packets longer than one LL frame are sent as consecutive fragments under
+// one lock, so frames of other senders cannot get in between. Every fragment
+// carries its own body CRC; only the first one starts with the HL header.
+//
+// A host that acknowledges gets the next fragment once it has acked the one
+// before (or after FRAGMENT_ACK_TIMEOUT_MS), so a small host receive buffer
+// is not overrun. The task that parses the host's packets cannot see the
+// ACK while it sends; its fragments still go back to back.
 esp_err_t protocol::send_data_int(const void* data,size_t size) {
 	if (!data || size==0) {
 		return ESP_OK; // @todo
 	}
-	if (size > (TX_BUFFER_SIZE-sizeof(ncp_header_t)-2)) {
+	if (size > MAX_PACKET_SIZE) {
 		ESP_LOGE(TAG,"failed send data, too long");
 		return ESP_FAIL;
 	}
 
 	utils::sem_lock l(m_tx_sem);
 
-	auto hdr = reinterpret_cast<ncp_header_t*>(m_tx_buffer);
-	hdr->signature[0] = 0xde;
-	hdr->signature[1] = 0xad;
-	hdr->packet_len = size + sizeof(ncp_header_t) + 2 - 2;
-	hdr->packet_type = ZBOSS_NCP_API_HL;
-	hdr->is_ack = 0;
-	hdr->is_nack = 0;
-	hdr->packet_seq = m_tx_seq;
-	hdr->ack_seq = 0;
-	hdr->first_fragment = 1;
-	hdr->last_fragment = 1;
-	hdr->header_crc = utils::crc8(&hdr->packet_len,4);
-	m_tx_seq = next_seq(m_tx_seq);
-	*reinterpret_cast<uint16_t*>(hdr+1) = utils::crc16(data,size);
-	memcpy(reinterpret_cast<uint8_t*>(hdr+1)+2,data,size);
-	auto data_size = sizeof(ncp_header_t) + 2 + size;
-	return transport::send(m_tx_buffer,data_size);
+	bool paced = size > FRAGMENT_DATA_SIZE && m_host_acks &&
+		xTaskGetCurrentTaskHandle() != m_rx_task.load();
+	auto src = static_cast<const uint8_t*>(data);
+	size_t pos = 0;
+	while (pos < size) {
+		auto chunk = std::min(size - pos, FRAGMENT_DATA_SIZE);
+		auto hdr = reinterpret_cast<ncp_header_t*>(m_tx_buffer);
+		hdr->signature[0] = 0xde;
+		hdr->signature[1] = 0xad;
+		hdr->packet_len = chunk + sizeof(ncp_header_t) + 2 - 2;
+		hdr->packet_type = ZBOSS_NCP_API_HL;
+		hdr->is_ack = 0;
+		hdr->is_nack = 0;
+		hdr->packet_seq = m_tx_seq;
+		hdr->ack_seq = 0;
+		hdr->first_fragment = pos == 0;
+		hdr->last_fragment = pos + chunk == size;
+		hdr->header_crc = utils::crc8(&hdr->packet_len,4);
+		m_tx_seq = next_seq(m_tx_seq);
+		*reinterpret_cast<uint16_t*>(hdr+1) = utils::crc16(src + pos,chunk);
+		memcpy(reinterpret_cast<uint8_t*>(hdr+1)+2,src + pos,chunk);
+		auto data_size = sizeof(ncp_header_t) + 2 + chunk;
+		bool wait_ack = paced && !hdr->last_fragment;
+		if (wait_ack) {
+			xSemaphoreTake(m_ack_sem,0); // an ACK given after a timeout
+			m_ack_wait_seq = hdr->packet_seq;
+		}
+		auto res = transport::send(m_tx_buffer,data_size);
+		if (res != ESP_OK) {
+			m_ack_wait_seq = NO_SEQ;
+			return res;
+		}
+		if (wait_ack && xSemaphoreTake(m_ack_sem,pdMS_TO_TICKS(FRAGMENT_ACK_TIMEOUT_MS)) != pdTRUE) {
+			ESP_LOGW(TAG,"fragment %d not acked",int(pos / FRAGMENT_DATA_SIZE));
+		}
+		m_ack_wait_seq = NO_SEQ;
+		pos += chunk;
+	}
+	uint32_t none = 0;
+	m_unacked_since_ms.compare_exchange_strong(none, std::max<uint32_t>(now_ms(), 1));
+	return ESP_OK;
+}
+
+bool protocol::host_alive(uint32_t timeout_ms) {
+	auto& self = instance();
+	if (!self.m_host_acks) {
+		return true;
+	}
+	auto since = self.m_unacked_since_ms.load();
+	return !since || now_ms() - since < timeout_ms;
 }
 
 void protocol::on_rx_packet(const ncp_header_t& hdr,const void* data,size_t data_size) {
+	// anything valid from the host means it is there and reading
+	m_last_rx_ms = now_ms();
+	m_unacked_since_ms = 0;
 	if (hdr.is_ack) {
-		// ack received
+		m_host_acks = true;
+		uint8_t seq = hdr.ack_seq;
+		if (!hdr.is_nack && m_ack_wait_seq.compare_exchange_strong(seq, NO_SEQ)) {
+			xSemaphoreGive(m_ack_sem);
+		}
 	}
+	ind_store::on_host_rx();
 	if (hdr.is_nack) {
 		ESP_LOGE(TAG,"NACK received, retransmitt not supported");
 		return;
@@ -132,10 +188,49 @@ void protocol::on_rx_packet(const ncp_header_t& hdr,const void* data,size_t data
 	if (!hdr.is_ack) {
 		send_ack(hdr);
 	}
-	app::on_rx_data(data,data_size);
+	// A host packet longer than one LL frame comes as fragments, the first
+	// with only first_fragment set and the last with only last_fragment.
+	// A fragment with the sequence number of the packet before it is the
+	// host's retransmission after a lost ACK; it is acked again but not
+	// appended twice.
+	auto prev_seq = m_rx_seq;
+	m_rx_seq = hdr.packet_seq;
+	if (!hdr.first_fragment && hdr.packet_seq == prev_seq) {
+		ESP_LOGW(TAG,"duplicate fragment dropped, seq: %d",int(hdr.packet_seq));
+		return;
+	}
+	if (hdr.first_fragment && hdr.last_fragment) {
+		m_rx_assembling = false;
+		app::on_rx_data(data,data_size);
+		return;
+	}
+	if (hdr.first_fragment) {
+		if (m_rx_assembling) {
+			ESP_LOGW(TAG,"incomplete packet dropped: %d",int(m_rx_packet_len));
+		}
+		m_rx_packet_len = 0;
+		m_rx_assembling = true;
+	} else if (!m_rx_assembling) {
+		app::on_rx_data(data,data_size);
+		return;
+	}
+	if (m_rx_packet_len + data_size > MAX_PACKET_SIZE) {
+		ESP_LOGE(TAG,"packet too long, dropped");
+		m_rx_assembling = false;
+		m_rx_packet_len = 0;
+		return;
+	}
+	memcpy(m_rx_packet + m_rx_packet_len,data,data_size);
+	m_rx_packet_len += data_size;
+	if (hdr.last_fragment) {
+		m_rx_assembling = false;
+		app::on_rx_data(m_rx_packet,m_rx_packet_len);
+		m_rx_packet_len = 0;
+	}
 }
 
 esp_err_t protocol::on_rx_int(const void* data,size_t size) {
+	m_rx_task = xTaskGetCurrentTaskHandle();
 	if (m_rx_buffer_pos + size > RX_BUFFER_SIZE) {
 		ESP_LOGE(TAG,"Buffer full, skip part");
 		auto overflow = (m_rx_buffer_pos + size) - RX_BUFFER_SIZE;
@@ -213,15 +308,32 @@ esp_err_t protocol::on_rx_int(const void* data,size_t size) {
 esp_err_t protocol::init_int() {
 	ESP_LOGI(TAG,"init");
 	m_rx_buffer_pos = 0;
+	m_rx_assembling = false;
+	m_rx_seq = NO_SEQ;
 	m_tx_seq = 0;
 	m_tx_sem = xSemaphoreCreateMutex();
     if (!m_tx_sem) {
         ESP_LOGE(TAG, "Input semaphore create error");
         return ESP_ERR_NO_MEM;
     }
+    m_ack_sem = xSemaphoreCreateBinary();
+    if (!m_ack_sem) {
+        ESP_LOGE(TAG, "ACK semaphore create error");
+        return ESP_ERR_NO_MEM;
+    }
     return ESP_OK;
 }
 
+void protocol::reset_int() {
+	ESP_LOGI(TAG,"reset");
+	utils::sem_lock l(m_tx_sem);
+	m_rx_buffer_pos = 0;
+	m_rx_assembling = false;
+	m_rx_seq = NO_SEQ;
+	m_rx_packet_len = 0;
+	m_tx_seq = 0;
+}
+
 esp_err_t protocol::start_int() {
 	return ESP_OK;
 }
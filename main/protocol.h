@@ -1,9 +1,11 @@
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <esp_err.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
 
 class protocol {
 private:
@@ -25,17 +27,33 @@ private:
 	static protocol& instance();
 	esp_err_t init_int();
 	esp_err_t start_int();
+	void reset_int();
 
 	static constexpr size_t RX_BUFFER_SIZE = 1024;
 	static constexpr size_t TX_BUFFER_SIZE = 256;
+	static constexpr size_t FRAGMENT_DATA_SIZE = TX_BUFFER_SIZE - sizeof(ncp_header_t) - 2;
+	static constexpr size_t MAX_PACKET_SIZE = 4096;
 	static constexpr uint8_t ZBOSS_NCP_API_HL = 0x06;
+	static constexpr uint8_t NO_SEQ = 0xff;
+	static constexpr uint32_t FRAGMENT_ACK_TIMEOUT_MS = 50;
 
 	uint8_t m_rx_buffer[RX_BUFFER_SIZE];
 	size_t m_rx_buffer_pos;
+	uint8_t m_rx_packet[MAX_PACKET_SIZE]; /*!< fragments of a packet being reassembled */
+	size_t m_rx_packet_len;
+	bool m_rx_assembling;
+	uint8_t m_rx_seq;                 /*!< of the last data packet, NO_SEQ after a reset */
 	uint8_t m_tx_seq;
 
 	uint8_t m_tx_buffer[TX_BUFFER_SIZE];
 	SemaphoreHandle_t m_tx_sem;        /*!< A semaphore handle send_data, becouse it use buffer */
+	SemaphoreHandle_t m_ack_sem;       /*!< given when the awaited fragment is acked */
+	std::atomic<uint8_t> m_ack_wait_seq{NO_SEQ};   /*!< fragment waiting for its ACK */
+	std::atomic<TaskHandle_t> m_rx_task{nullptr};  /*!< the task that parses host packets */
+
+	std::atomic<bool> m_host_acks{false};          /*!< the host acknowledges, its link is tracked */
+	std::atomic<uint32_t> m_unacked_since_ms{0};   /*!< first packet sent since the host's last, 0 if none */
+	std::atomic<uint32_t> m_last_rx_ms{0};
 
 	esp_err_t on_rx_int(const void* data,size_t size);
 	void on_rx_packet(const ncp_header_t& hdr,const void* data,size_t data_size);
@@ -47,6 +65,9 @@ public:
 	static esp_err_t init() { return instance().init_int();
   }
 	static esp_err_t start() { return instance().start_int(); }
+	// Starts a new link session: drops the bytes and fragments received so
+	// far and sends the next packet with sequence 0, as after a boot.
+	static void reset() { instance().reset_int(); }
 
 	static esp_err_t on_rx(const void* data,size_t size) {
 		return instance().on_rx_int(data,size);
@@ -54,4 +75,11 @@ public:
 	static esp_err_t send_data(const void* data,size_t size) {
 		return instance().send_data_int(data,size);
 	}
+
+	// False once the host has left our packets unacknowledged for timeout_ms.
+	// A host that never acknowledges (like the embedded driver) is always
+	// taken as alive.
+	static bool host_alive(uint32_t timeout_ms);
+	// When the last valid packet came from the host, ms since boot.
+	static uint32_t last_rx_ms() { return instance().m_last_rx_ms; }
 };
@@ -0,0 +1,75 @@
+#include "response_cache.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+static const char* TAG = "RCACHE";
+
+response_cache::response_cache() : m_next(0) {
+	memset(m_entries, 0, sizeof(m_entries));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+response_cache& response_cache::instance() {
+	static response_cache s_response_cache;
+	return s_response_cache;
+}
+
+int response_cache::find_locked(uint16_t command_id, const void* request, size_t request_len) const {
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		auto& e = m_entries[i];
+		if (e.command_id == command_id && e.request_len == request_len &&
+			memcmp(e.request, request, request_len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+size_t response_cache::get(command_id_t command_id, const void* request, size_t request_len,
+	uint8_t* out, size_t out_size) {
+	if (request_len > MAX_REQUEST) {
+		return 0;
+	}
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	auto i = self.find_locked(command_id, request, request_len);
+	if (i < 0 || self.m_entries[i].response_len > out_size) {
+		return 0;
+	}
+	auto& e = self.m_entries[i];
+	memcpy(out, e.response, e.response_len);
+	return e.response_len;
+}
+
+void response_cache::put(command_id_t command_id, const void* request, size_t request_len,
+	const uint8_t* response, size_t response_len) {
+	if (request_len > MAX_REQUEST || response_len > MAX_RESPONSE) {
+		return;
+	}
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	auto i = self.find_locked(command_id, request, request_len);
+	if (i < 0) {
+		i = self.m_next;
+		self.m_next = (self.m_next + 1) % CAPACITY;
+	}
+	auto& e = self.m_entries[i];
+	e.command_id = command_id;
+	e.request_len = request_len;
+	e.response_len = response_len;
+	memcpy(e.request, request, request_len);
+	memcpy(e.response, response, response_len);
+	ESP_LOGD(TAG, "cached %s", get_command_name(command_id));
+}
+
+void response_cache::invalidate(command_id_t command_id) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	for (auto& e : self.m_entries) {
+		if (e.command_id == command_id) {
+			e.command_id = 0;
+		}
+	}
+}
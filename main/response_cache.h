@@ -0,0 +1,48 @@
+#pragma once
+#include "commands.h"
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Finished responses of GET_* commands whose answer only changes on an
+// explicit SET (or a stack start): module version, coordinator version,
+// role, local IEEE address. A repeated query is answered by copying the
+// stored response and patching in its tsn, without running the handler;
+// framing, sequence numbers and CRCs are still added by protocol.
+//
+// Entries are keyed by command and request payload. A handler that makes
+// an answer stale calls invalidate() for its GET.
+class response_cache {
+public:
+	static constexpr size_t CAPACITY = 8;
+	static constexpr size_t MAX_REQUEST = 4;
+	static constexpr size_t MAX_RESPONSE = 32;   /*!< after the cmd_t header */
+
+private:
+	struct entry_t {
+		uint16_t command_id;        /*!< 0 when unused */
+		uint8_t request_len;
+		uint8_t response_len;
+		uint8_t request[MAX_REQUEST];
+		uint8_t response[MAX_RESPONSE];
+	};
+
+	response_cache();
+	static response_cache& instance();
+
+	entry_t m_entries[CAPACITY];
+	size_t m_next;              /*!< replaced next when full */
+	SemaphoreHandle_t m_sem;
+
+	int find_locked(uint16_t command_id, const void* request, size_t request_len) const;
+
+public:
+	// Copies the response into out; 0 on a miss.
+	static size_t get(command_id_t command_id, const void* request, size_t request_len,
+		uint8_t* out, size_t out_size);
+	static void put(command_id_t command_id, const void* request, size_t request_len,
+		const uint8_t* response, size_t response_len);
+	static void invalidate(command_id_t command_id);
+};
@@ -0,0 +1,212 @@
+#include "topology.h"
+#include "utils.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+static const char* TAG = "TOPO";
+
+static constexpr uint8_t DEVICE_TYPE_ROUTER = 1;
+
+topology::topology() : m_node_count(0), m_link_count(0), m_round(1),
+	m_enabled(false), m_running(false), m_request_interval_ms(1000), m_round_interval_s(600) {
+	memset(m_nodes, 0, sizeof(m_nodes));
+	memset(m_node_round, 0, sizeof(m_node_round));
+	memset(m_links, 0, sizeof(m_links));
+	m_sem = xSemaphoreCreateMutex();
+}
+
+topology& topology::instance() {
+	static topology s_topology;
+	return s_topology;
+}
+
+bool topology::configure(const config_t& config) {
+	if (config.request_interval_ms < 100 || config.round_interval_s == 0) {
+		return false;
+	}
+	auto& self = instance();
+	self.m_request_interval_ms = config.request_interval_ms;
+	self.m_round_interval_s = config.round_interval_s;
+	self.m_enabled = config.enabled != 0;
+	ESP_LOGI(TAG, "crawler %s request: %d ms round: %d s", config.enabled ? "on" : "off",
+		int(config.request_interval_ms), int(config.round_interval_s));
+	if (self.m_enabled && !self.m_running.exchange(true)) {
+		if (!crawl()) {
+			self.m_running = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+void topology::drop_links_locked(uint16_t src) {
+	size_t j = 0;
+	for (size_t i = 0; i < m_link_count; ++i) {
+		if (m_links[i].src != src)
+			m_links[j++] = m_links[i];
+	}
+	m_link_count = j;
+}
+
+void topology::end_round_locked() {
+	size_t j = 0;
+	for (size_t i = 0; i < m_node_count; ++i) {
+		if (m_node_round[i] == m_round) {
+			m_nodes[j] = m_nodes[i];
+			m_node_round[j++] = m_round;
+		} else {
+			ESP_LOGD(TAG, "lost %04x", m_nodes[i].nwk);
+		}
+	}
+	m_node_count = j;
+	// links stay only between devices still on the map (or the coordinator)
+	auto known = [this](uint16_t nwk) {
+		if (nwk == 0x0000)
+			return true;
+		for (size_t i = 0; i < m_node_count; ++i) {
+			if (m_nodes[i].nwk == nwk)
+				return true;
+		}
+		return false;
+	};
+	j = 0;
+	for (size_t i = 0; i < m_link_count; ++i) {
+		if (known(m_links[i].src) && known(m_links[i].dst))
+			m_links[j++] = m_links[i];
+	}
+	m_link_count = j;
+	ESP_LOGI(TAG, "round %d: %d devices, %d links", int(m_round), int(m_node_count), int(m_link_count));
+	++m_round;
+}
+
+void topology::add_neighbors(uint16_t src, const zb_zdo_mgmt_lqi_resp_t& resp, bool first_page) {
+	auto records = reinterpret_cast<const zb_zdo_neighbor_table_record_t*>(&resp + 1);
+	utils::sem_lock l(m_sem);
+	if (first_page) {
+		drop_links_locked(src);
+	}
+	for (uint8_t n = 0; n < resp.neighbor_table_list_count; ++n) {
+		zb_zdo_neighbor_table_record_t rec;
+		memcpy(&rec, &records[n], sizeof(rec));
+
+		size_t i = 0;
+		while (i < m_node_count && memcmp(m_nodes[i].ieee, rec.ext_addr, 8) != 0)
+			++i;
+		if (i == m_node_count) {
+			if (m_node_count == MAX_NODES) {
+				ESP_LOGW(TAG, "map full, skip %04x", rec.network_addr);
+				continue;
+			}
+			++m_node_count;
+			memcpy(m_nodes[i].ieee, rec.ext_addr, 8);
+		}
+		m_nodes[i].nwk = rec.network_addr;
+		m_nodes[i].type_flags = rec.type_flags;
+		m_nodes[i].depth = rec.depth;
+		m_node_round[i] = m_round;
+
+		if (m_link_count == MAX_LINKS) {
+			ESP_LOGW(TAG, "links full, skip %04x -> %04x", src, rec.network_addr);
+			continue;
+		}
+		m_links[m_link_count++] = {
+			.src = src,
+			.dst = rec.network_addr,
+			.lqi = rec.lqi,
+			.relationship = static_cast<uint8_t>((rec.type_flags >> 4) & 0x07),
+		};
+	}
+}
+
+zb_coro::task topology::crawl() {
+	auto& self = instance();
+	while (self.m_enabled) {
+		size_t head = 0;
+		size_t tail = 0;
+		self.m_queue[tail++] = 0x0000;
+		while (head < tail && self.m_enabled) {
+			uint16_t router = self.m_queue[head++];
+			uint8_t start_index = 0;
+			while (true) {
+				if (!co_await zb_coro::schedule(self.m_request_interval_ms)) {
+					ESP_LOGE(TAG, "schedule failed, crawler stopped");
+					self.m_running = false;
+					co_return;
+				}
+				auto buf = co_await zb_coro::buf_get_out(sizeof(zb_zdo_mgmt_lqi_param_t));
+				if (!buf) {
+					break;
+				}
+				auto req = static_cast<zb_zdo_mgmt_lqi_param_t*>(
+					zb_buf_alloc_tail(buf, sizeof(zb_zdo_mgmt_lqi_param_t)));
+				req->dst_addr = router;
+				req->start_index = start_index;
+				auto resp_buf = co_await zb_coro::zdo_request(buf, &zb_zdo_mgmt_lqi_req);
+				if (!resp_buf) {
+					break;
+				}
+				auto resp = static_cast<const zb_zdo_mgmt_lqi_resp_t*>(zb_buf_begin(resp_buf));
+				if (resp->status != 0 || resp->neighbor_table_list_count == 0) {
+					ESP_LOGD(TAG, "%04x status: %d", router, int(resp->status));
+					zb_buf_free(resp_buf);
+					break;
+				}
+				self.add_neighbors(router, *resp, start_index == 0);
+
+				// routers are crawled in turn, breadth first
+				auto records = reinterpret_cast<const zb_zdo_neighbor_table_record_t*>(resp + 1);
+				for (uint8_t n = 0; n < resp->neighbor_table_list_count; ++n) {
+					zb_zdo_neighbor_table_record_t rec;
+					memcpy(&rec, &records[n], sizeof(rec));
+					if ((rec.type_flags & 0x03) != DEVICE_TYPE_ROUTER || tail == MAX_NODES)
+						continue;
+					size_t q = 0;
+					while (q < tail && self.m_queue[q] != rec.network_addr)
+						++q;
+					if (q == tail)
+						self.m_queue[tail++] = rec.network_addr;
+				}
+				start_index += resp->neighbor_table_list_count;
+				auto entries = resp->neighbor_table_entries;
+				zb_buf_free(resp_buf);
+				if (start_index >= entries) {
+					break;
+				}
+			}
+		}
+		if (!self.m_enabled) {
+			break;
+		}
+		{
+			utils::sem_lock l(self.m_sem);
+			self.end_round_locked();
+		}
+		// wait in steps, so a disabled crawler stops soon
+		for (uint32_t s = 0; s < self.m_round_interval_s && self.m_enabled; ++s) {
+			if (!co_await zb_coro::schedule(1000)) {
+				ESP_LOGE(TAG, "schedule failed, crawler stopped");
+				self.m_running = false;
+				co_return;
+			}
+		}
+	}
+	ESP_LOGI(TAG, "crawler stopped");
+	self.m_running = false;
+}
+
+void topology::serialize(std::vector<uint8_t>& out) {
+	auto& self = instance();
+	utils::sem_lock l(self.m_sem);
+	uint16_t counts[2] = {
+		static_cast<uint16_t>(self.m_node_count),
+		static_cast<uint16_t>(self.m_link_count)
+	};
+	auto append = [&out](const void* data, size_t size) {
+		auto p = static_cast<const uint8_t*>(data);
+		out.insert(out.end(), p, p + size);
+	};
+	append(counts, sizeof(counts));
+	append(self.m_nodes, self.m_node_count * sizeof(node_t));
+	append(self.m_links, self.m_link_count * sizeof(link_t));
+}
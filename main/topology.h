@@ -0,0 +1,72 @@
+#pragma once
+#include "zboss_decl.h"
+#include "zb_coro.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Network map kept on the NCP.
+//
+// A background crawler walks the neighbor tables of the coordinator and every
+// router it finds (ZDO Mgmt_Lqi, page by page), one request per
+// request_interval_ms, and starts a new round round_interval_s after the last
+// one finished. Devices not seen in a whole round are dropped from the map
+// together with their links.
+class topology {
+public:
+	struct config_t {
+		uint8_t enabled;
+		uint16_t request_interval_ms;
+		uint16_t round_interval_s;
+	} __attribute__((packed));
+
+	struct node_t {
+		uint8_t ieee[8];
+		uint16_t nwk;
+		uint8_t type_flags;     /*!< device type, rx on when idle, relationship as in Mgmt_Lqi */
+		uint8_t depth;
+	} __attribute__((packed));
+
+	struct link_t {
+		uint16_t src;           /*!< router whose neighbor table has the entry */
+		uint16_t dst;
+		uint8_t lqi;
+		uint8_t relationship;
+	} __attribute__((packed));
+
+	static constexpr size_t MAX_NODES = 128;
+	static constexpr size_t MAX_LINKS = 256;
+
+private:
+	topology();
+	static topology& instance();
+
+	node_t m_nodes[MAX_NODES];
+	uint16_t m_node_round[MAX_NODES];
+	size_t m_node_count;
+	link_t m_links[MAX_LINKS];
+	size_t m_link_count;
+	uint16_t m_round;
+	SemaphoreHandle_t m_sem;
+
+	std::atomic<bool> m_enabled;
+	std::atomic<bool> m_running;
+	std::atomic<uint16_t> m_request_interval_ms;
+	std::atomic<uint16_t> m_round_interval_s;
+
+	uint16_t m_queue[MAX_NODES];   /*!< routers of the current round, crawler only */
+
+	static zb_coro::task crawl();
+	void add_neighbors(uint16_t src, const zb_zdo_mgmt_lqi_resp_t& resp, bool first_page);
+	void drop_links_locked(uint16_t src);
+	void end_round_locked();
+
+public:
+	static bool configure(const config_t& config);
+	// Appends node count, link count, nodes and links (see node_t, link_t).
+	static void serialize(std::vector<uint8_t>& out);
+};
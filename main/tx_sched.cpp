@@ -0,0 +1,298 @@
+#include "tx_sched.h"
+#include "addr_cache.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
+
+static const char* TAG = "TXS";
+
+// weight of a new sample: 1 / (1 << EWMA_SHIFT)
+static constexpr int EWMA_SHIFT = 3;
+// MAC capability: receiver on when idle
+static constexpr uint8_t CAPABILITY_RX_ON_WHEN_IDLE = 0x08;
+
+// Whether the destination of key is an end device that polls its parent for
+// frames. Unknown devices count as awake.
+static bool is_sleepy(uint64_t key, uint8_t addr_mode) {
+	addr_cache::entry_t e;
+	bool found = false;
+	if (addr_mode == ZB_APS_ADDR_MODE_64_ENDP_PRESENT) {
+		uint8_t ieee[8];
+		memcpy(ieee, &key, sizeof(ieee));
+		found = addr_cache::find_by_ieee(ieee, e);
+	} else if (addr_mode == ZB_APS_ADDR_MODE_16_ENDP_PRESENT) {
+		found = addr_cache::find_by_nwk(static_cast<uint16_t>(key), e);
+	}
+	return found && (e.flags & addr_cache::FLAG_CAPABILITY) &&
+		!(e.capability & CAPABILITY_RX_ON_WHEN_IDLE);
+}
+
+tx_sched::tx_sched() : m_inflight(0), m_waiting(0), m_window(INITIAL_WINDOW << 8),
+	m_latency_ms(0), m_failure_rate(0), m_hold(0) {
+	memset(m_dests, 0, sizeof(m_dests));
+	memset(m_rr, 0, sizeof(m_rr));
+	for (auto& rule : m_class_rules) {
+		rule = 0;
+	}
+}
+
+tx_sched& tx_sched::instance() {
+	static tx_sched s_tx_sched;
+	return s_tx_sched;
+}
+
+bool tx_sched::set_class(uint16_t cluster_id, uint8_t cls) {
+	auto& self = instance();
+	uint32_t value = cls < CLASS_COUNT ? (uint32_t(cluster_id) << 16) | (uint32_t(cls) << 8) | 1 : 0;
+	std::atomic<uint32_t>* free_rule = nullptr;
+	for (auto& rule : self.m_class_rules) {
+		auto v = rule.load();
+		if (v && (v >> 16) == cluster_id) {
+			rule = value;
+			return true;
+		}
+		if (!v && !free_rule) {
+			free_rule = &rule;
+		}
+	}
+	if (!value) {
+		return true;
+	}
+	if (!free_rule) {
+		return false;
+	}
+	*free_rule = value;
+	return true;
+}
+
+void tx_sched::clear_classes() {
+	for (auto& rule : instance().m_class_rules) {
+		rule = 0;
+	}
+}
+
+tx_sched::class_t tx_sched::class_of(uint16_t cluster_id) const {
+	for (auto& rule : m_class_rules) {
+		auto v = rule.load();
+		if (v && (v >> 16) == cluster_id) {
+			return static_cast<class_t>((v >> 8) & 0xff);
+		}
+	}
+	return CLASS_NORMAL;
+}
+
+int tx_sched::acquire_dest(uint64_t key, uint8_t addr_mode) {
+	int free_dest = -1;
+	for (size_t i = 0; i < MAX_DESTS; ++i) {
+		auto& d = m_dests[i];
+		if (d.refs && d.key == key) {
+			++d.refs;
+			return i;
+		}
+		if (!d.refs && free_dest < 0) {
+			free_dest = i;
+		}
+	}
+	if (free_dest >= 0) {
+		auto& d = m_dests[free_dest];
+		memset(&d, 0, sizeof(d));
+		d.key = key;
+		d.refs = 1;
+		d.indirect = is_sleepy(key, addr_mode);
+	}
+	return free_dest;
+}
+
+void tx_sched::on_confirm(int dest, uint32_t latency_ms, bool success) {
+	if (m_dests[dest].indirect) {
+		return;
+	}
+	if (m_latency_ms) {
+		m_latency_ms += (int32_t(latency_ms) - int32_t(m_latency_ms)) >> EWMA_SHIFT;
+	} else {
+		m_latency_ms = latency_ms;
+	}
+	m_failure_rate += ((success ? 0 : 0xffff) - int32_t(m_failure_rate)) >> EWMA_SHIFT;
+	if (m_hold) {
+		--m_hold;
+	}
+
+	if (m_failure_rate > FAILURE_HIGH || m_latency_ms > LATENCY_HIGH_MS) {
+		if (m_hold) {
+			return; // frames sent with the old window are still confirming
+		}
+		auto old = window();
+		m_window = std::max<uint16_t>(m_window / 2, MIN_WINDOW << 8);
+		m_hold = m_inflight;
+		if (window() != old) {
+			ESP_LOGI(TAG, "window %d, latency: %d ms failures: %d%%", int(window()),
+				int(m_latency_ms), int(m_failure_rate * 100 >> 16));
+		}
+	} else if (success && m_inflight >= window() && window() < MAX_WINDOW) {
+		// grow only when the window is what held frames back
+		auto old = window();
+		m_window = std::min<uint32_t>(m_window + (1u << 16) / m_window, MAX_WINDOW << 8);
+		if (window() != old) {
+			ESP_LOGD(TAG, "window %d, latency: %d ms", int(window()), int(m_latency_ms));
+		}
+	}
+}
+
+void tx_sched::release_dest(int dest) {
+	auto& d = m_dests[dest];
+	--d.inflight;
+	--d.refs;
+	--m_inflight;
+	dispatch(nullptr);
+}
+
+// Deficit round-robin over the destinations with frames of class cls that
+// may send now. Every round adds a quantum to each of them, so it goes on
+// until one has saved up for its frame, however long that is.
+tx_sched::admit* tx_sched::pick(class_t cls) {
+	bool eligible = false;
+	for (size_t n = 1;; ++n) {
+		auto idx = m_rr[cls];
+		auto& d = m_dests[idx];
+		auto& q = d.queues[cls];
+		if (q.head && d.inflight < MAX_INFLIGHT_PER_DEST) {
+			eligible = true;
+			if (q.deficit >= q.head->m_cost) {
+				auto w = q.head;
+				q.deficit -= w->m_cost;
+				q.head = w->m_next;
+				if (!q.head) {
+					q.tail = nullptr;
+					q.deficit = 0;
+				}
+				return w;
+			}
+			q.deficit += QUANTUM;
+		}
+		m_rr[cls] = (idx + 1) % MAX_DESTS;
+		if (n % MAX_DESTS == 0) {
+			if (!eligible) {
+				return nullptr;
+			}
+			eligible = false;
+		}
+	}
+}
+
+// Starts waiting frames while there is room. Returns true when self was
+// started; it is not resumed in that case.
+bool tx_sched::dispatch(const admit* self) {
+	bool self_started = false;
+	while (m_waiting && m_inflight < window()) {
+		admit* w = nullptr;
+		for (uint8_t cls = 0; cls < CLASS_COUNT && !w; ++cls) {
+			w = pick(static_cast<class_t>(cls));
+		}
+		if (!w) {
+			break; // everything waiting is for destinations at their limit
+		}
+		--m_waiting;
+		++m_inflight;
+		++m_dests[w->m_dest].inflight;
+		if (w == self) {
+			self_started = true;
+		} else {
+			w->m_handle.resume();
+		}
+	}
+	return self_started;
+}
+
+tx_sched::admit::admit(uint8_t addr_mode, const uint8_t* addr, uint16_t cluster_id, size_t cost)
+	: m_addr_mode(addr_mode), m_cost(cost) {
+	uint64_t a = 0;
+	memcpy(&a, addr, addr_mode == ZB_APS_ADDR_MODE_64_ENDP_PRESENT ? 8 : 2);
+	// the address mode goes into bits the 16-bit modes do not use
+	m_key = addr_mode == ZB_APS_ADDR_MODE_64_ENDP_PRESENT ? a : a | (uint64_t(addr_mode) << 56);
+	m_class = instance().class_of(cluster_id);
+}
+
+bool tx_sched::admit::await_ready() {
+	auto& s = instance();
+	m_dest = s.acquire_dest(m_key, m_addr_mode);
+	if (m_dest < 0) {
+		ESP_LOGW(TAG, "no destination slot, not scheduled");
+		return true;
+	}
+	auto& d = s.m_dests[m_dest];
+	if (!s.m_waiting && s.m_inflight < s.window() && d.inflight < MAX_INFLIGHT_PER_DEST) {
+		++s.m_inflight;
+		++d.inflight;
+		return true;
+	}
+	if (s.m_inflight >= s.window() && s.m_waiting >= s.window()) {
+		ESP_LOGD(TAG, "busy, window: %d waiting: %d", int(s.window()), int(s.m_waiting));
+		--d.refs;
+		m_dest = -1;
+		m_busy = true;
+		return true;
+	}
+	return false;
+}
+
+bool tx_sched::admit::await_suspend(std::coroutine_handle<> handle) {
+	auto& s = instance();
+	m_handle = handle;
+	auto& q = s.m_dests[m_dest].queues[m_class];
+	if (q.tail) {
+		q.tail->m_next = this;
+	} else {
+		q.head = this;
+	}
+	q.tail = this;
+	++s.m_waiting;
+	ESP_LOGD(TAG, "queued class: %d cost: %d waiting: %d", int(m_class), int(m_cost), int(s.m_waiting));
+	return !s.dispatch(this);
+}
+
+tx_sched::grant tx_sched::try_admit(uint8_t addr_mode, const uint8_t* addr, uint16_t cluster_id, size_t cost) {
+	admit a(addr_mode, addr, cluster_id, cost);
+	if (a.await_ready()) {
+		return a.await_resume();
+	}
+	// it would have to wait
+	--instance().m_dests[a.m_dest].refs;
+	return grant(-1, true);
+}
+
+tx_sched::grant::grant(int dest, bool busy)
+	: m_dest(dest), m_busy(busy), m_start(dest >= 0 ? esp_timer_get_time() : 0) {
+}
+
+tx_sched::grant::grant(grant&& other)
+	: m_dest(other.m_dest), m_busy(other.m_busy), m_start(other.m_start) {
+	other.m_dest = -1;
+}
+
+tx_sched::grant& tx_sched::grant::operator=(grant&& other) {
+	if (this != &other) {
+		release();
+		m_dest = other.m_dest;
+		m_busy = other.m_busy;
+		m_start = other.m_start;
+		other.m_dest = -1;
+	}
+	return *this;
+}
+
+void tx_sched::grant::complete(bool success) {
+	if (m_dest >= 0) {
+		auto latency_ms = static_cast<uint32_t>((esp_timer_get_time() - m_start) / 1000);
+		instance().on_confirm(m_dest, latency_ms, success);
+		release();
+	}
+}
+
+void tx_sched::grant::release() {
+	if (m_dest >= 0) {
+		instance().release_dest(m_dest);
+		m_dest = -1;
+	}
+}
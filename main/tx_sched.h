@@ -0,0 +1,156 @@
+#pragma once
+#include "zboss_decl.h"
+#include "zb_coro.h"
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+
+// Admission of outgoing APS data frames.
+//
+// Every frame waits in the FIFO of its destination and priority class until
+// it may go on air. Classes are served strictly in order (interactive before
+// normal before bulk); inside a class the destinations take turns by deficit
+// round-robin, weighted by frame length. A destination has at most
+// MAX_INFLIGHT_PER_DEST frames waiting for their APS confirm, so a sleepy
+// device with a full indirect queue holds back only its own frames.
+//
+// The number of frames in flight in total is limited by a congestion window
+// that adapts AIMD-style to the confirms: it grows by one frame per window
+// of successful confirms and halves when the smoothed failure rate goes above
+// FAILURE_HIGH or the smoothed confirm latency above LATENCY_HIGH_MS (at most
+// once per window, so a burst of failures from one round counts once). No
+// more frames than the window may wait either; beyond that the frame is
+// refused (grant::busy()) and the host is told to back off instead of piling
+// up retries.
+//
+// Confirms for sleepy end devices (rx off when idle, as announced) do not
+// adapt the window: their frames wait in the parent's indirect queue until
+// the next poll, which says nothing about the load on the air.
+//
+// The class of a frame comes from its cluster, as set by the host with
+// set_class(); unlisted clusters are CLASS_NORMAL.
+//
+// All scheduling happens in the ZBOSS context:
+//
+//   co_await zb_coro::schedule();
+//   auto grant = co_await tx_sched::admit(mode, addr, cluster_id, len);
+//   ... send, wait for the confirm ...
+//   // the grant is released when it goes out of scope
+class tx_sched {
+public:
+	enum class_t : uint8_t {
+		CLASS_INTERACTIVE = 0,
+		CLASS_NORMAL = 1,
+		CLASS_BULK = 2,
+		CLASS_COUNT
+	};
+
+	static constexpr size_t MIN_WINDOW = 1;
+	static constexpr size_t MAX_WINDOW = 8;
+	static constexpr size_t INITIAL_WINDOW = 4;
+	static constexpr uint32_t LATENCY_HIGH_MS = 1500;
+	static constexpr uint16_t FAILURE_HIGH = 0x4000;  /*!< 0.16 fixed point, 25% */
+	static constexpr size_t MAX_INFLIGHT_PER_DEST = 2;
+	static constexpr size_t QUANTUM = 128;      /*!< bytes per round-robin turn */
+	// Grants from try_admit() are held outside coroutines, by at most this
+	// many callers at a time (the unacked slots of APSDE_DATA_REQ).
+	static constexpr size_t MAX_DIRECT_GRANTS = 8;
+	// Every waiting or sending frame is a coroutine or holds one of those
+	// grants, so there are never more destinations in use than that.
+	static constexpr size_t MAX_DESTS = zb_coro::FRAME_COUNT + MAX_DIRECT_GRANTS;
+	static constexpr size_t MAX_CLASS_RULES = 16;
+
+	class admit;
+
+	// Holds one in-flight slot of a destination until destroyed. Report the
+	// confirm with complete() so the window can adapt; a grant released
+	// without it does not count either way.
+	class grant {
+	public:
+		grant() : m_dest(-1), m_busy(false), m_start(0) {}
+		grant(int dest, bool busy);
+		grant(grant&& other);
+		grant& operator=(grant&& other);
+		grant(const grant&) = delete;
+		grant& operator=(const grant&) = delete;
+		~grant() { release(); }
+
+		// The window is exhausted, the frame must not be sent.
+		bool busy() const { return m_busy; }
+		void complete(bool success);
+		void release();
+
+	private:
+		int m_dest;
+		bool m_busy;
+		int64_t m_start;
+	};
+
+	class admit {
+	public:
+		admit(uint8_t addr_mode, const uint8_t* addr, uint16_t cluster_id, size_t cost);
+
+		bool await_ready();
+		bool await_suspend(std::coroutine_handle<> handle);
+		grant await_resume() { return grant(m_dest, m_busy); }
+
+	private:
+		friend class tx_sched;
+		uint64_t m_key;
+		uint8_t m_addr_mode;
+		class_t m_class;
+		size_t m_cost;
+		int m_dest = -1;
+		bool m_busy = false;
+		admit* m_next = nullptr;
+		std::coroutine_handle<> m_handle;
+	};
+
+	// Admission without waiting, for callers that are not coroutines: the
+	// grant is busy() unless the frame may go on air right now.
+	static grant try_admit(uint8_t addr_mode, const uint8_t* addr, uint16_t cluster_id, size_t cost);
+
+	// CLASS_COUNT or above removes the cluster from the table.
+	static bool set_class(uint16_t cluster_id, uint8_t cls);
+	// Every cluster back to CLASS_NORMAL.
+	static void clear_classes();
+
+private:
+	tx_sched();
+	static tx_sched& instance();
+
+	struct queue_t {
+		admit* head;
+		admit* tail;
+		size_t deficit;
+	};
+	struct dest_t {
+		uint64_t key;
+		uint8_t refs;           /*!< frames waiting or in flight */
+		uint8_t inflight;
+		bool indirect;          /*!< sleepy end device */
+		queue_t queues[CLASS_COUNT];
+	};
+
+	dest_t m_dests[MAX_DESTS];
+	size_t m_rr[CLASS_COUNT];   /*!< round-robin position per class */
+	size_t m_inflight;
+	size_t m_waiting;
+
+	uint16_t m_window;          /*!< 8.8 fixed point */
+	uint32_t m_latency_ms;      /*!< smoothed confirm latency */
+	uint16_t m_failure_rate;    /*!< smoothed, 0.16 fixed point */
+	size_t m_hold;              /*!< confirms left before the next decrease */
+
+	// cluster_id << 16 | class << 8 | 1, 0 when unused
+	std::atomic<uint32_t> m_class_rules[MAX_CLASS_RULES];
+
+	class_t class_of(uint16_t cluster_id) const;
+	int acquire_dest(uint64_t key, uint8_t addr_mode);
+	admit* pick(class_t cls);
+	size_t window() const { return m_window >> 8; }
+	bool dispatch(const admit* self);
+	void release_dest(int dest);
+	void on_confirm(int dest, uint32_t latency_ms, bool success);
+};
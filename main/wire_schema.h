@@ -0,0 +1,250 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Declarative description of NCP payloads.
+//
+// A schema lists the wire fields in order. The same description gives the
+// serializer (struct -> frame) and the parser (frame -> struct), so a
+// command is described once, next to its buffalo schema comment:
+//
+//   static uint8_t ep_count(const zb_zdo_ep_resp_t &r) { ... }
+//   static const uint8_t *ep_list(const zb_zdo_ep_resp_t &r) { ... }
+//   using response_schema = wire::schema<
+//       wire::constant<uint8_t(STATUS_CATEGORY_ZDO)>,
+//       wire::field<&zb_zdo_ep_resp_t::status>,
+//       wire::count<&ep_count>,
+//       wire::list<&ep_count, &ep_list, 16>,
+//       wire::field<&zb_zdo_ep_resp_t::nwk_addr>>;
+//
+//   auto len = response_schema::encode(out, sizeof(out), *resp);
+//
+// Counts and element sources are member pointers or plain functions of the
+// source struct. Everything is resolved at compile time; encoding is a
+// sequence of bounded copies. Writing past the output, or reading past the
+// input, makes the whole encode/decode fail instead of overrunning.
+
+namespace wire {
+
+  static_assert(std::endian::native == std::endian::little,
+                "wire format is little endian");
+
+  class writer {
+  public:
+    writer(uint8_t *begin, size_t size)
+        : m_begin(begin), m_pos(begin), m_end(begin + size) {}
+
+    void put(const void *data, size_t size) {
+      if (!m_pos || size_t(m_end - m_pos) < size) {
+        m_pos = nullptr;
+        return;
+      }
+      memcpy(m_pos, data, size);
+      m_pos += size;
+    }
+    template <typename T> void put(const T &value) {
+      static_assert(std::is_trivially_copyable_v<T>);
+      put(&value, sizeof(T));
+    }
+
+    bool ok() const { return m_pos != nullptr; }
+    size_t size() const { return m_pos ? m_pos - m_begin : 0; }
+
+  private:
+    uint8_t *m_begin;
+    uint8_t *m_pos;
+    uint8_t *m_end;
+  };
+
+  class reader {
+  public:
+    reader(const void *begin, size_t size)
+        : m_pos(static_cast<const uint8_t *>(begin)), m_end(m_pos + size) {}
+
+    bool get(void *data, size_t size) {
+      if (!m_pos || size_t(m_end - m_pos) < size) {
+        m_pos = nullptr;
+        return false;
+      }
+      memcpy(data, m_pos, size);
+      m_pos += size;
+      return true;
+    }
+    template <typename T> bool get(T &value) {
+      static_assert(std::is_trivially_copyable_v<T>);
+      return get(&value, sizeof(T));
+    }
+    bool skip(size_t size) {
+      if (!m_pos || size_t(m_end - m_pos) < size) {
+        m_pos = nullptr;
+        return false;
+      }
+      m_pos += size;
+      return true;
+    }
+
+    bool ok() const { return m_pos != nullptr; }
+    size_t remaining() const { return m_pos ? m_end - m_pos : 0; }
+
+  private:
+    const uint8_t *m_pos;
+    const uint8_t *m_end;
+  };
+
+  namespace detail {
+
+    // Follows a chain of member pointers: path<&A::hdr, &H::status>(a).
+    template <auto First, auto... Rest, typename S>
+    constexpr auto &path(S &s) {
+      if constexpr (sizeof...(Rest) == 0) {
+        return s.*First;
+      } else {
+        return path<Rest...>(s.*First);
+      }
+    }
+
+    // A count, predicate or element source: member pointer or function.
+    template <auto Fn, typename S> constexpr decltype(auto) eval(S &s) {
+      if constexpr (std::is_member_object_pointer_v<decltype(Fn)>) {
+        return (s.*Fn);
+      } else {
+        return Fn(s);
+      }
+    }
+
+  }
+
+  // A member of the source struct, copied as is. Nested members are given as
+  // a path: field<&resp_t::hdr, &hdr_t::status>.
+  template <auto... Path> struct field {
+    template <typename S> static void encode(writer &w, const S &s) {
+      const auto &v = detail::path<Path...>(s);
+      w.put(&v, sizeof(v));
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      auto &v = detail::path<Path...>(s);
+      return r.get(&v, sizeof(v));
+    }
+  };
+
+  // A value computed from the source struct. Skipped when parsing.
+  template <auto Fn> struct value {
+    template <typename S> static void encode(writer &w, const S &s) {
+      w.put(Fn(s));
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      return r.skip(sizeof(decltype(Fn(s))));
+    }
+  };
+
+  // A fixed value. Parsing fails if the input holds something else.
+  template <auto V> struct constant {
+    template <typename S> static void encode(writer &w, const S &) {
+      w.put(V);
+    }
+    template <typename S> static bool decode(reader &r, S &) {
+      decltype(V) v;
+      return r.get(v) && v == V;
+    }
+  };
+
+  // Fields present only when Pred(s) holds. When parsing, Pred sees the
+  // fields decoded so far.
+  template <auto Pred, typename... Fields> struct when {
+    template <typename S> static void encode(writer &w, const S &s) {
+      if (detail::eval<Pred>(s)) {
+        (Fields::encode(w, s), ...);
+      }
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      if (!detail::eval<Pred>(s)) {
+        return true;
+      }
+      return (Fields::decode(r, s) && ...);
+    }
+  };
+
+  // Element count of a list, clamped to Max, written with the count's own
+  // type. Pairs with list<Count, ..., Max>.
+  template <auto Count, size_t Max = 0xFF> struct count {
+    template <typename S> static void encode(writer &w, const S &s) {
+      using T = std::remove_cvref_t<decltype(detail::eval<Count>(s))>;
+      T n = detail::eval<Count>(s);
+      w.put(static_cast<T>(std::min<size_t>(n, Max)));
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      if constexpr (std::is_member_object_pointer_v<decltype(Count)>) {
+        auto &n = s.*Count;
+        return r.get(n) && size_t(n) <= Max;
+      } else {
+        return r.skip(sizeof(decltype(Count(s))));
+      }
+    }
+  };
+
+  // Counted list. Elems is a member array or a function returning a
+  // pointer to the elements (for data trailing a ZBOSS response). At most
+  // Max elements are written. Elements are copied raw unless an element
+  // schema is given. Only member arrays can be parsed into.
+  template <auto Count, auto Elems, size_t Max, typename ElemSchema = void>
+  struct list {
+    template <typename S> static void encode(writer &w, const S &s) {
+      size_t n = std::min<size_t>(detail::eval<Count>(s), Max);
+      const auto *elems = &detail::eval<Elems>(s)[0];
+      if constexpr (std::is_void_v<ElemSchema>) {
+        w.put(elems, n * sizeof(*elems));
+      } else {
+        for (size_t i = 0; i < n; ++i) {
+          ElemSchema::encode(w, elems[i]);
+        }
+      }
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      static_assert(std::is_member_object_pointer_v<decltype(Elems)>,
+                    "only member arrays can be parsed into");
+      auto &arr = s.*Elems;
+      size_t n = detail::eval<Count>(s);
+      if (n > Max || n > std::extent_v<std::remove_reference_t<decltype(arr)>>) {
+        return false;
+      }
+      if constexpr (std::is_void_v<ElemSchema>) {
+        return r.get(&arr[0], n * sizeof(arr[0]));
+      } else {
+        for (size_t i = 0; i < n; ++i) {
+          if (!ElemSchema::decode(r, arr[i])) {
+            return false;
+          }
+        }
+        return true;
+      }
+    }
+  };
+
+  template <typename... Fields> struct schema {
+    template <typename S> static void encode(writer &w, const S &s) {
+      (Fields::encode(w, s), ...);
+    }
+    template <typename S> static bool decode(reader &r, S &s) {
+      return (Fields::decode(r, s) && ...);
+    }
+
+    // Serializes s into out. Returns the written size, 0 if it did not fit.
+    template <typename S>
+    static size_t encode(uint8_t *out, size_t size, const S &s) {
+      writer w(out, size);
+      encode(w, s);
+      return w.size();
+    }
+    // Parses s from data. Trailing bytes are ignored.
+    template <typename S>
+    static bool decode(const void *data, size_t size, S &s) {
+      reader r(data, size);
+      return decode(r, s);
+    }
+  };
+
+}
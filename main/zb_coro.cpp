@@ -0,0 +1,190 @@
+#include "zb_coro.h"
+#include <atomic>
+#include <esp_log.h>
+
+static const char* TAG = "CORO";
+
+namespace zb_coro {
+
+  static_assert(FRAME_COUNT <= 32, "frame bitmap is 32 bit");
+
+  alignas(std::max_align_t) static uint8_t s_frames[FRAME_COUNT][FRAME_SIZE];
+  static std::atomic<uint32_t> s_frames_used{0};
+  static std::atomic<size_t> s_frames_max{0};
+
+  // Frames are claimed from the command task and released from the ZBOSS
+  // task, so the bitmap is updated lock-free.
+  void *frame_pool::allocate(size_t size) {
+    auto max = s_frames_max.load();
+    while (size > max) {
+      if (s_frames_max.compare_exchange_weak(max, size)) {
+        ESP_LOGI(TAG, "largest frame: %d of %d", int(size), int(FRAME_SIZE));
+        break;
+      }
+    }
+    if (size > FRAME_SIZE) {
+      ESP_LOGE(TAG, "frame too big: %d > %d", int(size), int(FRAME_SIZE));
+      return nullptr;
+    }
+    auto used = s_frames_used.load();
+    while (true) {
+      auto free = ~used;
+      if (FRAME_COUNT < 32) {
+        free &= (uint32_t(1) << FRAME_COUNT) - 1;
+      }
+      if (!free) {
+        ESP_LOGW(TAG, "no free frames");
+        return nullptr;
+      }
+      auto idx = __builtin_ctz(free);
+      if (s_frames_used.compare_exchange_weak(used, used | (uint32_t(1) << idx))) {
+        return s_frames[idx];
+      }
+    }
+  }
+
+  void frame_pool::release(void *frame) {
+    auto idx = (static_cast<uint8_t *>(frame) - &s_frames[0][0]) / FRAME_SIZE;
+    s_frames_used.fetch_and(~(uint32_t(1) << idx));
+  }
+
+  size_t frame_pool::used() {
+    return __builtin_popcount(s_frames_used.load());
+  }
+
+  size_t frame_pool::max_size() {
+    return s_frames_max.load();
+  }
+
+  // Waiters for zb_buf_get_out_delayed_ext. The slot index is passed as the
+  // callback parameter.
+  static std::atomic<buf_get_out *> s_buf_waiters[FRAME_COUNT];
+
+  bool buf_get_out::await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    for (uint16_t slot = 0; slot < FRAME_COUNT; ++slot) {
+      buf_get_out *expected = nullptr;
+      if (!s_buf_waiters[slot].compare_exchange_strong(expected, this)) {
+        continue;
+      }
+      auto ret = zb_buf_get_out_delayed_ext(&on_buffer, slot, m_max_size);
+      if (ret != RET_OK) {
+        s_buf_waiters[slot].store(nullptr);
+        return false;
+      }
+      // the frame may already be resumed from the ZBOSS task here
+      return true;
+    }
+    return false;
+  }
+
+  void buf_get_out::on_buffer(zb_bufid_t buf, zb_uint16_t slot) {
+    auto waiter = s_buf_waiters[slot].exchange(nullptr);
+    if (!waiter) {
+      ESP_LOGE(TAG, "no waiter for buffer slot %d", int(slot));
+      zb_buf_free(buf);
+      return;
+    }
+    waiter->m_buf = buf;
+    waiter->m_handle.resume();
+  }
+
+  static std::atomic<schedule *> s_sched_waiters[FRAME_COUNT];
+
+  bool schedule::await_suspend(std::coroutine_handle<> handle) {
+    m_handle = handle;
+    for (uint8_t slot = 0; slot < FRAME_COUNT; ++slot) {
+      schedule *expected = nullptr;
+      if (!s_sched_waiters[slot].compare_exchange_strong(expected, this)) {
+        continue;
+      }
+      m_scheduled = true;
+      auto ret = m_delay_ms
+          ? ZB_SCHEDULE_APP_ALARM(&on_scheduled, slot,
+                                  ZB_MILLISECONDS_TO_BEACON_INTERVAL(m_delay_ms))
+          : ZB_SCHEDULE_APP_CALLBACK(&on_scheduled, slot);
+      if (ret != RET_OK) {
+        m_scheduled = false;
+        s_sched_waiters[slot].store(nullptr);
+        return false;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void schedule::on_scheduled(zb_uint8_t slot) {
+    auto waiter = s_sched_waiters[slot].exchange(nullptr);
+    if (waiter) {
+      waiter->m_handle.resume();
+    }
+  }
+
+  // Every deadline belongs to a suspended coroutine, so there are at most
+  // FRAME_COUNT of them.
+  static deadline *s_deadlines[FRAME_COUNT];
+
+  bool deadline::arm(uint32_t timeout_ms, expire_fn fn, void *ctx) {
+    for (uint8_t slot = 0; slot < FRAME_COUNT; ++slot) {
+      if (s_deadlines[slot]) {
+        continue;
+      }
+      auto ret = ZB_SCHEDULE_APP_ALARM(&on_alarm, slot,
+                                       ZB_MILLISECONDS_TO_BEACON_INTERVAL(timeout_ms));
+      if (ret != RET_OK) {
+        return false;
+      }
+      s_deadlines[slot] = this;
+      m_fn = fn;
+      m_ctx = ctx;
+      m_slot = slot;
+      return true;
+    }
+    ESP_LOGW(TAG, "no free deadline slot");
+    return false;
+  }
+
+  void deadline::cancel() {
+    if (m_slot < 0) {
+      return;
+    }
+    ZB_SCHEDULE_APP_ALARM_CANCEL(&on_alarm, m_slot);
+    s_deadlines[m_slot] = nullptr;
+    m_slot = -1;
+  }
+
+  void deadline::on_alarm(zb_uint8_t slot) {
+    auto d = s_deadlines[slot];
+    if (!d) {
+      return;
+    }
+    s_deadlines[slot] = nullptr;
+    d->m_slot = -1;
+    d->m_fn(d->m_ctx);
+  }
+
+  zdo_waiters &zdo_request::waiters() {
+    static zdo_waiters s_waiters;
+    return s_waiters;
+  }
+
+  bool zdo_request::await_suspend(std::coroutine_handle<> handle) {
+    auto tsn = m_start(m_buf, &on_response);
+    if (tsn == 0xFF) {
+      zb_buf_free(m_buf);
+      return false;
+    }
+    m_key = tsn;
+    return zdo_waiters::awaiter::await_suspend(handle);
+  }
+
+  // Every ZDP response starts with the transaction sequence number.
+  void zdo_request::on_response(zb_uint8_t buf) {
+    auto tsn = *static_cast<const uint8_t *>(zb_buf_begin(buf));
+    if (!waiters().resume(tsn, buf)) {
+      ESP_LOGW(TAG, "not found request for zdo response %d", int(tsn));
+      zb_buf_free(buf);
+    }
+  }
+
+}
@@ -0,0 +1,256 @@
+#pragma once
+#include "zboss_decl.h"
+#include <coroutine>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+
+// Awaitable layer over the ZBOSS callback APIs.
+//
+// A command handler is written as one coroutine instead of a chain of
+// start / callback / finish functions sharing static state:
+//
+//   static zb_coro::task run(zb_ncp::cmd_t cmd, Arg arg) {
+//     auto buf = co_await zb_coro::buf_get_out(sizeof(Req));
+//     ...
+//     auto resp = co_await zb_coro::zdo_request(buf, &Cmd::start_request);
+//     ...
+//   }
+//
+// Coroutine frames are taken from a fixed pool, so every request in flight
+// keeps its own state and nothing touches the heap. Parameters must be passed
+// by value: the caller's buffers are gone after the first suspension.
+//
+// After the first co_await the coroutine runs in the ZBOSS context.
+
+namespace zb_coro {
+
+  // Large request payloads are kept in payload_arena, not in the frame.
+  // FRAME_SIZE is the largest frame of a 64-bit host build with some room;
+  // frames are smaller on the 32-bit target. The bound is checked when the
+  // firmware is built: the compiler knows each frame's size once the
+  // coroutine is lowered, and a larger one fails the build (see
+  // promise_type::operator new). frame_pool::max_size() (and the log line on
+  // every new maximum) gives the real figure at run time.
+  static constexpr size_t FRAME_SIZE = 320;
+  static constexpr size_t FRAME_COUNT = 24;
+
+  // Never defined: a call left after optimization is a build error.
+  [[gnu::error("coroutine frame larger than zb_coro::FRAME_SIZE")]]
+  void frame_too_big();
+
+  class frame_pool {
+  public:
+    static void *allocate(size_t size);
+    static void release(void *frame);
+    static size_t used();
+    // The largest frame requested since boot.
+    static size_t max_size();
+  };
+
+  // Fire-and-forget coroutine. It starts eagerly and its frame is released
+  // when the body finishes. Evaluates to false if no frame was available, in
+  // which case the body did not run at all.
+  class task {
+  public:
+    struct promise_type {
+      task get_return_object() { return task{true}; }
+      static task get_return_object_on_allocation_failure() {
+        return task{false};
+      }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { abort(); }
+
+      // The frame size is a constant in every coroutine's ramp, so with
+      // optimization on the check folds away or breaks the build. Without
+      // it, allocate() refuses the frame at run time.
+      [[gnu::always_inline]] static void *operator new(size_t size) noexcept {
+        if (__builtin_constant_p(size) && size > FRAME_SIZE) {
+          frame_too_big();
+        }
+        return frame_pool::allocate(size);
+      }
+      static void operator delete(void *frame) { frame_pool::release(frame); }
+    };
+
+    explicit operator bool() const { return m_started; }
+
+  private:
+    explicit task(bool started) : m_started(started) {}
+    bool m_started;
+  };
+
+  // co_await buf_get_out(size) -> zb_bufid_t, 0 if no buffer could be
+  // requested.
+  class buf_get_out {
+  public:
+    explicit buf_get_out(zb_uint_t max_size) : m_max_size(max_size) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    zb_bufid_t await_resume() const noexcept { return m_buf; }
+
+  private:
+    static void on_buffer(zb_bufid_t buf, zb_uint16_t slot);
+
+    zb_uint_t m_max_size;
+    zb_bufid_t m_buf = 0;
+    std::coroutine_handle<> m_handle;
+  };
+
+  // co_await schedule() -> continues in the ZBOSS context, after delay_ms
+  // when given. False if the callback could not be scheduled; the coroutine
+  // then continues in place.
+  class schedule {
+  public:
+    explicit schedule(uint32_t delay_ms = 0) : m_delay_ms(delay_ms) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() const noexcept { return m_scheduled; }
+
+  private:
+    static void on_scheduled(zb_uint8_t slot);
+
+    uint32_t m_delay_ms;
+    bool m_scheduled = false;
+    std::coroutine_handle<> m_handle;
+  };
+
+  // A time limit for an awaiter, run as a ZBOSS alarm. fn(ctx) is called
+  // in the ZBOSS context if the limit passes before cancel().
+  class deadline {
+  public:
+    using expire_fn = void (*)(void *ctx);
+
+    bool arm(uint32_t timeout_ms, expire_fn fn, void *ctx);
+    void cancel();
+
+  private:
+    static void on_alarm(zb_uint8_t slot);
+
+    expire_fn m_fn = nullptr;
+    void *m_ctx = nullptr;
+    int8_t m_slot = -1;
+  };
+
+  // Coroutines waiting for a ZBOSS callback identified by a small key
+  // (ZDP or ZCL transaction sequence number). Only used from the ZBOSS
+  // context, so no locking is needed.
+  //
+  // A waiter given a timeout is resumed with 0 and timed_out() set when its
+  // callback has not come by then; a late callback finds nobody waiting.
+  template <size_t N>
+  class keyed_waiters {
+  public:
+    class awaiter {
+    public:
+      awaiter(keyed_waiters &owner, uint16_t key, uint32_t timeout_ms = 0)
+          : m_owner(owner), m_key(key), m_timeout_ms(timeout_ms) {}
+
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> handle) {
+        m_handle = handle;
+        if (!m_owner.insert(this)) {
+          return false;
+        }
+        if (m_timeout_ms && !m_deadline.arm(m_timeout_ms, &expire, this)) {
+          m_owner.remove(this);
+          return false;
+        }
+        return true;
+      }
+      zb_bufid_t await_resume() const noexcept { return m_result; }
+      bool timed_out() const { return m_timed_out; }
+
+    protected:
+      friend class keyed_waiters;
+      keyed_waiters &m_owner;
+      uint16_t m_key;
+      uint32_t m_timeout_ms;
+      zb_bufid_t m_result = 0;
+      bool m_timed_out = false;
+      deadline m_deadline;
+      std::coroutine_handle<> m_handle;
+
+    private:
+      static void expire(void *ctx) {
+        auto waiter = static_cast<awaiter *>(ctx);
+        waiter->m_owner.remove(waiter);
+        waiter->m_timed_out = true;
+        waiter->m_handle.resume();
+      }
+    };
+
+    awaiter wait(uint16_t key, uint32_t timeout_ms = 0) {
+      return awaiter{*this, key, timeout_ms};
+    }
+
+    // Resumes the coroutine waiting for key with buf. Returns false if
+    // nobody waits for it; the buffer is left to the caller then.
+    bool resume(uint16_t key, zb_bufid_t buf) {
+      for (auto &w : m_waiters) {
+        if (w && w->m_key == key) {
+          auto waiter = w;
+          w = nullptr;
+          waiter->m_deadline.cancel();
+          waiter->m_result = buf;
+          waiter->m_handle.resume();
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    bool insert(awaiter *waiter) {
+      for (auto &w : m_waiters) {
+        if (!w) {
+          w = waiter;
+          return true;
+        }
+      }
+      return false;
+    }
+    void remove(awaiter *waiter) {
+      for (auto &w : m_waiters) {
+        if (w == waiter) {
+          w = nullptr;
+        }
+      }
+    }
+
+    awaiter *m_waiters[N] = {};
+  };
+
+  using zdo_waiters = keyed_waiters<FRAME_COUNT>;
+
+  // co_await zdo_request(buf, start) -> response buffer, 0 if the request
+  // could not be started (buf is released in that case) or timed_out().
+  // start is one of the zb_zdo_*_req functions or a wrapper with the same
+  // signature.
+  class zdo_request : public zdo_waiters::awaiter {
+  public:
+    using start_fn = zb_uint8_t (*)(zb_uint8_t param, zb_callback_t cb);
+
+    // ZBOSS answers a request itself when the device does not; this only
+    // keeps a lost callback from holding the frame for good.
+    static constexpr uint32_t TIMEOUT_MS = 30000;
+
+    zdo_request(zb_bufid_t buf, start_fn start)
+        : zdo_waiters::awaiter(waiters(), 0, TIMEOUT_MS), m_buf(buf),
+          m_start(start) {}
+
+    bool await_suspend(std::coroutine_handle<> handle);
+
+  private:
+    static zdo_waiters &waiters();
+    static void on_response(zb_uint8_t buf);
+
+    zb_bufid_t m_buf;
+    start_fn m_start;
+  };
+
+}
@@ -7,6 +7,15 @@
 #include <cctype>
 #include "commands_list.h"
 #include "ind_impl.h"
+#include "ind_sender.h"
+#include "ind_store.h"
+#include "ind_filter.h"
+#include "addr_cache.h"
+#include "desc_cache.h"
+#include "dev_stats.h"
+#include "response_cache.h"
+#include "ota_server.h"
+#include "fw_update.h"
 
 static const char* TAG = "NCP";
 
@@ -60,6 +69,9 @@ esp_err_t zb_ncp::init_int() {
     //zgp_disable();
 
     zb_add_simple_descriptor(&ep1);
+    desc_cache::init();
+    ota_server::init();
+    ind_store::init();
 
     m_channels_mask = zb_get_channel_mask();
     return ESP_OK;
@@ -76,6 +88,7 @@ static bool s_init_flag = false;
 
 void zb_ncp::ncp_zb_task(void* arg) {
 	zb_set_network_coordinator_role(0xffffff);
+	response_cache::invalidate(GET_ZIGBEE_ROLE);
 
     zboss_start_no_autostart();
 
@@ -119,8 +132,32 @@ const char* get_command_name(unsigned command_id) {
   return "not found";
 }
 
+template <command_id_t... Ids>
+bool zb_ncp::dispatch(const cmd_t& cmd, const void* buffer, size_t len) {
+  return ((cmd.command_id == Ids && (cmd_handle<Ids>::process(cmd, buffer, len), true)) || ...);
+}
+
+// Requests from the host, on the app task. The stack itself is driven by
+// ZBOSSDriver in-process; from the host only NCP_RESET and the vendor
+// commands are taken.
 void zb_ncp::on_rx_data(const void* data,size_t size) {
-  ESP_LOGD(TAG, "Removed function");
+  if (size < sizeof(cmd_t)) {
+    ESP_LOGE(TAG, "packet too short: %d", int(size));
+    return;
+  }
+  cmd_t cmd;
+  memcpy(&cmd, data, sizeof(cmd));
+  if (cmd.type != REQUEST) {
+    ESP_LOGW(TAG, "not a request: %d", int(cmd.type));
+    return;
+  }
+  auto buffer = static_cast<const uint8_t*>(data) + sizeof(cmd);
+#define COMMAND(Name, Val) , Name
+  bool handled = dispatch<NCP_RESET COMMANDS_LIST_VENDOR>(cmd, buffer, size - sizeof(cmd));
+#undef COMMAND
+  if (!handled) {
+    ESP_LOGD(TAG, "%s not taken from the host", get_command_name(cmd.command_id));
+  }
 }
 
 void zb_ncp::send_cmd_data(const void* data,size_t size) {
@@ -132,9 +169,147 @@ void zb_ncp::send_cmd_data(const void* data,size_t size) {
 	}
 }
 
+// Every handler of the list that coalesces its requests.
+template <command_id_t... Ids>
+void zb_ncp::coalesce_reset() {
+	([] {
+		if constexpr (requires { cmd_handle<Ids>::coalesce; }) {
+			if constexpr (cmd_handle<Ids>::coalesce) {
+				cmd_handle<Ids>::coalesce_reset();
+			}
+		}
+	}(), ...);
+}
+
+zb_coro::task zb_ncp::soft_reset_zboss() {
+	if (!co_await zb_coro::schedule()) {
+		ESP_LOGE(TAG,"soft reset: not scheduled");
+		co_return;
+	}
+	// Requests in flight in the stack (APS frames, ZDO requests) run to their
+	// end and answer with the old tsn, which the new session does not know.
+#define COMMAND(Name, Val) , Name
+	coalesce_reset<NCP_RESET COMMANDS_LIST_BASE>();
+#undef COMMAND
+	// The new host may know nothing of what the old one set up; everything
+	// a restart would clear goes back to its defaults.
+	ind_filter::clear();
+	ind_store::reset();
+	ind_sender::reset();
+	tx_sched::clear_classes();
+	desc_cache::reset();
+	ESP_LOGI(TAG,"soft reset done");
+}
+
+void zb_ncp::soft_reset() {
+	if (!soft_reset_zboss()) {
+		ESP_LOGE(TAG,"soft reset: no coroutine frame");
+	}
+}
+
 template<command_id_t CmdId, typename... TArgs>
 void zb_ncp::indication(const TArgs&... args) {
-  zb_ncp::ind_handle<CmdId>::m_callback(args...);
+  zb_ncp::ind_handle<CmdId>::dispatch(args...);
+}
+
+// APSDE-DATA.indication
+// [CommandId.APSDE_DATA_IND]: {
+//     request: [],
+//     response: [
+//         {name: 'paramLength', type: DataType.UINT8},
+//         {name: 'dataLength', type: DataType.UINT16},
+//         {name: 'apsFC', type: DataType.UINT8},
+//         {name: 'srcNwk', type: DataType.UINT16},
+//         {name: 'dstNwk', type: DataType.UINT16},
+//         {name: 'grpNwk', type: DataType.UINT16},
+//         {name: 'dstEndpoint', type: DataType.UINT8},
+//         {name: 'srcEndpoint', type: DataType.UINT8},
+//         {name: 'clusterID', type: DataType.UINT16},
+//         {name: 'profileID', type: DataType.UINT16},
+//         {name: 'apsCounter', type: DataType.UINT8},
+//         {name: 'srcMAC', type: DataType.UINT16},
+//         {name: 'dstMAC', type: DataType.UINT16},
+//         {name: 'lqi', type: DataType.UINT8},
+//         {name: 'rssi', type: DataType.INT8},
+//         {name: 'KeySrcAndAttr', type: DataType.UINT8},
+//         {name: 'data', type: BuffaloZclDataType.LIST_UINT8, options:
+//         (payload, options) => (options.length = payload.dataLength)},
+//     ],
+// },
+namespace apsde_data_ind {
+  using Ind = zb_apsde_data_indication_t;
+  static uint8_t key_src_and_attr(const Ind &ind) {
+    return ind.aps_key_source | (ind.aps_key_attrs << 1) |
+           (ind.aps_key_from_tc << 3);
+  }
+  using params_schema = wire::schema<
+      wire::field<&Ind::fc>, wire::field<&Ind::src_addr>,
+      wire::field<&Ind::dst_addr>, wire::field<&Ind::group_addr>,
+      wire::field<&Ind::dst_endpoint>, wire::field<&Ind::src_endpoint>,
+      wire::field<&Ind::clusterid>, wire::field<&Ind::profileid>,
+      wire::field<&Ind::aps_counter>, wire::field<&Ind::mac_src_addr>,
+      wire::field<&Ind::mac_dst_addr>, wire::field<&Ind::lqi>,
+      wire::field<&Ind::rssi>, wire::value<&key_src_and_attr>>;
+  static constexpr uint8_t PARAM_LENGTH = 21;
+
+  // from the ZBOSS context only, so one frame buffer does
+  static uint8_t s_out[3 + PARAM_LENGTH + zb_ncp::MAX_APS_PAYLOAD_SIZE];
+  static_assert(sizeof(s_out) <= ind_sender::MAX_IND_SIZE);
+
+  static void send(const Ind &ind, const uint8_t *data, uint16_t len) {
+    wire::writer w(s_out, sizeof(s_out));
+    w.put(PARAM_LENGTH);
+    w.put(len);
+    params_schema::encode(w, ind);
+    w.put(data, len);
+    if (!w.ok()) {
+      ESP_LOGE(TAG, "APSDE_DATA_IND too long: %d", int(len));
+      return;
+    }
+    ind_sender::send(APSDE_DATA_IND, s_out, w.size());
+  }
+}
+
+// Device announce, also held by ind_store while the host is away
+// [CommandId.ZDO_DEV_ANNCE_IND]: {
+//     request: [],
+//     response: [
+//         {name: 'nwk', type: DataType.UINT16},
+//         {name: 'ieee', type: DataType.IEEE_ADDR},
+//         {name: 'macCapabilities', type: DataType.UINT8},
+//     ],
+// },
+namespace dev_annce_ind {
+  using Ind = zb_zdo_signal_device_annce_params_t;
+  using schema = wire::schema<
+      wire::field<&Ind::device_short_addr>, wire::field<&Ind::ieee_addr>,
+      wire::field<&Ind::capability>>;
+
+  static void send(const Ind &ind) {
+    uint8_t out[2 + 8 + 1];
+    auto len = schema::encode(out, sizeof(out), ind);
+    ind_sender::send(ZDO_DEV_ANNCE_IND, out, len);
+  }
+}
+
+// Leave indication
+// [CommandId.NWK_LEAVE_IND]: {
+//     request: [],
+//     response: [
+//         {name: 'ieee', type: DataType.IEEE_ADDR},
+//         {name: 'rejoin', type: DataType.UINT8},
+//     ],
+// },
+namespace leave_ind {
+  using Ind = zb_zdo_signal_leave_indication_params_t;
+  using schema = wire::schema<wire::field<&Ind::device_addr>,
+                              wire::field<&Ind::rejoin>>;
+
+  static void send(const Ind &ind) {
+    uint8_t out[8 + 1];
+    auto len = schema::encode(out, sizeof(out), ind);
+    ind_sender::send(NWK_LEAVE_IND, out, len);
+  }
 }
 
 static zb_uint8_t data_indication(zb_bufid_t param) {
@@ -161,8 +336,24 @@ static zb_uint8_t data_indication(zb_bufid_t param) {
   // }
 
 
-  if (len <= 255) {
-      zb_ncp::indication<APSDE_DATA_IND>(*ind);
+  addr_cache::on_rx(ind->src_addr, ind->mac_src_addr == ind->src_addr, ind->lqi, ind->rssi);
+  if (!dev_stats::on_rx(*ind)) {
+    // APS retransmission of a frame already passed on
+    zb_buf_free(param);
+    return ZB_TRUE;
+  }
+  if (ota_server::on_rx(*ind, begin, len)) {
+    // OTA request answered from the cached image
+    zb_buf_free(param);
+    return ZB_TRUE;
+  }
+
+  // payloads longer than one APS frame arrive reassembled by ZBOSS
+  if (len <= zb_ncp::MAX_APS_PAYLOAD_SIZE) {
+      zb_ncp::indication<APSDE_DATA_IND>(*ind, begin, uint16_t(len));
+      if (ind_filter::pass(*ind, begin, len)) {
+        apsde_data_ind::send(*ind, begin, len);
+      }
   } else {
     ESP_LOGE(TAG,"too long packet");
   }
@@ -174,6 +365,9 @@ static zb_uint8_t data_indication(zb_bufid_t param) {
 void zb_ncp::continue_zboss(uint8_t arg) {
     ESP_LOGI(TAG,"continue_zboss");
     zb_af_set_data_indication(data_indication);
+    // confirms of frames sent by the NCP itself come through here too
+    zb_aps_set_user_data_tx_cb(&cmd_handle<APSDE_DATA_REQ>::aps_user_payload_callback);
+    fw_update::confirm_running();
 
     ESP_LOGI(TAG,"continue_zboss 1");
     // ncp_cmd_handle<S_ESP_NCP_NETWORK_INIT>::response(0);
@@ -184,6 +378,13 @@ void zb_ncp::continue_zboss(uint8_t arg) {
         if (!res) {
             cmd_handle<NWK_FORMATION>::response(GENERIC_ERROR);
         }
+    } else if (!zb_bdb_is_factory_new()) {
+        // warm start: the network in NVRAM is taken as it is, without
+        // commissioning; ZB_BDB_SIGNAL_DEVICE_REBOOT follows
+        zboss_start_continue();
+    } else if (cmd_handle<NWK_START_WITHOUT_FORMATION>::need_resolve()) {
+        ESP_LOGW(TAG,"no network in NVRAM");
+        cmd_handle<NWK_START_WITHOUT_FORMATION>::response(GENERIC_NOT_FOUND);
     } else {
         bdb_start_top_level_commissioning(ZB_BDB_NETWORK_STEERING);
     }
@@ -226,7 +427,10 @@ extern "C" void zboss_signal_handler(zb_uint8_t param)
     case ZB_ZDO_SIGNAL_DEVICE_ANNCE: {
         ESP_LOGD(TAG,"ZB_ZDO_SIGNAL_DEVICE_ANNCE");
         auto parameters = ZB_ZDO_SIGNAL_GET_PARAMS(sg_p,const zb_zdo_signal_device_annce_params_t);
+        addr_cache::update(parameters->ieee_addr, parameters->device_short_addr, &parameters->capability);
+        desc_cache::invalidate(parameters->ieee_addr, parameters->device_short_addr);
         zb_ncp::indication<ZDO_DEV_ANNCE_IND>(*parameters);
+        dev_annce_ind::send(*parameters);
     } break;
     case ZB_ZDO_SIGNAL_LEAVE: {
         auto parameters = ZB_ZDO_SIGNAL_GET_PARAMS(sg_p,const zb_zdo_signal_leave_params_t);
@@ -239,7 +443,12 @@ extern "C" void zboss_signal_handler(zb_uint8_t param)
     case ZB_ZDO_SIGNAL_LEAVE_INDICATION: {
         auto parameters = ZB_ZDO_SIGNAL_GET_PARAMS(sg_p,const zb_zdo_signal_leave_indication_params_t);
         ESP_LOGD(TAG,"ZB_ZDO_SIGNAL_LEAVE_INDICATION");
+        if (!parameters->rejoin) {
+            addr_cache::remove(parameters->device_addr);
+            dev_stats::remove(parameters->short_addr);
+        }
         zb_ncp::indication<NWK_LEAVE_IND>(*parameters);
+        leave_ind::send(*parameters);
     } break;
     case ZB_ZDO_DEVICE_UNAVAILABLE: {
         auto parameters = ZB_ZDO_SIGNAL_GET_PARAMS(sg_p,const zb_zdo_device_unavailable_params_t);
@@ -251,6 +460,12 @@ extern "C" void zboss_signal_handler(zb_uint8_t param)
         auto parameters = ZB_ZDO_SIGNAL_GET_PARAMS(sg_p,const zb_zdo_signal_device_update_params_t);
         ESP_LOGD(TAG,"addr: %04x status: %d parent: %04x",parameters->short_addr,int(parameters->status),parameters->parent_short);
 
+        if (parameters->status == 0x02) { // device left
+            addr_cache::remove(parameters->long_addr);
+            dev_stats::remove(parameters->short_addr);
+        } else {
+            addr_cache::update(parameters->long_addr, parameters->short_addr);
+        }
         zb_ncp::indication<ZDO_DEV_UPDATE_IND>(*parameters);
         // {name: 'ieee', type: DataType.IEEE_ADDR},
         // {name: 'nwk', type: DataType.UINT16},
@@ -265,6 +480,7 @@ extern "C" void zboss_signal_handler(zb_uint8_t param)
             int(parameters->authorization_type),int(parameters->authorization_status));
 
 
+        addr_cache::update(parameters->long_addr, parameters->short_addr);
         zb_ncp::indication<ZDO_DEV_AUTHORIZED_IND>(*parameters);
     } break;
 
@@ -1,6 +1,7 @@
 #pragma once
 #include "zboss_decl.h"
 #include "commands.h"
+#include "zb_coro.h"
 
 extern "C" void zboss_signal_handler(zb_uint8_t param);
 
@@ -17,7 +18,17 @@ public:
 		command_id_t command_id;
 		uint8_t tsn;
 	} __attribute__((packed));
+	// Indications carry no tsn.
+	struct ind_t {
+		uint8_t version;
+		frame_type_t type;
+		command_id_t command_id;
+	} __attribute__((packed));
 	static constexpr size_t MAX_PARALLEL_REQUESTS = 16;
+	// Largest APS payload passed either way. Longer than one APS frame, it is
+	// fragmented and reassembled by the ZBOSS APS layer (block transfer with
+	// windowed block acks), the host always sees one frame.
+	static constexpr size_t MAX_APS_PAYLOAD_SIZE = 1024;
 	static constexpr size_t ZB_TASK_STACK_SIZE = 1024 * 8;
 private:
 	template <command_id_t Cmd>
@@ -36,6 +47,8 @@ private:
 	struct general_status_arg;
 	template <command_id_t CmdId,typename Arg,typename Res>
 	struct general_status_arg_res;
+	template <command_id_t CmdId,typename Arg,typename Res>
+	struct cached_lookup_process;
 
   template<command_id_t CmdId>
   struct ind_handle;
@@ -48,6 +61,11 @@ private:
 	static void set_channel_mask(uint32_t mask);
 	static bool start_zigbee_stack();
 	static void ncp_zb_task(void* arg);
+	static zb_coro::task soft_reset_zboss();
+	template <command_id_t... Ids>
+	static bool dispatch(const cmd_t& cmd, const void* buffer, size_t len);
+	template <command_id_t... Ids>
+	static void coalesce_reset();
 
 private:
 	zb_ncp();
@@ -59,4 +77,7 @@ public:
   template<command_id_t CmdId, typename... TArgs>
 	static void indication(const TArgs&... args);
 	static void send_cmd_data(const void* data,size_t size);
+	// Second half of a soft NCP_RESET, from the app task once the link is
+	// reset: drops the host requests still waiting for a response.
+	static void soft_reset();
 };